@@ -0,0 +1,36 @@
+#!/bin/bash
+
+# Benchmarks the remainder tree engines on the same stored product tree.
+# The tree is built once, then Part (B) and Part (C) are run with each engine
+# (keeping the levels), and results are checked to match.
+#
+#   usage: scripts/bench_engines.sh [csv file] [threads] [batchgcd options]
+
+moduli=${1:-testdata/toy.moduli}
+threads=${2:-1}
+shift 2
+expected=$(mktemp -d)
+
+./batchgcd ingest $moduli -threads $threads "$@" > /dev/null || exit 1
+./batchgcd tree -threads $threads > /dev/null || exit 1
+
+for engine in squares cofactor dfs; do
+    start=$(date +%s.%N)
+    ./batchgcd remainders -engine $engine -keep-levels -threads $threads \
+        > /dev/null || exit 1
+    end=$(date +%s.%N)
+    ./batchgcd finalize -threads $threads > /dev/null || exit 1
+    total=$(date +%s.%N)
+    awk -v e=$engine -v s=$start -v m=$end -v t=$total 'BEGIN {
+        printf "%-10s Part (B) %8.3f s   Part (C) %8.3f s\n", e, m-s, t-m }'
+    for f in compromised.csv duplicates.csv; do
+        if [ $engine = squares ]; then
+            sort $f > $expected/$f
+        elif ! sort $f | cmp -s - $expected/$f; then
+            echo "FAILED: $f differs with engine $engine"
+            exit 1
+        fi
+    done
+done
+rm -rf $expected
+echo "OK, all engines agree"
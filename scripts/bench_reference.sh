@@ -0,0 +1,70 @@
+#!/bin/bash
+
+# Head-to-head benchmark of batchgcd against fastgcd, the implementation of
+# factorable.net, on the same generated corpus. Reports the time of each
+# phase (when the tool reports it), the peak RAM and the peak disk usage.
+#
+#   usage: scripts/bench_reference.sh [count] [bits] [threads]
+#
+# fastgcd is taken from $FASTGCD, or from the PATH; it is skipped if absent.
+# The corpus and all outputs are kept in $BENCH_DIR (default: data/bench).
+
+count=${1:-100000}
+bits=${2:-2048}
+threads=${3:-1}
+repo=$(cd "$(dirname "$0")/.." && pwd)
+work=${BENCH_DIR:-$repo/data/bench}
+fastgcd=${FASTGCD:-$(command -v fastgcd)}
+
+mkdir -p $work
+cd $work || exit 1
+corpus=corpus_${count}_${bits}.csv
+if [ ! -f $corpus ]; then
+    $repo/batchgcd generate $corpus $count $bits -threads $threads \
+        > /dev/null || exit 1
+fi
+$repo/batchgcd export-base16 $corpus -threads 1 > /dev/null || exit 1
+
+# measure <dir> <log> <command...> runs the command in <dir>, sampling its
+# peak RSS (VmHWM) and the size of <dir>, and sets 'seconds', 'rss_mb' and
+# 'disk_mb'.
+measure() {
+    local dir=$1 log=$2
+    shift 2
+    local start=$(date +%s.%N)
+    (cd $dir && exec "$@") > $log 2>&1 &
+    local pid=$! rss=0 disk=0
+    while kill -0 $pid 2> /dev/null; do
+        local hwm=$(awk '/VmHWM/ { print $2 }' /proc/$pid/status 2> /dev/null)
+        [ -n "$hwm" ] && [ $hwm -gt $rss ] && rss=$hwm
+        local used=$(du -sk $dir 2> /dev/null | cut -f1)
+        [ -n "$used" ] && [ $used -gt $disk ] && disk=$used
+        sleep 0.2
+    done
+    wait $pid || echo "warning: $* failed, see $log"
+    local end=$(date +%s.%N)
+    seconds=$(awk -v s=$start -v e=$end 'BEGIN { printf "%.2f", e-s }')
+    rss_mb=$((rss / 1024))
+    disk_mb=$((disk / 1024))
+}
+
+printf "%-10s %8s %10s %10s %10s %10s %9s %9s %6s\n" tool moduli "A (s)" \
+    "B (s)" "C (s)" "total (s)" "RAM (MB)" "disk (MB)" found
+
+rm -rf batchgcd_run && mkdir batchgcd_run
+measure batchgcd_run batchgcd.log $repo/batchgcd ../$corpus -threads $threads
+phases=($(grep "Time elapsed (s):" batchgcd.log | head -3 | awk '{ print $4 }'))
+found=$(cat batchgcd_run/compromised.csv batchgcd_run/duplicates.csv | wc -l)
+printf "%-10s %8s %10.2f %10.2f %10.2f %10s %9s %9s %6s\n" batchgcd $count \
+    ${phases[0]:-0} ${phases[1]:-0} ${phases[2]:-0} $seconds $rss_mb \
+    $disk_mb $found
+
+if [ -n "$fastgcd" ] && [ -x "$fastgcd" ]; then
+    rm -rf fastgcd_run && mkdir fastgcd_run
+    measure fastgcd_run fastgcd.log $fastgcd ../base16.moduli
+    found=$(wc -l < fastgcd_run/vulnerable_moduli)
+    printf "%-10s %8s %10s %10s %10s %10s %9s %9s %6s\n" fastgcd $count \
+        - - - $seconds $rss_mb $disk_mb $found
+else
+    echo "fastgcd not found (set FASTGCD=/path/to/fastgcd), skipped"
+fi
@@ -0,0 +1,26 @@
+#!/bin/bash
+
+# Runs batchgcd on the toy moduli from testdata/toy.arrow (the same records
+# as toy.moduli, as an Arrow IPC file) and checks that results match the run
+# on the csv file.
+
+toy_moduli=testdata/toy.moduli
+toy_arrow=testdata/toy.arrow
+expected=$(mktemp -d)
+
+echo 1 | ./batchgcd $toy_moduli > /dev/null || exit 1
+sort compromised.csv > $expected/compromised.csv
+sort duplicates.csv > $expected/duplicates.csv
+
+for threads in 1 4; do
+    echo "Running batchgcd on $toy_arrow with $threads threads"
+    ./batchgcd $toy_arrow -threads $threads > /dev/null || exit 1
+    for f in compromised.csv duplicates.csv; do
+        if ! sort $f | cmp -s - $expected/$f; then
+            echo "FAILED: $f differs with $threads threads"
+            exit 1
+        fi
+    done
+done
+rm -rf $expected
+echo "OK, Arrow results match the csv run"
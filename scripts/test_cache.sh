@@ -0,0 +1,39 @@
+#!/bin/bash
+
+# Runs batchgcd with the subtree cache on a synthetic corpus, then on the
+# same corpus plus 1% new moduli, as consecutive scans would. Checks that the
+# second run reads nodes of the upper levels (products of at least 32 leaves)
+# from the cache, and that its results match a run without the cache.
+
+work=$(mktemp -d)
+trap "rm -rf $work" EXIT
+
+./batchgcd generate $work/before.csv 5000 512 -threads 2 > /dev/null || exit 1
+./batchgcd generate $work/after.csv 5050 512 -threads 2 > /dev/null || exit 1
+
+./batchgcd $work/after.csv -threads 2 > /dev/null || exit 1
+sort compromised.csv > $work/compromised.csv
+sort duplicates.csv > $work/duplicates.csv
+
+for csv in before after; do
+    ./batchgcd $work/$csv.csv -threads 2 -cache $work/cache \
+        -cache-min-bits 1024 > $work/$csv.log || exit 1
+done
+for f in compromised.csv duplicates.csv; do
+    if ! sort $f | cmp -s - $work/$f; then
+        echo "FAILED: $f differs with the cache"
+        exit 1
+    fi
+done
+
+# Hits per level of the second run: level l is the product of 2^l leaves
+awk '/Multiplying/ {l++} /Subtree cache: [0-9]+ hits/ {print l, $3}' \
+    $work/after.log > $work/hits
+cat $work/hits | while read l hits; do
+    echo "Level $l: $hits cache hits"
+done
+if ! awk '$1 >= 5 && $2 > 0 {found=1} END {exit !found}' $work/hits; then
+    echo "FAILED: no cache hit above level 4"
+    exit 1
+fi
+echo "OK, the incremental run reuses upper subtrees"
@@ -0,0 +1,26 @@
+#!/bin/bash
+
+# Runs the MPI mode on the toy moduli with several amounts of ranks on this
+# host, and checks that results match the single-process run.
+
+toy_moduli=testdata/toy.moduli
+expected=$(mktemp -d)
+
+echo 1 | ./batchgcd $toy_moduli > /dev/null || exit 1
+sort compromised.csv > $expected/compromised.csv
+sort duplicates.csv > $expected/duplicates.csv
+
+# With one rank per modulus, each rank holds a single-level tree
+for np in 1 2 3 4 $(wc -l < $toy_moduli); do
+    echo "Running batchgcd_mpi with $np ranks"
+    mpirun $MPIRUN_FLAGS --oversubscribe -np $np \
+        ./batchgcd_mpi $toy_moduli -threads 1 > /dev/null || exit 1
+    for f in compromised.csv duplicates.csv; do
+        if ! sort $f | cmp -s - $expected/$f; then
+            echo "FAILED: $f differs with $np ranks"
+            exit 1
+        fi
+    done
+done
+rm -rf $expected
+echo "OK, MPI results match the single-process run"
@@ -14,3 +14,7 @@ echo "Now with the the same moduli, base 10:"
 cat $toy_moduli_10
 read -p "Press enter to continue"
 ./batchgcd $toy_moduli_10 -base10
+read -p "Press enter to continue "; echo ""
+
+echo "Now with the stored product tree, which small batches skip:"
+./batchgcd $toy_moduli -algorithm disk
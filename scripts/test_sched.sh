@@ -0,0 +1,45 @@
+#!/bin/bash
+
+# Runs a few jobs through the scheduler daemon, with 2 threads, and checks
+# that each job gets its own directory and the results of a direct run, and
+# that batchgcd follows a thread quota renegotiated while it runs.
+
+toy_moduli=testdata/toy.moduli
+work=$(mktemp -d)
+socket=$work/sched.sock
+
+echo 1 | ./batchgcd $toy_moduli > /dev/null || exit 1
+# Renegotiated quotas are read from the -threads-file before each level
+echo 2 > $work/threads
+./batchgcd $toy_moduli -algorithm disk -threads 1 -threads-file $work/threads \
+    | grep -q "Thread quota changed from 1 to 2" || {
+    echo "FAILED: thread quota not renegotiated"; rm -rf $work; exit 1; }
+sort compromised.csv > $work/compromised.csv
+sort duplicates.csv > $work/duplicates.csv
+
+./batchgcd_sched serve -threads 2 -socket $socket -jobs $work/jobs \
+    > $work/sched.log &
+daemon=$!
+trap "kill $daemon; rm -rf $work" EXIT
+while [ ! -S $socket ]; do sleep 0.1; done
+
+ids=""
+for args in "-priority 1 --" "--" "-threads 2 -- -engine dfs"; do
+    id=$(./batchgcd_sched submit -socket $socket $args $toy_moduli | \
+        awk '/^ok/ {print $2}')
+    [ -n "$id" ] || { echo "FAILED: job not accepted"; exit 1; }
+    ids="$ids $id"
+done
+./batchgcd_sched status -socket $socket
+
+for id in $ids; do
+    ./batchgcd_sched wait -socket $socket $id || {
+        cat $work/jobs/$id/log.txt; exit 1; }
+    for f in compromised.csv duplicates.csv; do
+        if ! sort $work/jobs/$id/$f | cmp -s - $work/$f; then
+            echo "FAILED: $f of job $id differs"
+            exit 1
+        fi
+    done
+done
+echo "OK, scheduled jobs match the direct run"
@@ -0,0 +1,581 @@
+#include "arrow_input.hpp"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <atomic>
+#include <cstring>
+#include <stdexcept>
+
+using std::cout;
+using std::endl;
+using std::min;
+using std::max;
+using std::to_string;
+
+/* Apache Arrow input
+ *
+ * Besides csv, the moduli can be read from Arrow IPC files (Feather V2,
+ * usually .arrow or .feather) and streams (.arrows), as written by the
+ * scanners which keep their keys in Arrow tables. The file is mapped in
+ * memory, and the leaves are imported directly from the column buffers:
+ *
+ *   - the IDs from ARROW_ID_COLUMN, of type utf8, binary (or their large
+ *     variants), fixed size binary or integer;
+ *   - the moduli from ARROW_MODULUS_COLUMN, of type binary, large binary or
+ *     fixed size binary, as unsigned big-endian bytes.
+ *
+ * When the default column is missing, the IDs are the first other column
+ * and the moduli the first binary column. Record batches are decoded
+ * concurrently by N_THREADS threads.
+ *
+ * Only what these columns need is implemented: the flatbuffer metadata
+ * (Schema.fbs, Message.fbs, File.fbs) is read by hand rather than with the
+ * Arrow library, the other columns must be flat (no list, struct, ...), and
+ * compressed record batches are not supported.
+ */
+string ARROW_ID_COLUMN = "id";
+string ARROW_MODULUS_COLUMN = "modulus";
+
+static const char ARROW_MAGIC[] = "ARROW1";
+static const uint32_t CONTINUATION = 0xFFFFFFFF;
+
+// Values of the Type union (Schema.fbs)
+enum arrow_type {
+    NULL_TYPE = 1, INT = 2, FLOATING_POINT = 3, BINARY = 4, UTF8 = 5,
+    BOOL = 6, DECIMAL = 7, DATE = 8, TIME = 9, TIMESTAMP = 10, INTERVAL = 11,
+    FIXED_SIZE_BINARY = 15, DURATION = 18, LARGE_BINARY = 19, LARGE_UTF8 = 20
+};
+
+// Values of the MessageHeader union (Message.fbs)
+enum arrow_message {
+    SCHEMA_MESSAGE = 1, DICTIONARY_MESSAGE = 2, RECORD_BATCH_MESSAGE = 3
+};
+
+// MetadataVersion V4, the first with the current layout
+static const int16_t METADATA_V4 = 3;
+
+// load reads a little-endian value of the mapped file at 'at'.
+template <class T> static T load(const uint8_t *data, size_t size, size_t at) {
+    if (at > size || size - at < sizeof(T)) {
+        throw std::runtime_error("truncated metadata");
+    }
+    T value;
+    memcpy(&value, data + at, sizeof(T));
+    return value;
+}
+
+/* flat_table reads a table of a flatbuffer within the mapped file. Its fields
+ * are located by its vtable, at a signed offset from the table; all
+ * positions are from the start of the file and checked against its size.
+ */
+struct flat_table {
+    const uint8_t *data;
+    size_t size, pos, vtable;
+    uint16_t vtable_size;
+
+    flat_table(const uint8_t *data, size_t size, size_t pos);
+
+    template <class T> T load(size_t at) const {
+        return ::load<T>(data, size, at);
+    }
+
+    // Position of the field, or 0 if absent
+    size_t field(int slot) const {
+        size_t entry = 4 + 2 * slot;
+        if (entry + 2 > vtable_size) return 0;
+        uint16_t offset = load<uint16_t>(vtable + entry);
+        return offset ? pos + offset : 0;
+    }
+
+    template <class T> T scalar(int slot, T default_value) const {
+        size_t at = field(slot);
+        return at ? load<T>(at) : default_value;
+    }
+
+    // Position referenced by the offset field at 'at'
+    size_t follow(size_t at) const {
+        return at + load<uint32_t>(at);
+    }
+
+    bool has(int slot) const { return field(slot) != 0; }
+
+    flat_table table(int slot) const {
+        if (!has(slot)) throw std::runtime_error("missing metadata");
+        return flat_table(data, size, follow(field(slot)));
+    }
+
+    // Position of the first element of a vector field, and its length
+    size_t vector(int slot, size_t *length) const {
+        *length = 0;
+        if (!has(slot)) return 0;
+        size_t at = follow(field(slot));
+        *length = load<uint32_t>(at);
+        return at + 4;
+    }
+
+    string str(int slot) const {
+        size_t length;
+        size_t at = vector(slot, &length);
+        if (at + length > size) throw std::runtime_error("truncated metadata");
+        return string(reinterpret_cast<const char *>(data + at), length);
+    }
+};
+
+flat_table::flat_table(const uint8_t *data, size_t size, size_t pos)
+    : data(data), size(size), pos(pos), vtable(0), vtable_size(0) {
+    vtable = pos - load<int32_t>(pos);
+    vtable_size = load<uint16_t>(vtable);
+}
+
+// A top-level column of the schema
+struct arrow_column {
+    string name;
+    int type;
+    // Bytes of a value of a fixed size type (bits / 8 for integers)
+    int width;
+    bool is_signed, dictionary;
+};
+
+// buffers returns the amount of buffers of the column in a record batch, or
+// -1 for the nested types, which are not supported.
+static int buffers(const arrow_column &column) {
+    if (column.dictionary) return 2;
+    switch (column.type) {
+        case NULL_TYPE:
+            return 0;
+        case BINARY: case UTF8: case LARGE_BINARY: case LARGE_UTF8:
+            return 3;
+        case INT: case FLOATING_POINT: case BOOL: case DECIMAL: case DATE:
+        case TIME: case TIMESTAMP: case INTERVAL: case FIXED_SIZE_BINARY:
+        case DURATION:
+            return 2;
+        default:
+            return -1;
+    }
+}
+
+static bool is_binary(const arrow_column &column) {
+    return !column.dictionary && (column.type == BINARY ||
+            column.type == LARGE_BINARY || column.type == FIXED_SIZE_BINARY);
+}
+
+static bool is_id(const arrow_column &column) {
+    if (column.dictionary) return false;
+    if (column.type == INT) return column.width >= 1 && column.width <= 8;
+    return column.type == UTF8 || column.type == LARGE_UTF8 ||
+        is_binary(column);
+}
+
+// The position of a record batch in the file, and its first row
+struct arrow_batch {
+    size_t metadata, body, first_row, rows;
+};
+
+/* arrow_file maps an Arrow IPC file or stream, and reads its schema and the
+ * positions of its record batches.
+ */
+struct arrow_file {
+    string filename;
+    const uint8_t *data;
+    size_t size, rows;
+    vector<arrow_column> columns;
+    vector<arrow_batch> batches;
+
+    explicit arrow_file(string filename);
+    ~arrow_file();
+
+ private:
+    void read_schema(const flat_table &schema);
+    void add_batch(const flat_table &message, size_t body);
+    bool read_message(size_t offset, size_t *message, size_t *body,
+            size_t *next);
+};
+
+arrow_file::arrow_file(string filename)
+    : filename(filename), data(nullptr), size(0), rows(0) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    struct stat status;
+    if (fd < 0 || fstat(fd, &status) != 0) {
+        throw std::runtime_error("cannot open file");
+    }
+    size = status.st_size;
+    if (size > 0) {
+        void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) throw std::runtime_error("cannot map file");
+        data = static_cast<const uint8_t *>(map);
+    }
+    close(fd);
+    size_t magic = strlen(ARROW_MAGIC);
+    if (size >= magic && memcmp(data, ARROW_MAGIC, magic) == 0) {
+        // File format: the footer holds the schema and the record batches
+        size_t tail = magic + 4;
+        if (size < 8 + tail ||
+                memcmp(data + size - magic, ARROW_MAGIC, magic) != 0) {
+            throw std::runtime_error("truncated file");
+        }
+        uint32_t length;
+        memcpy(&length, data + size - tail, 4);
+        if (length > size - tail - 8) {
+            throw std::runtime_error("truncated footer");
+        }
+        size_t footer_start = size - tail - length;
+        flat_table footer(data, size, footer_start +
+                load<uint32_t>(data, size, footer_start));
+        read_schema(footer.table(1));
+        size_t count;
+        size_t block = footer.vector(3, &count);
+        for (size_t k = 0; k < count; k++, block += 24) {
+            // struct Block { offset: long; metaDataLength: int; bodyLength:
+            // long; }
+            size_t offset = footer.load<int64_t>(block);
+            size_t message, body, next;
+            if (!read_message(offset, &message, &body, &next)) {
+                throw std::runtime_error("missing record batch");
+            }
+            add_batch(flat_table(data, size, message), body);
+        }
+    } else {
+        // Stream format: schema message, then dictionaries and record
+        // batches until the end-of-stream marker (or the end of the file)
+        size_t offset = 0, message, body;
+        bool schema = false;
+        while (offset < size && read_message(offset, &message, &body,
+                    &offset)) {
+            flat_table header(data, size, message);
+            uint8_t type = header.scalar<uint8_t>(1, 0);
+            if (type == SCHEMA_MESSAGE) {
+                read_schema(header.table(2));
+                schema = true;
+            } else if (type == RECORD_BATCH_MESSAGE) {
+                if (!schema) throw std::runtime_error("missing schema");
+                add_batch(header, body);
+            }
+        }
+        if (!schema) throw std::runtime_error("missing schema");
+    }
+}
+
+// read_message returns false at the end-of-stream marker.
+bool arrow_file::read_message(size_t offset, size_t *message, size_t *body,
+        size_t *next) {
+    // Pre-0.15 streams have no continuation marker
+    uint32_t length = load<uint32_t>(data, size, offset);
+    offset += 4;
+    if (length == CONTINUATION) {
+        length = load<uint32_t>(data, size, offset);
+        offset += 4;
+    }
+    if (length == 0) return false;
+    if (length > size - offset) throw std::runtime_error("truncated message");
+    *message = offset + load<uint32_t>(data, size, offset);
+    flat_table header(data, size, *message);
+    if (header.scalar<int16_t>(0, 0) < METADATA_V4) {
+        throw std::runtime_error("metadata older than V4");
+    }
+    *body = offset + length;
+    int64_t body_length = header.scalar<int64_t>(3, 0);
+    if (body_length < 0 || static_cast<size_t>(body_length) > size - *body) {
+        throw std::runtime_error("truncated message body");
+    }
+    *next = *body + body_length;
+    return true;
+}
+
+void arrow_file::read_schema(const flat_table &schema) {
+    if (schema.scalar<int16_t>(0, 0) != 0) {
+        throw std::runtime_error("big-endian data");
+    }
+    columns.clear();
+    size_t count;
+    size_t at = schema.vector(1, &count);
+    for (size_t k = 0; k < count; k++, at += 4) {
+        flat_table field(schema.data, size, schema.follow(at));
+        arrow_column column;
+        column.name = field.str(0);
+        column.type = field.scalar<uint8_t>(2, 0);
+        column.width = 0;
+        column.is_signed = false;
+        column.dictionary = field.has(4);
+        if (column.type == INT) {
+            flat_table type = field.table(3);
+            column.width = type.scalar<int32_t>(0, 0) / 8;
+            column.is_signed = type.scalar<uint8_t>(1, 0);
+        } else if (column.type == FIXED_SIZE_BINARY) {
+            column.width = field.table(3).scalar<int32_t>(0, 0);
+        }
+        size_t children;
+        field.vector(5, &children);
+        if (children) column.type = 0;
+        columns.push_back(column);
+    }
+}
+
+void arrow_file::add_batch(const flat_table &message, size_t body) {
+    if (message.scalar<uint8_t>(1, 0) != RECORD_BATCH_MESSAGE) {
+        throw std::runtime_error("unexpected message");
+    }
+    flat_table batch = message.table(2);
+    if (batch.has(3)) {
+        throw std::runtime_error("compressed record batches are not "
+                "supported");
+    }
+    int64_t length = batch.scalar<int64_t>(0, 0);
+    if (length < 0) throw std::runtime_error("negative length");
+    batches.push_back({batch.pos, body, rows, static_cast<size_t>(length)});
+    rows += length;
+}
+
+arrow_file::~arrow_file() {
+    if (data) munmap(const_cast<uint8_t *>(data), size);
+}
+
+/* column_values locates the buffers of a column in a record batch, and reads
+ * its values.
+ */
+struct column_values {
+    const arrow_column *column;
+    const uint8_t *validity, *offsets, *values;
+    size_t values_size, rows;
+    int64_t null_count;
+
+    column_values(const arrow_file &file, const arrow_batch &batch,
+            size_t index);
+
+    bool valid(size_t i) const {
+        if (null_count == 0 || !validity) return true;
+        return (validity[i / 8] >> (i % 8)) & 1;
+    }
+
+    // bytes points to the value of row i of a binary or utf8 column.
+    size_t bytes(size_t i, const uint8_t **value) const {
+        size_t begin, end;
+        if (column->type == FIXED_SIZE_BINARY) {
+            begin = i * column->width;
+            end = begin + column->width;
+        } else if (column->type == LARGE_BINARY ||
+                column->type == LARGE_UTF8) {
+            int64_t bounds[2];
+            memcpy(bounds, offsets + 8 * i, 16);
+            begin = bounds[0];
+            end = bounds[1];
+        } else {
+            int32_t bounds[2];
+            memcpy(bounds, offsets + 4 * i, 8);
+            begin = bounds[0];
+            end = bounds[1];
+        }
+        if (begin > end || end > values_size) {
+            throw std::runtime_error("value out of its buffer");
+        }
+        *value = values + begin;
+        return end - begin;
+    }
+
+    string id(size_t i) const {
+        if (!valid(i)) return "";
+        if (column->type != INT) {
+            const uint8_t *value;
+            size_t length = bytes(i, &value);
+            return string(reinterpret_cast<const char *>(value), length);
+        }
+        uint64_t x = 0;
+        memcpy(&x, values + i * column->width, column->width);
+        if (column->is_signed && column->width < 8 &&
+                (x >> (8 * column->width - 1))) {
+            x |= ~0ULL << (8 * column->width);
+        }
+        return column->is_signed ? to_string(static_cast<int64_t>(x)) :
+            to_string(x);
+    }
+};
+
+column_values::column_values(const arrow_file &file, const arrow_batch &batch,
+        size_t index)
+    : column(&file.columns[index]), validity(nullptr), offsets(nullptr),
+      values(nullptr), values_size(0), rows(batch.rows), null_count(0) {
+    flat_table header(file.data, file.size, batch.metadata);
+    // Buffers of the columns before this one
+    size_t first = 0;
+    for (size_t k = 0; k < index; k++) {
+        int count = buffers(file.columns[k]);
+        if (count < 0) {
+            throw std::runtime_error("nested column " + file.columns[k].name);
+        }
+        first += count;
+    }
+    size_t count;
+    size_t node = header.vector(1, &count);
+    if (index >= count) throw std::runtime_error("missing field node");
+    // struct FieldNode { length: long; null_count: long; }
+    if (header.load<int64_t>(node + 16 * index) !=
+            static_cast<int64_t>(rows)) {
+        throw std::runtime_error("column shorter than its record batch");
+    }
+    null_count = header.load<int64_t>(node + 16 * index + 8);
+    size_t buffer = header.vector(2, &count);
+    if (first + buffers(*column) > count) {
+        throw std::runtime_error("missing buffer");
+    }
+    // struct Buffer { offset: long; length: long; }, from the body
+    const uint8_t *located[3];
+    size_t sizes[3];
+    for (int k = 0; k < buffers(*column); k++) {
+        size_t offset = header.load<int64_t>(buffer + 16 * (first + k));
+        size_t length = header.load<int64_t>(buffer + 16 * (first + k) + 8);
+        if (offset > file.size - batch.body ||
+                length > file.size - batch.body - offset) {
+            throw std::runtime_error("buffer out of the file");
+        }
+        located[k] = file.data + batch.body + offset;
+        sizes[k] = length;
+    }
+    if (sizes[0] > 0) {
+        if (sizes[0] < (rows + 7) / 8) {
+            throw std::runtime_error("short validity bitmap");
+        }
+        validity = located[0];
+    }
+    size_t width = column->width;
+    if (buffers(*column) == 3) {
+        offsets = located[1];
+        width = (column->type == LARGE_BINARY || column->type == LARGE_UTF8) ?
+            8 : 4;
+        if (sizes[1] < (rows + 1) * width) {
+            throw std::runtime_error("short offsets buffer");
+        }
+        values = located[2];
+        values_size = sizes[2];
+    } else {
+        values = located[1];
+        values_size = sizes[1];
+        if (values_size < rows * width) {
+            throw std::runtime_error("short values buffer");
+        }
+    }
+}
+
+static size_t select_column(const arrow_file &file, string name,
+        string default_name, bool modulus, size_t other) {
+    for (size_t k = 0; k < file.columns.size(); k++) {
+        if (file.columns[k].name == name) return k;
+    }
+    if (name != default_name) {
+        throw std::runtime_error("no column named " + name);
+    }
+    for (size_t k = 0; k < file.columns.size(); k++) {
+        const arrow_column &column = file.columns[k];
+        if (k != other && (modulus ? is_binary(column) : is_id(column))) {
+            return k;
+        }
+    }
+    throw std::runtime_error(modulus ? "no binary column" : "no ID column");
+}
+
+// is_arrow_file returns true if the file starts as an Arrow file or stream.
+bool is_arrow_file(string filename) {
+    FILE* file = fopen(filename.c_str(), "rb");
+    if (!file) return false;
+    char start[6];
+    size_t read = fread(start, 1, sizeof(start), file);
+    fclose(file);
+    if (read >= 6 && memcmp(start, ARROW_MAGIC, 6) == 0) return true;
+    uint32_t marker;
+    memcpy(&marker, start, 4);
+    return read >= 4 && marker == CONTINUATION;
+}
+
+[[noreturn]] static void arrow_error(string filename, string what) {
+    cout << "ERROR: Cannot process moduli file " << filename << " (" << what;
+    cout << ")" << endl;
+    exit(1);
+}
+
+/* read_moduli_range_from_arrow is read_moduli_range_from_csv for Arrow files:
+ * it stores the moduli and IDs of the rows in [first, last).
+ */
+void read_moduli_range_from_arrow(
+        string filename,
+        vector<mpz_class> *moduli,
+        vector<string>*IDs,
+        size_t first,
+        size_t last) {
+    cout << "Reading moduli from " << filename << " (Arrow)" << endl;
+    try {
+        arrow_file file(filename);
+        size_t modulus = select_column(file, ARROW_MODULUS_COLUMN, "modulus",
+                true, SIZE_MAX);
+        size_t id = select_column(file, ARROW_ID_COLUMN, "id", false,
+                modulus);
+        if (!is_binary(file.columns[modulus])) {
+            throw std::runtime_error("column " + file.columns[modulus].name +
+                    " is not binary");
+        }
+        const arrow_column &ids = file.columns[id];
+        if (!is_id(ids)) {
+            throw std::runtime_error("unsupported type of column " + ids.name);
+        }
+        cout << "Columns " << ids.name << " (IDs) and ";
+        cout << file.columns[modulus].name << " (moduli), ";
+        cout << file.batches.size() << " record batches" << endl;
+        first = min(first, file.rows);
+        last = min(last, file.rows);
+        size_t start = moduli->size();
+        moduli->resize(start + last - first);
+        IDs->resize(start + last - first);
+        // Each thread decodes whole record batches
+        std::atomic<size_t> next(0);
+        boost::mutex mutex;
+        string error;
+        vector<boost::thread> threads;
+        for (int t = 0; t < max(1, N_THREADS); t++) {
+            threads.push_back(boost::thread([&]() {
+                size_t b;
+                while ((b = next++) < file.batches.size()) {
+                    const arrow_batch &batch = file.batches[b];
+                    size_t begin = max(first, batch.first_row);
+                    size_t end = min(last, batch.first_row + batch.rows);
+                    if (begin >= end) continue;
+                    try {
+                        column_values X(file, batch, modulus);
+                        column_values ID(file, batch, id);
+                        for (size_t r = begin; r < end; r++) {
+                            size_t i = r - batch.first_row;
+                            size_t k = start + r - first;
+                            (*IDs)[k] = ID.id(i);
+                            const uint8_t *value;
+                            size_t length = X.valid(i) ? X.bytes(i, &value) :
+                                0;
+                            if (length) {
+                                mpz_import((*moduli)[k].get_mpz_t(), length,
+                                        1, 1, 1, 0, value);
+                            }
+                            if ((*moduli)[k] == 0) {
+                                throw std::runtime_error("modulus with id " +
+                                        (*IDs)[k] + " equals 0");
+                            }
+                        }
+                    } catch (const std::runtime_error &e) {
+                        boost::lock_guard<boost::mutex> lock(mutex);
+                        if (error == "") error = e.what();
+                    }
+                }
+                }));
+        }
+        for (auto& th : threads)
+            th.join();
+        if (error != "") throw std::runtime_error(error);
+    } catch (const std::runtime_error &e) {
+        arrow_error(filename, e.what());
+    }
+    cout << "Done. Read " << moduli->size() << " moduli" << endl;
+}
+
+// count_moduli_in_arrow returns the amount of rows of the given file.
+size_t count_moduli_in_arrow(string filename) {
+    try {
+        return arrow_file(filename).rows;
+    } catch (const std::runtime_error &e) {
+        arrow_error(filename, e.what());
+    }
+}
@@ -0,0 +1,15 @@
+#ifndef SRC_ARROW_INPUT_HPP_
+#define SRC_ARROW_INPUT_HPP_
+
+#include "utils.hpp"
+
+// Columns of the IDs and of the moduli (see -arrow-columns)
+extern string ARROW_ID_COLUMN;
+extern string ARROW_MODULUS_COLUMN;
+
+bool is_arrow_file(string);
+void read_moduli_range_from_arrow(string, vector<mpz_class>*, vector<string>*,
+        size_t, size_t);
+size_t count_moduli_in_arrow(string);
+
+#endif /* SRC_ARROW_INPUT_HPP_ */
@@ -0,0 +1,328 @@
+#include "backend.hpp"
+#include "tuner.hpp"
+#include "ntt.hpp"
+#include <array>
+#include <mutex>
+#ifdef BATCHGCD_FLINT
+#include <flint/flint.h>
+#include <flint/fmpz.h>
+#endif
+
+using std::cout;
+using std::endl;
+using std::to_string;
+
+/* Big-integer backends
+ *
+ * The op_* functions (opstats.cpp) run the arithmetic of the tree engines
+ * through a bigint_backend:
+ *
+ *   gmp     mpz_* of the (patched) GMP, always built and the default;
+ *   ntt     products and squares of operands of at least NTT_MIN_BITS by the
+ *           multi-threaded, vectorized NTT of ntt.cpp, the rest by GMP;
+ *   flint   fmpz_* of FLINT, built with 'make FLINT=1'. Its products of very
+ *           large integers (flint_mpn_mul) run on several threads.
+ *
+ * The last two help the top of the tree, where a level holds fewer products
+ * than cores.
+ *
+ * -backend picks one for all operations, or "auto" the fastest for each
+ * operation and operand size, as measured by 'batchgcd tune'
+ * (calibrate_backends) and stored in the host profile under
+ * backend_<op>_<b> for operands of about 2^b bits; smaller sizes than
+ * measured use gmp, and larger ones the choice of the largest size measured.
+ * Integers are serialized in the GMP raw format whatever the backend, so that
+ * stored trees are interchangeable.
+ */
+string BACKEND = "gmp";
+
+const char *OP_NAMES[OP_KINDS] = {"mul", "sqr", "mod", "divexact", "gcd"};
+
+static const int BUCKETS = 64;
+
+static void gmp_mul(mpz_ptr rop, mpz_srcptr a, mpz_srcptr b) {
+    mpz_mul(rop, a, b);
+}
+
+static void gmp_sqr(mpz_ptr rop, mpz_srcptr a) {
+    mpz_mul(rop, a, a);
+}
+
+static size_t gmp_out_raw(FILE *file, mpz_srcptr x) {
+    return mpz_out_raw(file, x);
+}
+
+static size_t gmp_inp_raw(mpz_ptr x, FILE *file) {
+    return mpz_inp_raw(x, file);
+}
+
+static const bigint_backend GMP_BACKEND = {"gmp", gmp_mul, gmp_sqr, mpz_mod,
+    mpz_divexact, mpz_gcd, gmp_out_raw, gmp_inp_raw};
+
+static const bigint_backend NTT_BACKEND = {"ntt", ntt_mul, ntt_sqr, mpz_mod,
+    mpz_divexact, mpz_gcd, gmp_out_raw, gmp_inp_raw};
+
+#ifdef BATCHGCD_FLINT
+/* flint_view is a read-only fmpz_t over the limbs of an mpz_t, and
+ * flint_result an fmpz_t whose value is moved to an mpz_t (swapped, when
+ * FLINT holds it as an mpz), so that operands are not copied between the
+ * two representations.
+ */
+struct flint_view {
+    fmpz_t value;
+
+    explicit flint_view(mpz_srcptr x) { fmpz_init_set_readonly(value, x); }
+    ~flint_view() { fmpz_clear_readonly(value); }
+};
+
+struct flint_result {
+    fmpz_t value;
+
+    flint_result() { fmpz_init(value); }
+    ~flint_result() { fmpz_clear(value); }
+
+    void move_to(mpz_ptr rop) {
+        if (COEFF_IS_MPZ(*value)) {
+            mpz_swap(rop, COEFF_TO_PTR(*value));
+        } else {
+            fmpz_get_mpz(rop, value);
+        }
+    }
+};
+
+/* flint_threads lets FLINT split the operations of the calling thread on up
+ * to N_THREADS threads (the setting is per thread).
+ */
+static void flint_threads() {
+    static thread_local bool done = false;
+    if (!done) {
+        flint_set_num_threads(std::max(1, N_THREADS));
+        done = true;
+    }
+}
+
+static void flint_mul(mpz_ptr rop, mpz_srcptr a, mpz_srcptr b) {
+    flint_threads();
+    flint_view x(a), y(b);
+    flint_result z;
+    fmpz_mul(z.value, x.value, y.value);
+    z.move_to(rop);
+}
+
+static void flint_sqr(mpz_ptr rop, mpz_srcptr a) {
+    flint_threads();
+    flint_view x(a);
+    flint_result z;
+    fmpz_mul(z.value, x.value, x.value);
+    z.move_to(rop);
+}
+
+static void flint_mod(mpz_ptr rop, mpz_srcptr a, mpz_srcptr b) {
+    flint_threads();
+    flint_view x(a), y(b);
+    flint_result z;
+    fmpz_mod(z.value, x.value, y.value);
+    z.move_to(rop);
+}
+
+static void flint_divexact(mpz_ptr rop, mpz_srcptr a, mpz_srcptr b) {
+    flint_threads();
+    flint_view x(a), y(b);
+    flint_result z;
+    fmpz_divexact(z.value, x.value, y.value);
+    z.move_to(rop);
+}
+
+static void flint_gcd(mpz_ptr rop, mpz_srcptr a, mpz_srcptr b) {
+    flint_view x(a), y(b);
+    flint_result z;
+    fmpz_gcd(z.value, x.value, y.value);
+    z.move_to(rop);
+}
+
+static const bigint_backend FLINT_BACKEND = {"flint", flint_mul, flint_sqr,
+    flint_mod, flint_divexact, flint_gcd, gmp_out_raw, gmp_inp_raw};
+#endif
+
+static const vector<const bigint_backend *> BACKENDS = {&GMP_BACKEND,
+    &NTT_BACKEND,
+#ifdef BATCHGCD_FLINT
+    &FLINT_BACKEND,
+#endif
+};
+
+// find_backend returns the built backend 'name', or nullptr.
+const bigint_backend *find_backend(string name) {
+    for (const bigint_backend *backend : BACKENDS) {
+        if (name == backend->name) return backend;
+    }
+    return nullptr;
+}
+
+// backend_names returns the names of the backends built in.
+vector<string> backend_names() {
+    vector<string> names;
+    for (const bigint_backend *backend : BACKENDS) {
+        names.push_back(backend->name);
+    }
+    return names;
+}
+
+// check_backend returns true if 'name' is a built backend, or "auto".
+bool check_backend(string name) {
+    return name == "auto" || find_backend(name) != nullptr;
+}
+
+// The backend of all operations, or nullptr for "auto", and the per-size
+// choices of "auto" for each operation
+static const bigint_backend *fixed = &GMP_BACKEND;
+static std::array<std::array<const bigint_backend *, BUCKETS>, OP_KINDS>
+    by_bucket;
+static std::once_flag selection_loaded;
+
+static void load_selection() {
+    for (auto &choices : by_bucket) choices.fill(&GMP_BACKEND);
+    if (BACKEND != "auto") {
+        fixed = find_backend(BACKEND);
+        if (!fixed) fixed = &GMP_BACKEND;
+        return;
+    }
+    fixed = nullptr;
+    std::map<string, string> profile = read_key_value_file(profile_file());
+    for (int op = 0; op < OP_KINDS; op++) {
+        const bigint_backend *largest = &GMP_BACKEND;
+        for (int b = 0; b < BUCKETS; b++) {
+            auto it = profile.find("backend_" + string(OP_NAMES[op]) + "_" +
+                    to_string(b));
+            if (it != profile.end() && find_backend(it->second)) {
+                largest = find_backend(it->second);
+            }
+            by_bucket[op][b] = largest;
+        }
+    }
+}
+
+/* backend_for returns the backend of operation 'op' on a and b, which is the
+ * same for all operations unless BACKEND is "auto".
+ */
+const bigint_backend *backend_for(op_kind op, mpz_srcptr a, mpz_srcptr b) {
+    std::call_once(selection_loaded, load_selection);
+    if (fixed) return fixed;
+    size_t bits = std::max(mpz_size(a), mpz_size(b)) * GMP_NUMB_BITS;
+    int bucket = 0;
+    while (bucket < BUCKETS-1 && (2ULL << bucket) <= bits) bucket++;
+    return by_bucket[op][bucket];
+}
+
+size_t write_raw(FILE *file, mpz_srcptr x) {
+    return backend_for(MUL, x, x)->out_raw(file, x);
+}
+
+size_t read_raw(mpz_ptr x, FILE *file) {
+    return backend_for(MUL, x, x)->inp_raw(x, file);
+}
+
+static double elapsed_since(const struct timespec &start) {
+    struct timespec finish;
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+    return finish.tv_sec - start.tv_sec +
+        (finish.tv_nsec - start.tv_nsec) / 1000000000.0;
+}
+
+// run_op runs operation 'op' of 'backend' on a and b (a alone for sqr).
+static void run_op(const bigint_backend *backend, op_kind op, mpz_ptr rop,
+        mpz_srcptr a, mpz_srcptr b) {
+    switch (op) {
+        case MUL: backend->mul(rop, a, b); break;
+        case SQR: backend->sqr(rop, a); break;
+        case MOD: backend->mod(rop, a, b); break;
+        case DIVEXACT: backend->divexact(rop, a, b); break;
+        default: backend->gcd(rop, a, b); break;
+    }
+}
+
+// same_op tells if backends x and y run operation 'op' with the same code.
+static bool same_op(const bigint_backend *x, const bigint_backend *y,
+        op_kind op) {
+    switch (op) {
+        case MUL: return x->mul == y->mul;
+        case SQR: return x->sqr == y->sqr;
+        case MOD: return x->mod == y->mod;
+        case DIVEXACT: return x->divexact == y->divexact;
+        default: return x->gcd == y->gcd;
+    }
+}
+
+// Largest operands timed for each operation: divisions and GCDs are slower
+static const size_t CALIBRATION_MAX_BITS[OP_KINDS] = {1 << 26, 1 << 26,
+    1 << 24, 1 << 24, 1 << 22};
+
+/* calibrate_backends times each operation on operands of 2^14 bits up to
+ * CALIBRATION_MAX_BITS with each backend, and stores the fastest for each
+ * operation and size in the profile. The largest operand has the given size:
+ * mod and divexact divide it by an operand of half its size, like the
+ * remainder tree and Part (C) do. A backend running the same code as one
+ * before it (e.g. ntt, for all but products) is not timed again.
+ */
+void calibrate_backends() {
+    // Time the NTT itself at every size
+    size_t ntt_min_bits = NTT_MIN_BITS;
+    NTT_MIN_BITS = 0;
+    gmp_randclass random(gmp_randinit_default);
+    std::map<string, string> profile = read_key_value_file(profile_file());
+    for (int op = 0; op < OP_KINDS; op++) {
+        op_kind kind = static_cast<op_kind>(op);
+        cout << "   " << OP_NAMES[op] << " bits";
+        for (const bigint_backend *backend : BACKENDS) {
+            cout << "\t" << backend->name << " (s)";
+        }
+        cout << endl;
+        for (size_t bits = 1 << 14; bits <= CALIBRATION_MAX_BITS[op];
+                bits *= 2) {
+            mpz_class a = random.get_z_bits(bits), b = random.get_z_bits(bits);
+            if (kind == MOD || kind == DIVEXACT) {
+                b = random.get_z_bits(bits/2);
+                mpz_setbit(b.get_mpz_t(), bits/2 - 1);
+                a = b * random.get_z_bits(bits/2);
+            }
+            mpz_class c;
+            // Repeat small operations to get measurable times
+            int repeats = std::max<size_t>(1, (1 << 22) / bits);
+            const bigint_backend *best = nullptr;
+            double best_time = 0;
+            cout << "   " << bits;
+            for (size_t k = 0; k < BACKENDS.size(); k++) {
+                const bigint_backend *backend = BACKENDS[k];
+                bool timed_before = false;
+                for (size_t j = 0; j < k; j++) {
+                    timed_before |= same_op(BACKENDS[j], backend, kind);
+                }
+                if (timed_before) {
+                    cout << "\t-";
+                    continue;
+                }
+                struct timespec start;
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                for (int r = 0; r < repeats; r++) {
+                    run_op(backend, kind, c.get_mpz_t(), a.get_mpz_t(),
+                            b.get_mpz_t());
+                }
+                double time = elapsed_since(start) / repeats;
+                cout << "\t" << time;
+                if (!best || time < best_time) {
+                    best = backend;
+                    best_time = time;
+                }
+            }
+            cout << "\t-> " << best->name << endl;
+            int bucket = 0;
+            while ((2ULL << bucket) <= bits) bucket++;
+            profile["backend_" + string(OP_NAMES[op]) + "_" +
+                to_string(bucket)] = best->name;
+        }
+    }
+    NTT_MIN_BITS = ntt_min_bits;
+    write_profile(profile);
+    cout << "Fastest backends stored in " << profile_file();
+    cout << " (used with -backend auto)" << endl;
+}
@@ -0,0 +1,37 @@
+#ifndef SRC_BACKEND_HPP_
+#define SRC_BACKEND_HPP_
+
+#include "utils.hpp"
+
+/* A bigint_backend implements the operations of the tree engines on GMP
+ * integers. Operands are always mpz_t, so that the trees, their files and
+ * the rest of the code do not depend on the backend.
+ */
+// The operations of a backend, also the kinds of the op_* histograms
+enum op_kind { MUL, SQR, MOD, DIVEXACT, GCD, OP_KINDS };
+extern const char *OP_NAMES[OP_KINDS];
+
+struct bigint_backend {
+    const char *name;
+    void (*mul)(mpz_ptr, mpz_srcptr, mpz_srcptr);
+    void (*sqr)(mpz_ptr, mpz_srcptr);
+    void (*mod)(mpz_ptr, mpz_srcptr, mpz_srcptr);
+    void (*divexact)(mpz_ptr, mpz_srcptr, mpz_srcptr);
+    void (*gcd)(mpz_ptr, mpz_srcptr, mpz_srcptr);
+    size_t (*out_raw)(FILE *, mpz_srcptr);
+    size_t (*inp_raw)(mpz_ptr, FILE *);
+};
+
+// "gmp" (default), "ntt", "flint" if built with FLINT=1, or "auto" (see
+// -backend).
+extern string BACKEND;
+
+vector<string> backend_names();
+bool check_backend(string);
+const bigint_backend *find_backend(string);
+const bigint_backend *backend_for(op_kind, mpz_srcptr, mpz_srcptr);
+size_t write_raw(FILE *, mpz_srcptr);
+size_t read_raw(mpz_ptr, FILE *);
+void calibrate_backends();
+
+#endif /* SRC_BACKEND_HPP_ */
@@ -33,19 +33,264 @@
  */
 
 #include <getopt.h>
+#include <algorithm>
 #include "utils.hpp"
+#include "remainders_dfs.hpp"
+#include "bipartite.hpp"
+#include "subtree_cache.hpp"
+#include "known_primes.hpp"
+#include "small_primes.hpp"
+#include "fingerprint.hpp"
+#include "tuner.hpp"
+#include "opstats.hpp"
+#include "corpus.hpp"
+#include "small_batch.hpp"
+#include "spill.hpp"
+#include "backend.hpp"
+#include "arrow_input.hpp"
 
 int N_THREADS = 1;
 static int base_10_flag;
 
+// Remainder tree engine: "squares" (breadth-first), "cofactor" or "dfs"
+static string engine = "squares";
+// "auto", or "pairwise", "memory" or "disk" (see small_batch.cpp)
+static string algorithm = "auto";
+// Second set of moduli (csv file or stored tree) for bipartite mode
+static string against = "";
+// Database of primes recovered by previous runs
+static string known_primes_file = "";
+// Bound of the small-prime stage (0 means disabled)
+static uint64_t small_primes_bound = 0;
+// Prime base of the smooth parts mode
+static string smooth_base_file = "";
+// Verify the fingerprints of the stored tree before Part (B)
+static int verify_flag;
+
 using std::cout, std::endl, std::cin, std::vector, std::ofstream;
 
 /* Pre-requisites:
  *
  * - A file ./data/moduli.csv containing all moduli, in the format
  * <ID>,<modulus in base 16>\n
+ *   or an Arrow IPC (Feather V2) file with an ID column and a binary modulus
+ *   column (see arrow_input.cpp and -arrow-columns)
+ *
+ * The run is split in stages, which can also be run separately (e.g. on
+ * different hosts sharing the data directory) with the subcommands
+ *
+ *      batchgcd ingest <csv>   reads (and screens) the moduli; stores level 0
+ *      batchgcd tree           Part (A), product tree
+ *      batchgcd remainders     Part (B), stores the remainders
+ *      batchgcd finalize       Part (C), writes compromised/duplicates.csv
+ *
+ * and 'batchgcd verify' checks the fingerprints of the stored tree. 'batchgcd
+ * tune' measures when products should be split across threads (see -tune),
+ * up to which size batches are computed in RAM (see -algorithm), and which
+ * backend multiplies each size fastest (see -backend auto).
  *
+ * Stages communicate through the files in TREE_DIR, whose manifest records
+ * the shape of the tree and the last completed stage.
+ */
+
+static const vector<string> STAGES = {"ingest", "tree", "remainders",
+    "finalize"};
+
+static double elapsed_since(const struct timespec &start) {
+    struct timespec finish;
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+    double elapsed = finish.tv_sec - start.tv_sec;
+    elapsed += (finish.tv_nsec - start.tv_nsec) / 1000000000.0;
+    return elapsed;
+}
+
+// require_stage exits unless the stored run completed the given stage.
+static void require_stage(string stage) {
+    string done = manifest_get("stage");
+    int required = std::find(STAGES.begin(), STAGES.end(), stage) -
+        STAGES.begin();
+    int completed = std::find(STAGES.begin(), STAGES.end(), done) -
+        STAGES.begin();
+    if (done == "" || completed < required) {
+        cout << "Fatal error: run 'batchgcd " << stage << "' first" << endl;
+        exit(1);
+    }
+}
+
+/* ingest reads the moduli, screens them against the known primes and stores
+ * their IDs. Returns false if no modulus is left for the tree.
+ */
+static bool ingest(string filename, int base, vector<mpz_class> *X,
+        vector<string> *IDs) {
+    boost::filesystem::create_directories(TREE_DIR);
+    remove((TREE_DIR + "/manifest.txt").c_str());
+    read_moduli_from_csv(filename, X, IDs, base);
+    manifest_set("inputs", std::to_string(X->size()));
+    // Moduli sharing a known prime skip the tree
+    vector<string> screened;
+    if (known_primes_file != "") {
+        vector<mpz_class> known_primes;
+        read_known_primes(known_primes_file, &known_primes);
+        screen_known_primes(X, IDs, &known_primes, &screened);
+        write_known_primes(known_primes_file, &known_primes);
+    }
+    write_ids(&screened, "screened.txt");
+    if (CACHE_DIR != "") {
+        // Deterministic leaf order, so that subtrees repeat across runs
+        bucket_leaves_by_hash(X, IDs);
+    }
+    write_ids(IDs);
+    manifest_set("stage", "ingest");
+    return !X->empty();
+}
+
+/* tree is Part (A), followed by the optional stages which only need the
+ * product tree. Returns the amount of levels.
+ */
+static int tree(vector<mpz_class> *X, vector<string> *IDs, bool write_leaves) {
+    struct timespec start;
+    int levels = product_tree(X, write_leaves);
+    manifest_set("stage", "tree");
+    manifest_set("pruned", "no");
+
+    if (small_primes_bound) {
+        cout << " ------------------------------------------------ " << endl;
+        cout << "| Small primes - remᵢ <- P mod Xᵢ, P = ∏ p < bound |" << endl;
+        cout << " ------------------------------------------------ " << endl;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        mpz_class P;
+        primes_product(small_primes_bound, &P);
+        small_factors(levels, P, IDs);
+        cout << "Time elapsed (s): " << elapsed_since(start) << endl << endl;
+    }
+    return levels;
+}
+
+// remainders is Part (B).
+static void remainders(int levels, vector<mpz_class> *R) {
+    if (manifest_get("pruned") == "yes") {
+        cout << "Fatal error: the levels of the tree were deleted by a ";
+        cout << "previous Part (B); run 'batchgcd tree' again, and use ";
+        cout << "-keep-levels to keep them" << endl;
+        exit(1);
+    }
+    if (verify_flag && !verify_tree(levels)) {
+        exit(1);
+    }
+    // Set beforehand, a failed run may have deleted some levels already
+    if (!KEEP_LEVELS) {
+        manifest_set("pruned", "yes");
+    }
+    if (engine == "dfs") {
+        // Also computes the final GCDs of Part (C)
+        remainders_gcds_dfs(levels, R);
+    } else if (engine == "cofactor") {
+        remainders_cofactors(levels, R);
+    } else {
+        remainders_squares(levels, R);
+    }
+    manifest_set("remainders", engine);
+}
+
+// finalize is Part (C), without the report.
+static void finalize(vector<mpz_class> *R, vector<mpz_class> *X) {
+    cout << "Re-reading moduli (were destroyed in part B)" << endl;
+    read_level_from_file(0, X);
+    // The dfs engine already computed the GCDs
+    string used = manifest_get("remainders");
+    if (used == "cofactor") {
+        cofactor_gcds(R, X);
+    } else if (used != "dfs") {
+        final_gcds(R, X);
+    }
+}
+
+// report classifies, updates the known primes and writes the results.
+static void report(vector<mpz_class> *R, vector<mpz_class> *X,
+        vector<string> *IDs) {
+    cout << "Verifying correctness before announcing results" << endl << endl;
+    vector<string> compromised;
+    vector<string> duplicates;
+    vector<string> screened;
+    size_t false_positives = classify_results(R, X, IDs, &compromised,
+            &duplicates);
+    read_ids(&screened, "screened.txt");
+    if (screened.size()) {
+        cout << "Moduli flagged by known primes: " << screened.size() << endl;
+        compromised.insert(compromised.end(), screened.begin(),
+                screened.end());
+    }
+    if (known_primes_file != "") {
+        vector<mpz_class> known_primes;
+        read_known_primes(known_primes_file, &known_primes);
+        collect_recovered_primes(R, X, &known_primes);
+        write_known_primes(known_primes_file, &known_primes);
+    }
+    report_results(std::stoull(manifest_get("inputs")), &compromised,
+            &duplicates, false_positives);
+    manifest_set("stage", "finalize");
+}
+
+/* output_base16 writes the moduli to base16.moduli, one per line in hex, the
+ * input format of fastgcd (factorable.net). Only for fair benchmarking.
  */
+static void output_base16(vector<mpz_class> *X) {
+    ofstream file;
+    file.open("base16.moduli");
+    for (size_t i = 0; i < X->size(); i++) {
+        file << X->at(i).get_str(16) << "\n";
+    }
+    file.close();
+}
+
+// run_stage runs a single stage of the pipeline, on the stored artifacts.
+static int run_stage(string stage, int argc, char** argv, int base) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    vector<mpz_class> X, R;
+    vector<string> IDs;
+    if (stage == "ingest") {
+        if (optind + 1 >= argc) {
+            cout << "Please specify target csv file." << endl;
+            exit(1);
+        }
+        if (ingest(argv[optind+1], base, &X, &IDs)) {
+            write_level_to_file(0, &X);
+        }
+        intsPerFloor.assign(1, X.size());
+        write_tree_manifest();
+    } else if (stage == "tree") {
+        require_stage("ingest");
+        read_tree_manifest();
+        if (intsPerFloor[0] == 0) {
+            cout << "All moduli were screened, nothing to do." << endl;
+        } else {
+            read_level_from_file(0, &X);
+            read_ids(&IDs);
+            tree(&X, &IDs, false);
+        }
+    } else if (stage == "remainders") {
+        require_stage("tree");
+        int levels = read_tree_manifest();
+        remainders(levels, &R);
+        write_remainders_to_file(&R);
+        manifest_set("stage", "remainders");
+    } else {
+        require_stage("ingest");
+        read_tree_manifest();
+        if (intsPerFloor[0] > 0) {
+            require_stage("remainders");
+            read_remainders_from_file(&R);
+            finalize(&R, &X);
+            read_ids(&IDs);
+        }
+        report(&R, &X, &IDs);
+    }
+    cout << "Time elapsed (s): " << elapsed_since(start) << endl;
+    write_opstats();
+    cout << "Done, bye." << endl;
+    return 0;
+}
 
 int main(int argc, char** argv) {
     if (argc < 2) {
@@ -55,21 +300,149 @@ int main(int argc, char** argv) {
     // Detect flags
     static struct option long_options[] = {
           {"base10", no_argument, &base_10_flag, 1},
+          {"threads", required_argument, 0, 't'},
+          {"threads-file", required_argument, 0, 'T'},
+          {"engine", required_argument, 0, 'e'},
+          {"algorithm", required_argument, 0, 'r'},
+          {"against", required_argument, 0, 'a'},
+          {"cache", required_argument, 0, 'c'},
+          {"cache-size", required_argument, 0, 's'},
+          {"cache-min-bits", required_argument, 0, 'm'},
+          {"known-primes", required_argument, 0, 'k'},
+          {"small-primes", required_argument, 0, 'p'},
+          {"smooth-base", required_argument, 0, 'b'},
+          {"storage", required_argument, 0, 'd'},
+          {"keep-levels", no_argument, 0, 'l'},
+          {"disk-budget", required_argument, 0, 'g'},
+          {"memory-budget", required_argument, 0, 'M'},
+          {"backend", required_argument, 0, 'B'},
+          {"arrow-columns", required_argument, 0, 'A'},
+          {"tune", no_argument, 0, 'u'},
+          {"profile", required_argument, 0, 'f'},
+          {"opstats", required_argument, 0, 'o'},
+          {"verify", no_argument, &verify_flag, 1},
           {0, 0, 0, 0}
         };
     int option_index = 0;
-    getopt_long_only(argc, argv, "", long_options, &option_index);
+    int c;
+    N_THREADS = 0;
+    while ((c = getopt_long_only(argc, argv, "", long_options,
+                    &option_index)) != -1) {
+        if (c == 't') N_THREADS = std::max(1, atoi(optarg));
+        if (c == 'T') THREADS_FILE = optarg;
+        if (c == 'e') engine = optarg;
+        if (c == 'r') algorithm = optarg;
+        if (c == 'a') against = optarg;
+        if (c == 'c') CACHE_DIR = optarg;
+        // In MB
+        if (c == 's') CACHE_MAX_BYTES = strtoull(optarg, NULL, 10) << 20;
+        if (c == 'm') CACHE_MIN_BITS = strtoull(optarg, NULL, 10);
+        if (c == 'k') known_primes_file = optarg;
+        if (c == 'p') small_primes_bound = strtoull(optarg, NULL, 10);
+        if (c == 'b') smooth_base_file = optarg;
+        if (c == 'd') boost::split(STORAGE_DIRS, string(optarg),
+                boost::is_any_of(","));
+        if (c == 'l') KEEP_LEVELS = true;
+        if (c == 'u') AUTO_TUNE = true;
+        if (c == 'f') PROFILE_FILE = optarg;
+        if (c == 'o') OPSTATS_FILE = optarg;
+        if (c == 'g') DISK_BUDGET = strtoull(optarg, NULL, 10) << 20;
+        // In MB
+        if (c == 'M') MEMORY_BUDGET = strtoull(optarg, NULL, 10) << 20;
+        if (c == 'B') BACKEND = optarg;
+        if (c == 'A') {
+            vector<string> names;
+            boost::split(names, string(optarg), boost::is_any_of(","));
+            if (names.size() != 2) {
+                cout << "-arrow-columns expects <ID column>,<modulus column>";
+                cout << endl;
+                exit(1);
+            }
+            ARROW_ID_COLUMN = names[0];
+            ARROW_MODULUS_COLUMN = names[1];
+        }
+    }
+    if (MEMORY_BUDGET) track_gmp_memory();
+    if (engine != "squares" && engine != "cofactor" && engine != "dfs") {
+        cout << "Unknown engine " << engine << endl;
+        exit(1);
+    }
+    if (!check_backend(BACKEND)) {
+        cout << "Unknown backend " << BACKEND << " (built: ";
+        cout << boost::join(backend_names(), ", ") << ", or auto)" << endl;
+        exit(1);
+    }
+    if (algorithm != "auto" && algorithm != "pairwise" &&
+            algorithm != "memory" && algorithm != "disk") {
+        cout << "Unknown algorithm " << algorithm << endl;
+        exit(1);
+    }
+    if (optind >= argc) {
+        cout << "Please specify target csv file." << endl;
+        exit(1);
+    }
 
     // Set base
     int base = 16;
     if (base_10_flag) base = 10;
 
-    // Prompt threads
-    cout << "Define number of threads: ";
-    cin >> N_THREADS;
+    // Prompt threads, unless given with -threads
+    if (N_THREADS == 0) {
+        cout << "Define number of threads: ";
+        if (!(cin >> N_THREADS) || N_THREADS < 1) {
+            cout << "Invalid number of threads" << endl;
+            exit(1);
+        }
+    }
+
+    string stage = argv[optind];
+    if (std::find(STAGES.begin(), STAGES.end(), stage) != STAGES.end()) {
+        return run_stage(stage, argc, argv, base);
+    }
+    if (stage == "generate") {
+        if (optind + 2 >= argc) {
+            cout << "Usage: batchgcd generate <csv file> <count> [bits] ";
+            cout << "[seed]" << endl;
+            exit(1);
+        }
+        unsigned int bits = optind + 3 < argc ? atoi(argv[optind+3]) : 2048;
+        unsigned long seed = optind + 4 < argc ? atol(argv[optind+4]) : 1;
+        generate_corpus(argv[optind+1], strtoull(argv[optind+2], NULL, 10),
+                bits, seed);
+        return 0;
+    }
+    if (stage == "export-base16") {
+        if (optind + 1 >= argc) {
+            cout << "Please specify target csv file." << endl;
+            exit(1);
+        }
+        vector<mpz_class> X;
+        vector<string> IDs;
+        read_moduli_from_csv(argv[optind+1], &X, &IDs, base);
+        output_base16(&X);
+        cout << "Moduli written to base16.moduli" << endl;
+        return 0;
+    }
+    if (stage == "tune") {
+        calibrate_split();
+        calibrate_small_batches();
+        calibrate_backends();
+        return 0;
+    }
+    if (stage == "verify") {
+        require_stage("tree");
+        return verify_tree(read_tree_manifest()) ? 0 : 1;
+    }
+
+    if (against != "") {
+        bipartite_gcds(argv[optind], against, base);
+        write_opstats();
+        cout << "Done, bye." << endl;
+        return 0;
+    }
 
     // Set timer
-    struct timespec start, finish;
+    struct timespec start;
     double elapsedA, elapsedB, elapsedC;
 
     cout << " --------------------------------------------------- " << endl;
@@ -77,40 +450,71 @@ int main(int argc, char** argv) {
     cout << " --------------------------------------------------- " << endl;
     vector<mpz_class> input_moduli;
     vector<string> IDs;
+    vector<mpz_class> R;
     clock_gettime(CLOCK_MONOTONIC, &start);
-    read_moduli_from_csv(argv[1], &input_moduli, &IDs, base);
-    int levels = product_tree(&input_moduli);
-    clock_gettime(CLOCK_MONOTONIC, &finish);
+    if (!ingest(argv[optind], base, &input_moduli, &IDs)) {
+        // All moduli were screened
+        report(&R, &input_moduli, &IDs);
+        write_opstats();
+        cout << "Done, bye." << endl;
+        return 0;
+    }
+    // Options which need the stored tree, or only apply to its engines
+    // (the small batch algorithms run on one thread, with GMP)
+    if (smooth_base_file != "" || small_primes_bound || CACHE_DIR != "" ||
+            KEEP_LEVELS || verify_flag || engine != "squares" ||
+            !STORAGE_DIRS.empty() || DISK_BUDGET || MEMORY_BUDGET ||
+            AUTO_TUNE || BACKEND != "gmp" || OPSTATS_FILE != "") {
+        algorithm = "disk";
+    }
+    if (algorithm == "auto") algorithm = choose_algorithm(&input_moduli);
+    if (algorithm != "disk") {
+        cout << "Small batch: " << algorithm << " gcds of ";
+        cout << input_moduli.size() << " moduli" << endl;
+        small_batch_gcds(algorithm, &input_moduli, &R);
+        cout << "Time elapsed (s): " << elapsed_since(start) << endl << endl;
+        report(&R, &input_moduli, &IDs);
+        write_opstats();
+        cout << "Done, bye." << endl;
+        return 0;
+    }
+    int levels = tree(&input_moduli, &IDs, true);
     cout << "End Part (A)" << endl;
-    elapsedA = finish.tv_sec - start.tv_sec;
-    elapsedA += (finish.tv_nsec - start.tv_nsec) / 1000000000.0;
+    elapsedA = elapsed_since(start);
     cout << "Time elapsed (s): " << elapsedA << endl << endl;
 
+    if (smooth_base_file != "") {
+        cout << " ------------------------------------------------ " << endl;
+        cout << "| Smooth parts with respect to the prime base     |" << endl;
+        cout << " ------------------------------------------------ " << endl;
+        vector<mpz_class> prime_base;
+        read_known_primes(smooth_base_file, &prime_base);
+        mpz_class P;
+        product_of(&prime_base, &P);
+        write_smooth_parts(levels, P, &IDs);
+        write_opstats();
+        cout << "Done, bye." << endl;
+        return 0;
+    }
+
     cout << " ----------------------------------------------------- " << endl;
     cout << "| Part (B) - Compute the remainders remᵢ <- Z mod Xᵢ² |" << endl;
     cout << " ----------------------------------------------------- " << endl;
     clock_gettime(CLOCK_MONOTONIC, &start);
-    vector<mpz_class> R;
-    remainders_squares(levels, &R);
+    remainders(levels, &R);
+    manifest_set("stage", "remainders");
     cout << "End Part (B)" << endl;
-    clock_gettime(CLOCK_MONOTONIC, &finish);
-    elapsedB = (finish.tv_sec - start.tv_sec);
-    elapsedB += (finish.tv_nsec - start.tv_nsec) / 1000000000.0;
+    elapsedB = elapsed_since(start);
     cout << "Time elapsed (s): " << elapsedB << endl << endl;
 
     cout << " ------------------------------------------------------  " << endl;
     cout << "|Part (C) - Compute final GCDs (remᵢ <- remᵢ/Xᵢ mod Xᵢ) |" << endl;
     cout << " ------------------------------------------------------  " << endl;
     clock_gettime(CLOCK_MONOTONIC, &start);
-    cout << "Re-reading moduli (were destroyed in part B)" << endl;
-    read_level_from_file(0, &input_moduli);
-    for (unsigned int i = 0; i < input_moduli.size(); i++) {
-        R[i] = R[i] / input_moduli[i];
-        R[i] = gcd(R[i], input_moduli[i]);
-    }
-    clock_gettime(CLOCK_MONOTONIC, &finish);
-    elapsedC = (finish.tv_sec - start.tv_sec);
-    elapsedC += (finish.tv_nsec - start.tv_nsec) / 1000000000.0;
+    finalize(&R, &input_moduli);
+    cout << "End Part (C)" << endl;
+    elapsedC = elapsed_since(start);
+    cout << "Time elapsed (s): " << elapsedC << endl;
 
 
     cout << endl;
@@ -127,63 +531,8 @@ int main(int argc, char** argv) {
     cout << "   *****************************  " << endl;
     cout << "   *****************************  " << endl << endl;
 
-    cout << "Verifying correctness before announcing results" << endl << endl;
-    vector<string> compromised;
-    vector<string> duplicates;
-    int false_positives = 0;
-    // False positives should not exist, this is a sanity check for large input
-    // sets.
-    for (int i = 0; i < static_cast<int>(input_moduli.size()); i++) {
-        if (R[i] != 1) {
-            if (R[i] == 0 || input_moduli[i] % R[i] != 0) {
-                false_positives += 1;
-            } else if (R[i] == input_moduli[i]) {
-                duplicates.push_back(IDs[i]);
-            } else {
-                compromised.push_back(IDs[i]);
-            }
-        }
-    }
-    cout << "    ------------- " << endl;
-    cout << "   |-- Results --|" << endl;
-    cout << "    ------------- " << endl << endl;
-    cout << "Amount of target moduli:       " << input_moduli.size() << endl;
-    cout << "Amount of duplicates:          " << duplicates.size() << endl;
-    cout << "Amount of compromised moduli:  " << compromised.size() << endl;
-    cout << "False positives:               " << false_positives << endl;
-    cout << "Writing compromised IDs to file..." << endl;
-    string line = "";
-    ofstream file;
-    file.open("compromised.csv");
-    for (unsigned int i = 0; i < compromised.size(); i++) {
-        file << compromised[i] << "\n";
-    }
-    file.close();
-    file.open("duplicates.csv");
-    for (unsigned int i = 0; i < duplicates.size(); i++) {
-        file << duplicates[i] << "\n";
-    }
-    file.close();
-    if (duplicates.size()) {
-        cout << "Note: filter duplicates directly from the input file ";
-        cout << "(i.e., ignoring the output file)" << endl;
-        cout << "and run again. They may contain compromised moduli. ";
-        cout << "If you already did this, then all\nintegers marked as ";
-        cout << "duplicate share factors (run naïve GCDs).";
-        cout << endl << endl;
-    }
-    cout << endl << "See results in compromised.csv and duplicates.csv" << endl;
+    report(&R, &input_moduli, &IDs);
+    write_opstats();
     cout << "Done, bye." << endl;
     return 0;
 }
-
-// Only for fair benchmarking against factorable.net
-void output_base16(vector<mpz_class> *X) {
-    ofstream file;
-    file.open("base16.moduli");
-    for (unsigned int i = 0; i < X->size(); i++) {
-        file << X->at(i).get_str(16) << "\n";
-    }
-    file.close();
-}
-
@@ -0,0 +1,293 @@
+/* ------------------------------------------------------
+ * Distributed (MPI) execution mode of the BatchGCD algorithm
+ * ------------------------------------------------------
+ *
+ *  Each of the 'p' ranks owns a contiguous shard of the input moduli and
+ *  builds the product tree of its shard on its own disk, exactly as the
+ *  single-process version does. The p shard products form the leaves of an
+ *  upper tree, which is computed pairwise across the ranks: node j of upper
+ *  level l belongs to rank j·2^l, which receives its right child from rank
+ *  (2j+1)·2^(l-1) and keeps both children on its disk. The remainders then
+ *  go down the same pairs: the owner of a node reduces its remainder modulo
+ *  the squares of both children, and sends the right one to its owner, so
+ *  that each rank ends with
+ *
+ *                    Rᵣ = Z mod rootᵣ²
+ *
+ *  From there, each rank runs the remainder tree and the final GCDs of its
+ *  shard locally. Results are gathered at rank 0, which writes
+ *  compromised.csv and duplicates.csv in the usual format.
+ *
+ *  A rank holds its shard, then at most one node of the upper tree and its
+ *  remainder at a time: the nodes of its path up to the highest level it
+ *  owns, of up to the size of all the input for rank 0 (which holds Z), are
+ *  kept on disk. Rank 0 counts the records of the csv file and finds where
+ *  each shard starts, so that the other ranks only read their own shard.
+ *
+ *  Usage: mpirun -np <p> ./batchgcd_mpi /path/to/csv [-base10] [-threads N]
+ */
+
+#include <getopt.h>
+#include <mpi.h>
+#include <climits>
+#include "utils.hpp"
+#include "opstats.hpp"
+#include "backend.hpp"
+#include "arrow_input.hpp"
+
+int N_THREADS = 1;
+static int base_10_flag;
+
+using std::cout, std::endl, std::vector, std::string;
+
+/* send_mpz sends x to rank 'dest', and recv_mpz receives it from rank
+ * 'source'. Values are sent as 64-bit words in chunks, so that products above
+ * 2**31 bytes are supported.
+ */
+void send_mpz(const mpz_class &x, int dest) {
+    uint64_t words = (mpz_sizeinbase(x.get_mpz_t(), 2) + 63) / 64;
+    vector<uint64_t> buffer(words);
+    size_t count;
+    mpz_export(buffer.data(), &count, -1, 8, 0, 0, x.get_mpz_t());
+    words = count;
+    MPI_Send(&words, 1, MPI_UINT64_T, dest, 0, MPI_COMM_WORLD);
+    for (uint64_t offset = 0; offset < words; offset += INT_MAX) {
+        int chunk = static_cast<int>(std::min<uint64_t>(INT_MAX,
+                    words - offset));
+        MPI_Send(buffer.data() + offset, chunk, MPI_UINT64_T, dest, 0,
+                MPI_COMM_WORLD);
+    }
+}
+
+void recv_mpz(mpz_class *x, int source) {
+    uint64_t words;
+    MPI_Recv(&words, 1, MPI_UINT64_T, source, 0, MPI_COMM_WORLD,
+            MPI_STATUS_IGNORE);
+    vector<uint64_t> buffer(words);
+    for (uint64_t offset = 0; offset < words; offset += INT_MAX) {
+        int chunk = static_cast<int>(std::min<uint64_t>(INT_MAX,
+                    words - offset));
+        MPI_Recv(buffer.data() + offset, chunk, MPI_UINT64_T, source, 0,
+                MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    }
+    mpz_import(x->get_mpz_t(), words, -1, 8, 0, 0, buffer.data());
+}
+
+// upper_filename is the file of the children of the node at upper level l.
+static string upper_filename(int l) {
+    return TREE_DIR + "/upper" + std::to_string(l) + ".gmp";
+}
+
+/* upper_tree computes the upper tree of the shard products, from the root of
+ * this rank's shard. Children are written to disk by the owner of their
+ * parent. Returns the amount of upper levels; rank 0 ends with Z in 'node'.
+ */
+static int upper_tree(mpz_class *node, int rank, int size) {
+    int levels = 0;
+    while ((1 << levels) < size) levels++;
+    for (int l = 1; l <= levels; l++) {
+        int half = 1 << (l-1);
+        if (rank % (2*half) == half) {
+            send_mpz(*node, rank - half);
+            *node = 0;
+            break;
+        }
+        if (rank + half >= size) continue;
+        mpz_class right;
+        recv_mpz(&right, rank + half);
+        FILE *file = fopen(upper_filename(l).c_str(), "wb");
+        if (!file) {
+            cout << "Fatal error: cannot write " << upper_filename(l) << endl;
+            throw std::exception();
+        }
+        write_raw(file, node->get_mpz_t());
+        write_raw(file, right.get_mpz_t());
+        fclose(file);
+        op_mul(node->get_mpz_t(), node->get_mpz_t(), right.get_mpz_t());
+    }
+    return levels;
+}
+
+/* upper_remainders takes Z at rank 0 and leaves Z mod root² at each rank,
+ * where root is the product of its shard.
+ */
+static void upper_remainders(mpz_class *rem, int levels, int rank, int size) {
+    for (int l = levels; l >= 1; l--) {
+        int half = 1 << (l-1);
+        if (rank % (2*half) == half) {
+            recv_mpz(rem, rank - half);
+        } else if (rank % (2*half) == 0 && rank + half < size) {
+            mpz_class left, right;
+            FILE *file = fopen(upper_filename(l).c_str(), "rb");
+            if (!file) {
+                cout << "Fatal error: missing " << upper_filename(l) << endl;
+                throw std::exception();
+            }
+            if (read_raw(left.get_mpz_t(), file) == 0 ||
+                    read_raw(right.get_mpz_t(), file) == 0) {
+                cout << "Fatal error: corrupted " << upper_filename(l) << endl;
+                throw std::exception();
+            }
+            fclose(file);
+            remove(upper_filename(l).c_str());
+            op_sqr(right.get_mpz_t(), right.get_mpz_t());
+            mpz_class reduced;
+            op_mod(reduced.get_mpz_t(), rem->get_mpz_t(), right.get_mpz_t());
+            right = 0;
+            send_mpz(reduced, rank + half);
+            reduced = 0;
+            op_sqr(left.get_mpz_t(), left.get_mpz_t());
+            op_mod(rem->get_mpz_t(), rem->get_mpz_t(), left.get_mpz_t());
+        }
+    }
+}
+
+/* gather_ids concatenates the ID lists of all ranks at rank 0, in rank order.
+ */
+void gather_ids(vector<string> *IDs, int rank, int size) {
+    string local;
+    for (size_t i = 0; i < IDs->size(); i++) {
+        local += (*IDs)[i] + "\n";
+    }
+    uint64_t length = local.size();
+    vector<uint64_t> lengths(size);
+    MPI_Gather(&length, 1, MPI_UINT64_T, lengths.data(), 1, MPI_UINT64_T, 0,
+            MPI_COMM_WORLD);
+    // MPI counts are ints: longer lists are sent in chunks of INT_MAX bytes
+    if (rank != 0) {
+        for (uint64_t offset = 0; offset < length; offset += INT_MAX) {
+            int chunk = static_cast<int>(std::min<uint64_t>(INT_MAX,
+                        length - offset));
+            MPI_Send(local.data() + offset, chunk, MPI_CHAR, 0, 0,
+                    MPI_COMM_WORLD);
+        }
+        return;
+    }
+    for (int r = 1; r < size; r++) {
+        string remote(lengths[r], '\0');
+        for (uint64_t offset = 0; offset < lengths[r]; offset += INT_MAX) {
+            int chunk = static_cast<int>(std::min<uint64_t>(INT_MAX,
+                        lengths[r] - offset));
+            MPI_Recv(&remote[offset], chunk, MPI_CHAR, r, 0, MPI_COMM_WORLD,
+                    MPI_STATUS_IGNORE);
+        }
+        local += remote;
+    }
+    vector<string>().swap(*IDs);
+    boost::split(*IDs, local, boost::is_any_of("\n"));
+    // Trailing separator
+    IDs->pop_back();
+}
+
+int main(int argc, char** argv) {
+    MPI_Init(&argc, &argv);
+    int rank, size;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &size);
+    if (argc < 2) {
+        if (rank == 0) cout << "Please specify target csv file." << endl;
+        MPI_Finalize();
+        exit(1);
+    }
+    // Detect flags
+    static struct option long_options[] = {
+          {"base10", no_argument, &base_10_flag, 1},
+          {"threads", required_argument, 0, 't'},
+          {0, 0, 0, 0}
+        };
+    int option_index = 0;
+    int c;
+    while ((c = getopt_long_only(argc, argv, "", long_options,
+                    &option_index)) != -1) {
+        if (c == 't') N_THREADS = std::max(1, atoi(optarg));
+    }
+    int base = 16;
+    if (base_10_flag) base = 10;
+    string filename = argv[optind];
+
+    struct timespec start, finish;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // Shard the input: rank r owns records [first, last). Rank 0 counts them
+    // and, for a csv file, finds where each shard starts.
+    uint64_t n = 0;
+    vector<int64_t> offsets(size, -1);
+    if (rank == 0) {
+        n = count_moduli_in_csv(filename);
+        if (!is_arrow_file(filename)) {
+            vector<size_t> firsts(size);
+            for (int r = 0; r < size; r++) firsts[r] = n * r / size;
+            offsets = csv_record_offsets(filename, firsts);
+        }
+    }
+    MPI_Bcast(&n, 1, MPI_UINT64_T, 0, MPI_COMM_WORLD);
+    MPI_Bcast(offsets.data(), size, MPI_INT64_T, 0, MPI_COMM_WORLD);
+    if (n < static_cast<size_t>(size)) {
+        if (rank == 0) cout << "Fatal error: less moduli than ranks" << endl;
+        MPI_Finalize();
+        exit(1);
+    }
+    size_t first = n * rank / size;
+    size_t last = n * (rank + 1) / size;
+    vector<mpz_class> input_moduli;
+    vector<string> IDs;
+    read_moduli_range_from_csv(filename, &input_moduli, &IDs, base, first,
+            last, offsets[rank]);
+
+    // Each rank stores its own product tree
+    TREE_DIR = TREE_DIR + "/rank" + std::to_string(rank);
+    boost::filesystem::create_directories(TREE_DIR);
+
+    if (rank == 0) {
+        cout << " --------------------------------------------------- " << endl;
+        cout << "| Part (A) - Local product trees of " << size << " shards";
+        cout << endl;
+        cout << " --------------------------------------------------- " << endl;
+    }
+    int levels = product_tree(&input_moduli);
+    vector<mpz_class> R;
+    read_level_from_file(levels-1, &R);
+
+    // Upper tree of the shard products
+    mpz_class node;
+    mpz_swap(node.get_mpz_t(), R[0].get_mpz_t());
+    int upper_levels = upper_tree(&node, rank, size);
+
+    if (rank == 0) {
+        cout << " ----------------------------------------------------- " << endl;
+        cout << "| Part (B) - Compute the remainders remᵢ <- Z mod Xᵢ² |" << endl;
+        cout << " ----------------------------------------------------- " << endl;
+    }
+    upper_remainders(&node, upper_levels, rank, size);
+    mpz_swap(R[0].get_mpz_t(), node.get_mpz_t());
+    remainders_squares_from_level(levels-1, &R);
+
+    if (rank == 0) {
+        cout << " ------------------------------------------------------  " << endl;
+        cout << "|Part (C) - Compute final GCDs (remᵢ <- remᵢ/Xᵢ mod Xᵢ) |" << endl;
+        cout << " ------------------------------------------------------  " << endl;
+    }
+    read_level_from_file(0, &input_moduli);
+    final_gcds(&R, &input_moduli);
+    vector<string> compromised;
+    vector<string> duplicates;
+    uint64_t false_positives = classify_results(&R, &input_moduli, &IDs,
+            &compromised, &duplicates);
+
+    // Gather results at rank 0
+    uint64_t total_false_positives = 0;
+    MPI_Reduce(&false_positives, &total_false_positives, 1, MPI_UINT64_T,
+            MPI_SUM, 0, MPI_COMM_WORLD);
+    gather_ids(&compromised, rank, size);
+    gather_ids(&duplicates, rank, size);
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+    if (rank == 0) {
+        double elapsed = finish.tv_sec - start.tv_sec;
+        elapsed += (finish.tv_nsec - start.tv_nsec) / 1000000000.0;
+        cout << endl << "Total time elapsed (s): " << elapsed << endl << endl;
+        report_results(n, &compromised, &duplicates, total_false_positives);
+        cout << "Done, bye." << endl;
+    }
+    MPI_Finalize();
+    return 0;
+}
@@ -0,0 +1,641 @@
+/* ------------------------------------------------------
+ * Job scheduler daemon for concurrent BatchGCD runs
+ * ------------------------------------------------------
+ *
+ *  A local daemon queues batchgcd jobs submitted through a unix socket and
+ *  runs each of them as a forked ./batchgcd process in its own directory
+ *  <jobs>/<id>, which holds its product tree (data/product_tree), its output
+ *  (compromised.csv, duplicates.csv, ...) and its log (log.txt). Jobs thus
+ *  never collide on storage.
+ *
+ *  Jobs share a pool of 'threads' threads and one memory budget. Each job
+ *  is granted a thread quota out of the pool, which it gets as -threads and
+ *  runs its own threads within. A job is started once a thread is free and
+ *  its memory fits in the budget. Among the jobs that fit, the next one is
+ *  chosen by
+ *
+ *      1. priority (higher first),
+ *      2. fair share: the owner (uid of the submitting client) using the
+ *         fewest threads first,
+ *      3. small jobs (inputs under SMALL_JOB_BYTES) first,
+ *      4. submission order.
+ *
+ *  The share of an owner is threads/(active owners), split among its jobs; a
+ *  job given an explicit thread count gets no more than it. When there is
+ *  more than one thread, one of them is reserved to small jobs, so that they
+ *  never wait behind a multi-hour full-corpus run.
+ *
+ *  Quotas are renegotiated while jobs run (see rebalance): while a job that
+ *  fits waits, the running jobs are shrunk to their fair share, and once none
+ *  waits, the threads left are handed back to the running jobs. The quota of
+ *  a job is written to <jobs>/<id>/threads, its -threads-file, which batchgcd
+ *  reads again before each level: a shrinking job may thus hold its former
+ *  threads until its current level ends. The depth-first engine and the
+ *  small-batch path keep their initial quota.
+ *
+ *  The memory of a job is given at submission or estimated from the size of
+ *  its input files; it is an admission limit, not enforced on the process.
+ *  The queue lives in the memory of the daemon, and is lost when it stops.
+ *  Clients are served by the same poll loop as the scheduling, without
+ *  blocking: a slow client delays neither the other ones nor the jobs.
+ *
+ *  Usage:
+ *    ./batchgcd_sched serve [-threads T] [-memory MB] [-jobs data/jobs]
+ *                           [-batchgcd ./batchgcd] [-socket data/sched.sock]
+ *    ./batchgcd_sched submit [-priority P] [-memory MB] [-threads N]
+ *                            -- <csv> [batchgcd options]
+ *    ./batchgcd_sched status [id]
+ *    ./batchgcd_sched wait <id>
+ *    ./batchgcd_sched cancel <id>
+ *
+ *  Clients take the same -socket option. Relative paths among the batchgcd
+ *  arguments are resolved by the client, so that jobs find their inputs.
+ */
+
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <boost/algorithm/string.hpp>
+#include <boost/filesystem.hpp>
+#include <algorithm>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <map>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using std::cout;
+using std::endl;
+using std::map;
+using std::min;
+using std::string;
+using std::to_string;
+using std::vector;
+
+// Inputs below this size are small jobs
+static const uint64_t SMALL_JOB_BYTES = 16 << 20;
+// Clients not done with within this time (in seconds) are dropped
+static const int CLIENT_TIMEOUT = 5;
+
+static string socket_path = "data/sched.sock";
+static string jobs_dir = "data/jobs";
+static string batchgcd_path = "./batchgcd";
+static int total_threads = 1;
+// In bytes, 0 means unlimited
+static uint64_t memory_budget = 0;
+
+struct job {
+    uint64_t id;
+    uid_t owner;
+    int priority;
+    uint64_t memory;
+    // Requested threads, 0 for the fair share
+    int threads;
+    bool small;
+    vector<string> args;
+    // queued, running, done, failed or cancelled
+    string state;
+    int granted;
+    pid_t pid;
+    int exit_code;
+    bool cancel;
+};
+
+static map<uint64_t, job> jobs;
+static uint64_t next_id = 1;
+
+// used_threads returns the threads granted to running jobs of 'owner', or
+// of all owners if it is NULL.
+static int used_threads(const uid_t *owner) {
+    int used = 0;
+    for (auto const &entry : jobs) {
+        const job &j = entry.second;
+        if (j.state == "running" && (!owner || j.owner == *owner)) {
+            used += j.granted;
+        }
+    }
+    return used;
+}
+
+static uint64_t used_memory() {
+    uint64_t used = 0;
+    for (auto const &entry : jobs) {
+        if (entry.second.state == "running") used += entry.second.memory;
+    }
+    return used;
+}
+
+// free_threads returns the threads not granted yet that job 'j' may use.
+static int free_threads(const job &j) {
+    int available = total_threads - used_threads(NULL);
+    if (!j.small && total_threads > 1) {
+        // Keep a thread for small jobs, unless one already holds it
+        bool small_running = false;
+        for (auto const &entry : jobs) {
+            small_running |= (entry.second.state == "running" &&
+                    entry.second.small);
+        }
+        if (!small_running) available--;
+    }
+    return available;
+}
+
+// better returns true if job 'a' should start before job 'b'.
+static bool better(const job &a, const job &b) {
+    if (a.priority != b.priority) return a.priority > b.priority;
+    int used_a = used_threads(&a.owner);
+    int used_b = used_threads(&b.owner);
+    if (used_a != used_b) return used_a < used_b;
+    if (a.small != b.small) return a.small;
+    return a.id < b.id;
+}
+
+static string job_dir(const job &j) {
+    return jobs_dir + "/" + to_string(j.id);
+}
+
+/* set_quota grants 'threads' threads to job 'j', and writes them to its
+ * control file, read by batchgcd before each level. The file is replaced at
+ * once, so that the job never reads a partial quota.
+ */
+static bool set_quota(job *j, int threads) {
+    string path = job_dir(*j) + "/threads";
+    FILE *file = fopen((path + ".tmp").c_str(), "w");
+    if (!file) {
+        cout << "Job " << j->id << ": cannot write " << path << ".tmp: ";
+        cout << strerror(errno) << endl;
+        return false;
+    }
+    fprintf(file, "%d\n", threads);
+    if (fclose(file) != 0 ||
+            rename((path + ".tmp").c_str(), path.c_str()) != 0) {
+        cout << "Job " << j->id << ": cannot write " << path << ": ";
+        cout << strerror(errno) << endl;
+        return false;
+    }
+    j->granted = threads;
+    return true;
+}
+
+static void launch(job *j, int threads) {
+    string dir = job_dir(*j);
+    boost::filesystem::create_directories(dir);
+    if (!set_quota(j, threads)) {
+        j->state = "failed";
+        return;
+    }
+    vector<string> args = {batchgcd_path};
+    args.insert(args.end(), j->args.begin(), j->args.end());
+    args.push_back("-threads");
+    args.push_back(to_string(threads));
+    args.push_back("-threads-file");
+    args.push_back("threads");
+    pid_t pid = fork();
+    if (pid < 0) {
+        cout << "Job " << j->id << ": fork failed: " << strerror(errno) << endl;
+        j->state = "failed";
+        return;
+    }
+    if (pid == 0) {
+        if (chdir(dir.c_str()) != 0) _exit(127);
+        int log = open("log.txt", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        int null = open("/dev/null", O_RDONLY);
+        if (log < 0 || null < 0) _exit(127);
+        dup2(null, 0);
+        dup2(log, 1);
+        dup2(log, 2);
+        vector<char *> argv;
+        for (string &arg : args) argv.push_back(&arg[0]);
+        argv.push_back(NULL);
+        execv(argv[0], argv.data());
+        _exit(127);
+    }
+    j->state = "running";
+    j->pid = pid;
+    cout << "Job " << j->id << " started with " << threads << " threads in ";
+    cout << dir << endl;
+}
+
+// fits returns true if queued job 'j' fits in the memory left.
+static bool fits(const job &j) {
+    return !memory_budget || used_memory() + j.memory <= memory_budget;
+}
+
+// fair_share returns the threads job 'j' is entitled to: the share of its
+// owner among the active owners, split among the active jobs of the owner.
+static int fair_share(const job &j) {
+    std::set<uid_t> owners;
+    int owned = 0;
+    for (auto const &entry : jobs) {
+        const job &other = entry.second;
+        bool active = other.state == "running" ||
+            (other.state == "queued" && fits(other));
+        if (!active) continue;
+        owners.insert(other.owner);
+        if (other.owner == j.owner) owned++;
+    }
+    int share = std::max<int>(1, total_threads / std::max<size_t>(1,
+                owners.size()));
+    share = std::max(1, share / std::max(1, owned));
+    return j.threads ? min(j.threads, share) : share;
+}
+
+// schedule starts queued jobs as long as threads and memory allow.
+static void schedule() {
+    while (true) {
+        job *next = NULL;
+        for (auto &entry : jobs) {
+            job &j = entry.second;
+            if (j.state != "queued" || free_threads(j) < 1 || !fits(j)) {
+                continue;
+            }
+            if (!next || better(j, *next)) next = &j;
+        }
+        if (!next) return;
+        launch(next, min(fair_share(*next), free_threads(*next)));
+    }
+}
+
+/* rebalance renegotiates the quotas of the running jobs. While a queued job
+ * fits in memory but finds no free thread, the jobs above their fair share
+ * are shrunk to it, so that the threads freed start the queued job. Once no
+ * job waits, the threads left (but the one reserved to small jobs) are
+ * handed to the running jobs in turn, up to their explicit thread count.
+ */
+static void rebalance() {
+    bool waiting = false;
+    for (auto const &entry : jobs) {
+        const job &j = entry.second;
+        waiting |= (j.state == "queued" && fits(j));
+    }
+    vector<job *> running;
+    for (auto &entry : jobs) {
+        if (entry.second.state == "running") running.push_back(&entry.second);
+    }
+    if (waiting) {
+        for (job *j : running) {
+            int share = fair_share(*j);
+            if (j->granted <= share || !set_quota(j, share)) continue;
+            cout << "Job " << j->id << " shrunk to " << share << " threads";
+            cout << endl;
+        }
+        return;
+    }
+    int spare = total_threads - used_threads(NULL);
+    bool small_running = false;
+    vector<int> quotas;
+    for (job *j : running) {
+        small_running |= j->small;
+        quotas.push_back(j->granted);
+    }
+    bool grown = true;
+    while (grown) {
+        grown = false;
+        for (size_t k = 0; k < running.size(); k++) {
+            const job &j = *running[k];
+            int limit = j.threads ? j.threads : total_threads;
+            // As in free_threads
+            int reserved = (!j.small && !small_running && total_threads > 1);
+            if (spare - reserved < 1 || quotas[k] >= limit) continue;
+            quotas[k]++;
+            spare--;
+            grown = true;
+        }
+    }
+    for (size_t k = 0; k < running.size(); k++) {
+        job *j = running[k];
+        if (quotas[k] == j->granted || !set_quota(j, quotas[k])) continue;
+        cout << "Job " << j->id << " grown to " << quotas[k] << " threads";
+        cout << endl;
+    }
+}
+
+// reap collects the finished jobs.
+static void reap() {
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        for (auto &entry : jobs) {
+            job &j = entry.second;
+            if (j.state != "running" || j.pid != pid) continue;
+            j.exit_code = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+            if (j.cancel) {
+                j.state = "cancelled";
+            } else {
+                j.state = (j.exit_code == 0) ? "done" : "failed";
+            }
+            cout << "Job " << j.id << " " << j.state << endl;
+        }
+    }
+}
+
+static string describe(const job &j) {
+    std::ostringstream out;
+    out << j.id << "\t" << j.state << "\t" << j.priority << "\t" << j.owner;
+    out << "\t" << j.granted << "\t" << (j.memory >> 20) << "\t";
+    out << job_dir(j) << "\t" << boost::join(j.args, " ");
+    return out.str();
+}
+
+// handle_request runs a request of a client and returns the response.
+static string handle_request(const vector<string> &request, uid_t owner) {
+    string command = request.empty() ? "" : request[0];
+    if (command == "submit" && request.size() >= 5) {
+        job j = {next_id, owner, std::stoi(request[1]),
+            std::stoull(request[2]) << 20, std::stoi(request[3]), false,
+            vector<string>(request.begin()+4, request.end()), "queued", 0, 0,
+            0, false};
+        uint64_t input_bytes = 0;
+        for (const string &arg : j.args) {
+            if (boost::filesystem::is_regular_file(arg)) {
+                input_bytes += boost::filesystem::file_size(arg);
+            }
+        }
+        j.small = input_bytes < SMALL_JOB_BYTES;
+        // Levels of the leaves' size in RAM, plus R and its next level
+        if (j.memory == 0) j.memory = 4*input_bytes + (64 << 20);
+        if (memory_budget && j.memory > memory_budget) {
+            return "error: job needs more than the memory budget\n";
+        }
+        j.threads = min(j.threads, total_threads);
+        jobs[j.id] = j;
+        cout << "Job " << j.id << " queued: " << describe(j) << endl;
+        return "ok " + to_string(next_id++) + "\n";
+    }
+    if (command == "status") {
+        string response = "id\tstate\tpriority\towner\tthreads\tMB\tdir\targs\n";
+        for (auto const &entry : jobs) {
+            if (request.size() > 1 && to_string(entry.first) != request[1]) {
+                continue;
+            }
+            response += describe(entry.second) + "\n";
+        }
+        return response;
+    }
+    if (command == "cancel" && request.size() > 1) {
+        auto it = jobs.find(std::stoull(request[1]));
+        if (it == jobs.end()) return "error: no such job\n";
+        job &j = it->second;
+        if (j.state == "queued") {
+            j.state = "cancelled";
+        } else if (j.state == "running") {
+            j.cancel = true;
+            kill(j.pid, SIGTERM);
+        }
+        return "ok\n";
+    }
+    return "error: unknown request\n";
+}
+
+/* client holds a connection: the request read so far, and once the request
+ * is complete, the part of the response not written yet.
+ */
+struct client {
+    uid_t owner;
+    time_t deadline;
+    bool answered;
+    string request;
+    string response;
+};
+
+static map<int, client> clients;
+
+static void accept_client(int listener) {
+    int fd = accept4(listener, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+    if (fd < 0) return;
+    client c = {0, time(NULL) + CLIENT_TIMEOUT, false, "", ""};
+    struct ucred credentials;
+    socklen_t length = sizeof(credentials);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &credentials,
+                &length) == 0) {
+        c.owner = credentials.uid;
+    }
+    clients[fd] = c;
+}
+
+// answer parses a complete request of a client and runs it.
+static string answer(string line, uid_t owner) {
+    boost::trim_right_if(line, boost::is_any_of("\n"));
+    vector<string> request;
+    boost::split(request, line, boost::is_any_of("\t"));
+    try {
+        return handle_request(request, owner);
+    } catch (std::exception &e) {
+        return "error: malformed request\n";
+    }
+}
+
+/* serve_client reads from (or writes to) client 'fd' as much as it can
+ * without blocking, and returns false once the client is done with.
+ */
+static bool serve_client(int fd, client *c) {
+    char buffer[4096];
+    ssize_t n;
+    while (!c->answered) {
+        n = read(fd, buffer, sizeof(buffer));
+        if (n > 0) {
+            c->request.append(buffer, n);
+        } else if (n == 0) {
+            // The client shuts down its side after the request
+            c->response = answer(c->request, c->owner);
+            c->answered = true;
+        } else if (errno != EINTR) {
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+    }
+    while (!c->response.empty()) {
+        n = write(fd, c->response.data(), c->response.size());
+        if (n >= 0) {
+            c->response.erase(0, n);
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return true;
+        } else if (errno != EINTR) {
+            cout << "Lost client: " << strerror(errno) << endl;
+            return false;
+        }
+    }
+    return false;
+}
+
+static void on_sigchld(int) {}
+
+static int serve() {
+    boost::filesystem::create_directories(jobs_dir);
+    jobs_dir = boost::filesystem::canonical(jobs_dir).string();
+    batchgcd_path = boost::filesystem::absolute(batchgcd_path).string();
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    struct sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(address.sun_path)) {
+        cout << "Fatal error: socket path too long" << endl;
+        return 1;
+    }
+    strncpy(address.sun_path, socket_path.c_str(),
+            sizeof(address.sun_path)-1);
+    unlink(socket_path.c_str());
+    if (bind(listener, (struct sockaddr *) &address, sizeof(address)) != 0 ||
+            listen(listener, 64) != 0) {
+        cout << "Fatal error: cannot listen on " << socket_path << ": ";
+        cout << strerror(errno) << endl;
+        return 1;
+    }
+    /* SIGCHLD interrupts poll (which is never restarted), so that finished
+     * jobs are replaced at once; other calls are restarted.
+     */
+    struct sigaction action = {};
+    action.sa_handler = on_sigchld;
+    action.sa_flags = SA_RESTART;
+    sigaction(SIGCHLD, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    cout << "Serving on " << socket_path << " with " << total_threads;
+    cout << " threads, memory budget ";
+    cout << (memory_budget ? to_string(memory_budget >> 20) + " MB" :
+            "unlimited") << ", jobs in " << jobs_dir << endl;
+    while (true) {
+        vector<struct pollfd> fds = {{listener, POLLIN, 0}};
+        for (auto const &entry : clients) {
+            short events = entry.second.answered ? POLLOUT : POLLIN;
+            fds.push_back({entry.first, events, 0});
+        }
+        if (poll(fds.data(), fds.size(), 1000) > 0) {
+            for (size_t k = 1; k < fds.size(); k++) {
+                if (fds[k].revents &&
+                        !serve_client(fds[k].fd, &clients[fds[k].fd])) {
+                    close(fds[k].fd);
+                    clients.erase(fds[k].fd);
+                }
+            }
+            if (fds[0].revents & POLLIN) accept_client(listener);
+        }
+        time_t now = time(NULL);
+        for (auto it = clients.begin(); it != clients.end(); ) {
+            if (now <= it->second.deadline) {
+                ++it;
+                continue;
+            }
+            cout << "Dropped client after " << CLIENT_TIMEOUT << " s" << endl;
+            close(it->first);
+            it = clients.erase(it);
+        }
+        reap();
+        rebalance();
+        schedule();
+    }
+}
+
+// request sends a request to the daemon and returns its response.
+static string request(const vector<string> &fields) {
+    int server = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, socket_path.c_str(),
+            sizeof(address.sun_path)-1);
+    if (connect(server, (struct sockaddr *) &address, sizeof(address)) != 0) {
+        cout << "Fatal error: no scheduler on " << socket_path << ": ";
+        cout << strerror(errno) << endl;
+        exit(1);
+    }
+    string line = boost::join(fields, "\t") + "\n";
+    if (write(server, line.data(), line.size()) < 0) {
+        cout << "Fatal error: " << strerror(errno) << endl;
+        exit(1);
+    }
+    shutdown(server, SHUT_WR);
+    string response;
+    char buffer[4096];
+    ssize_t n;
+    while ((n = read(server, buffer, sizeof(buffer))) > 0) {
+        response.append(buffer, n);
+    }
+    close(server);
+    return response;
+}
+
+// job_state returns the state of job 'id', as listed by the daemon.
+static string job_state(string id) {
+    std::istringstream lines(request({"status", id}));
+    string line;
+    std::getline(lines, line);
+    if (!std::getline(lines, line)) return "";
+    vector<string> fields;
+    boost::split(fields, line, boost::is_any_of("\t"));
+    return fields.size() > 1 ? fields[1] : "";
+}
+
+int main(int argc, char** argv) {
+    int priority = 0, threads = 0;
+    uint64_t memory = 0;
+    static struct option long_options[] = {
+          {"threads", required_argument, 0, 't'},
+          {"memory", required_argument, 0, 'm'},
+          {"priority", required_argument, 0, 'p'},
+          {"socket", required_argument, 0, 's'},
+          {"jobs", required_argument, 0, 'j'},
+          {"batchgcd", required_argument, 0, 'b'},
+          {0, 0, 0, 0}
+        };
+    int option_index = 0;
+    int c;
+    while ((c = getopt_long_only(argc, argv, "", long_options,
+                    &option_index)) != -1) {
+        if (c == 't') threads = std::max(1, atoi(optarg));
+        // In MB
+        if (c == 'm') memory = strtoull(optarg, NULL, 10);
+        if (c == 'p') priority = atoi(optarg);
+        if (c == 's') socket_path = optarg;
+        if (c == 'j') jobs_dir = optarg;
+        if (c == 'b') batchgcd_path = optarg;
+    }
+    string command = optind < argc ? argv[optind] : "";
+    if (command == "serve") {
+        total_threads = threads ? threads : std::max(1L,
+                sysconf(_SC_NPROCESSORS_ONLN));
+        memory_budget = memory << 20;
+        return serve();
+    }
+    if (command == "submit" && optind + 1 < argc) {
+        vector<string> fields = {"submit", to_string(priority),
+            to_string(memory), to_string(threads)};
+        for (int k = optind+1; k < argc; k++) {
+            string arg = argv[k];
+            if (boost::filesystem::exists(arg)) {
+                arg = boost::filesystem::absolute(arg).string();
+            }
+            fields.push_back(arg);
+        }
+        string response = request(fields);
+        cout << response;
+        return response.compare(0, 2, "ok") == 0 ? 0 : 1;
+    }
+    if (command == "status") {
+        vector<string> fields = {"status"};
+        if (optind + 1 < argc) fields.push_back(argv[optind+1]);
+        cout << request(fields);
+        return 0;
+    }
+    if (command == "cancel" && optind + 1 < argc) {
+        string response = request({"cancel", argv[optind+1]});
+        cout << response;
+        return response.compare(0, 2, "ok") == 0 ? 0 : 1;
+    }
+    if (command == "wait" && optind + 1 < argc) {
+        string state;
+        while ((state = job_state(argv[optind+1])) == "queued" ||
+                state == "running") {
+            sleep(1);
+        }
+        cout << "Job " << argv[optind+1] << " " << state << endl;
+        return state == "done" ? 0 : 1;
+    }
+    cout << "Usage: batchgcd_sched serve|submit|status|wait|cancel ";
+    cout << "(see src/batchgcd_sched.cpp)" << endl;
+    return 1;
+}
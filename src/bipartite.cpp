@@ -0,0 +1,107 @@
+#include "bipartite.hpp"
+#include "opstats.hpp"
+
+using std::cout;
+using std::endl;
+
+/* Bipartite batch GCD
+ *
+ * Given two sets of moduli A and B, only GCDs between a modulus of A and a
+ * modulus of B are wanted. With Zₐ, Z_b the products of A and B, the
+ * remainder trees
+ *
+ *              remᵢ <- Z_b mod Aᵢ,       remⱼ <- Zₐ mod Bⱼ
+ *
+ * followed by gcd(remᵢ, Aᵢ) and gcd(remⱼ, Bⱼ) give exactly the cross-corpus
+ * hits. Nodes are never squared and no tree over A∪B is built, which makes
+ * this much cheaper than a batch GCD of the union when one side is small.
+ */
+
+/* load_or_build_tree makes the product tree of 'input' available in TREE_DIR:
+ * if 'input' is a directory with a stored tree (e.g. a previous run), the
+ * tree is reused, and its upper levels are rebuilt from the leaves if a Part
+ * (B) deleted them; otherwise it is a csv file, whose tree is built in 'dir'.
+ * The IDs of the leaves are loaded into IDs. Returns the amount of levels.
+ */
+int load_or_build_tree(string input, string dir, int base,
+        vector<string> *IDs) {
+    if (boost::filesystem::is_directory(input)) {
+        cout << "Reusing product tree stored in " << input << endl;
+        TREE_DIR = input;
+        read_ids(IDs);
+        int levels = read_tree_manifest();
+        if (manifest_get("pruned") != "yes") {
+            return levels;
+        }
+        cout << "   Its upper levels were deleted by Part (B), ";
+        cout << "rebuilding them from the leaves" << endl;
+        vector<mpz_class> moduli;
+        read_level_from_file(0, &moduli);
+        levels = product_tree(&moduli, false);
+        manifest_set("pruned", "no");
+        return levels;
+    }
+    TREE_DIR = dir;
+    boost::filesystem::create_directories(TREE_DIR);
+    vector<mpz_class> moduli;
+    read_moduli_from_csv(input, &moduli, IDs, base);
+    write_ids(IDs);
+    return product_tree(&moduli);
+}
+
+/* cross_gcds sets R[i] <- gcd(Z mod Xᵢ, Xᵢ) for the leaves Xᵢ of the tree
+ * stored in 'dir', and reports the hits in files with the given suffix.
+ */
+static void cross_gcds(string dir, const mpz_class &Z, vector<string> *IDs,
+        string suffix) {
+    TREE_DIR = dir;
+    int levels = read_tree_manifest();
+    vector<mpz_class> R, X;
+    remainders_mod(levels, Z, &R);
+    read_level_from_file(0, &X);
+    for (size_t i = 0; i < X.size(); i++) {
+        op_gcd(R[i].get_mpz_t(), R[i].get_mpz_t(), X[i].get_mpz_t());
+    }
+    vector<string> compromised;
+    vector<string> duplicates;
+    size_t false_positives = classify_results(&R, &X, IDs, &compromised,
+            &duplicates);
+    report_results(X.size(), &compromised, &duplicates, false_positives,
+            suffix);
+}
+
+/* bipartite_gcds reports the moduli of A sharing a factor with some modulus
+ * of B in compromised.csv (duplicates.csv if all of its factors are in B),
+ * and vice versa in compromised_against.csv and duplicates_against.csv.
+ * Stored trees are kept, and can be passed instead of the csv files later.
+ */
+void bipartite_gcds(string input_A, string input_B, int base) {
+    string dir = TREE_DIR;
+    vector<string> IDs_A, IDs_B;
+    vector<mpz_class> root;
+
+    cout << " ----------------------------------------- " << endl;
+    cout << "| Product trees of both sets of moduli     |" << endl;
+    cout << " ----------------------------------------- " << endl;
+    int levels_A = load_or_build_tree(input_A, dir, base, &IDs_A);
+    string dir_A = TREE_DIR;
+    read_level_from_file(levels_A-1, &root);
+    mpz_class Z_A = root[0];
+    int levels_B = load_or_build_tree(input_B, dir + "_against", base,
+            &IDs_B);
+    string dir_B = TREE_DIR;
+    read_level_from_file(levels_B-1, &root);
+    mpz_class Z_B = root[0];
+    vector<mpz_class>().swap(root);
+
+    cout << " ----------------------------------------- " << endl;
+    cout << "| Remainders of Z_b down the tree of A     |" << endl;
+    cout << " ----------------------------------------- " << endl;
+    cross_gcds(dir_A, Z_B, &IDs_A, "");
+    Z_B = 0;
+
+    cout << " ----------------------------------------- " << endl;
+    cout << "| Remainders of Zₐ down the tree of B     |" << endl;
+    cout << " ----------------------------------------- " << endl;
+    cross_gcds(dir_B, Z_A, &IDs_B, "_against");
+}
@@ -0,0 +1,9 @@
+#ifndef SRC_BIPARTITE_HPP_
+#define SRC_BIPARTITE_HPP_
+
+#include "utils.hpp"
+
+int load_or_build_tree(string input, string dir, int base, vector<string> *);
+void bipartite_gcds(string input_A, string input_B, int base);
+
+#endif /* SRC_BIPARTITE_HPP_ */
@@ -0,0 +1,63 @@
+#include "corpus.hpp"
+
+using std::cout;
+using std::endl;
+
+/* Synthetic RSA corpora for benchmarking
+ *
+ * generate_corpus writes 'count' moduli of 'bits' bits to a csv file, in the
+ * input format of batchgcd ("<ID>,<hex modulus>"). One modulus out of
+ * WEAK_EVERY takes one of its primes from a small shared pool, as a broken
+ * key generator would, so that the run has results to find. Modulus i only
+ * depends on (seed, i): the corpus is the same for any amount of threads.
+ */
+static const size_t WEAK_EVERY = 50;
+static const int SHARED_PRIMES = 16;
+
+static mpz_class random_prime(gmp_randclass *random, unsigned int bits) {
+    mpz_class p = random->get_z_bits(bits);
+    /* Top two bits set: p >= 1.5 * 2^(bits-1), so that the product of primes
+     * of a and b bits has exactly a+b bits (with the top bit alone it can
+     * have a+b-1).
+     */
+    mpz_setbit(p.get_mpz_t(), bits-1);
+    mpz_setbit(p.get_mpz_t(), bits-2);
+    mpz_nextprime(p.get_mpz_t(), p.get_mpz_t());
+    return p;
+}
+
+void generate_corpus(string filename, size_t count, unsigned int bits,
+        unsigned long seed) {
+    cout << "Generating " << count << " moduli of " << bits << " bits" << endl;
+    gmp_randclass pool_random(gmp_randinit_mt);
+    pool_random.seed(seed);
+    vector<mpz_class> shared(SHARED_PRIMES);
+    for (int k = 0; k < SHARED_PRIMES; k++) {
+        shared[k] = random_prime(&pool_random, bits/2);
+    }
+    vector<string> lines(count);
+    vector<boost::thread> threads;
+    for (int j = 0; j < N_THREADS; j++) {
+        threads.push_back(boost::thread([j, count, bits, seed, &shared,
+                    &lines]() {
+            gmp_randclass random(gmp_randinit_mt);
+            for (size_t i = j; i < count; i += N_THREADS) {
+                random.seed(seed * 1000003 + i + 1);
+                mpz_class p = random_prime(&random, bits/2);
+                if (i % WEAK_EVERY == 0) {
+                    mpz_class k = random.get_z_range(SHARED_PRIMES);
+                    p = shared[k.get_ui()];
+                }
+                mpz_class n = p * random_prime(&random, bits - bits/2);
+                lines[i] = "k" + std::to_string(i) + "," + n.get_str(16);
+            }
+            }));
+    }
+    for (auto& th : threads)
+        th.join();
+    std::ofstream file(filename);
+    for (size_t i = 0; i < count; i++) {
+        file << lines[i] << "\n";
+    }
+    cout << "Corpus written to " << filename << endl;
+}
@@ -0,0 +1,8 @@
+#ifndef SRC_CORPUS_HPP_
+#define SRC_CORPUS_HPP_
+
+#include "utils.hpp"
+
+void generate_corpus(string, size_t, unsigned int, unsigned long);
+
+#endif /* SRC_CORPUS_HPP_ */
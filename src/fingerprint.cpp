@@ -0,0 +1,180 @@
+#include "fingerprint.hpp"
+#include <memory>
+#include <random>
+#include <sstream>
+
+using std::cout;
+using std::endl;
+using std::to_string;
+
+/* Algebraic fingerprints of the stored product tree
+ *
+ * A few random 64-bit primes are drawn for each tree, and the residues of the
+ * root modulo these primes are stored in the manifest (key 'fingerprint').
+ * Since every node is the product of its children, the residues of two
+ * children multiply to the residue of their parent, and the product of the
+ * residues of any level is the fingerprint of the root. verify_tree checks
+ * this for all nodes in one streaming pass over the levels, which catches
+ * silent corruption without redoing any multiplication.
+ */
+
+/* fingerprint_primes returns the primes of the tree in TREE_DIR, drawing and
+ * storing them in the manifest if the tree has none yet.
+ */
+fingerprint fingerprint_primes() {
+    fingerprint primes;
+    string stored = manifest_get("fingerprint_primes");
+    if (stored != "") {
+        std::istringstream in(stored);
+        for (int k = 0; k < FINGERPRINT_PRIMES; k++) {
+            in >> std::hex >> primes[k];
+        }
+        return primes;
+    }
+    std::random_device device;
+    std::mt19937_64 generator((static_cast<uint64_t>(device()) << 32) ^
+            device());
+    string hex = "";
+    for (int k = 0; k < FINGERPRINT_PRIMES; k++) {
+        // Random prime in [2^62, 2^64)
+        mpz_class p = static_cast<unsigned long>(generator() | (1ULL << 62));
+        mpz_nextprime(p.get_mpz_t(), p.get_mpz_t());
+        if (!p.fits_ulong_p()) {
+            k--;
+            continue;
+        }
+        primes[k] = p.get_ui();
+        hex += (k ? " " : "") + p.get_str(16);
+    }
+    manifest_set("fingerprint_primes", hex);
+    return primes;
+}
+
+// fingerprint_one is the fingerprint of 1 (and of an empty product).
+fingerprint fingerprint_one() {
+    fingerprint f;
+    f.fill(1);
+    return f;
+}
+
+// fingerprint_of returns the residues of x modulo each prime.
+fingerprint fingerprint_of(const fingerprint &primes, mpz_srcptr x) {
+    fingerprint f;
+    for (int k = 0; k < FINGERPRINT_PRIMES; k++) {
+        f[k] = mpz_fdiv_ui(x, primes[k]);
+    }
+    return f;
+}
+
+// fingerprint_mul sets f <- f * g, residue by residue.
+void fingerprint_mul(const fingerprint &primes, fingerprint *f,
+        const fingerprint &g) {
+    for (int k = 0; k < FINGERPRINT_PRIMES; k++) {
+        (*f)[k] = static_cast<uint64_t>(
+                static_cast<unsigned __int128>((*f)[k]) * g[k] % primes[k]);
+    }
+}
+
+static string fingerprint_to_string(const fingerprint &f) {
+    std::ostringstream out;
+    for (int k = 0; k < FINGERPRINT_PRIMES; k++) {
+        out << (k ? " " : "") << std::hex << f[k];
+    }
+    return out.str();
+}
+
+// store_tree_fingerprint stores the fingerprint of the root, i.e. of any level.
+void store_tree_fingerprint(const fingerprint &f) {
+    manifest_set("fingerprint", fingerprint_to_string(f));
+}
+
+/* tree_check holds the state of verify_tree: an open stream on each stored
+ * level, read once from the first node to the last, and the fingerprint of
+ * the nodes read so far on each level.
+ */
+struct tree_check {
+    fingerprint primes;
+    vector<std::unique_ptr<level_stream>> streams;
+    vector<fingerprint> level_products;
+    bool ok;
+
+    // below returns the highest stored level under 'l', or -1.
+    int below(int l) const {
+        for (int b = l-1; b >= 0; b--) {
+            if (streams[b]) return b;
+        }
+        return -1;
+    }
+
+    /* node reads node j of stored level l, checks it against its descendants
+     * in the stored level below (read by the same recursion, i.e. in order),
+     * and returns its fingerprint.
+     */
+    fingerprint node(int l, size_t j) {
+        mpz_class x;
+        streams[l]->next(x.get_mpz_t());
+        fingerprint f = fingerprint_of(primes, x.get_mpz_t());
+        fingerprint_mul(primes, &level_products[l], f);
+        int b = below(l);
+        if (b < 0) return f;
+        // Node j covers an aligned range of the nodes of level b, orphans
+        // being carried up unchanged
+        fingerprint product = fingerprint_one();
+        size_t first = j << (l - b);
+        size_t last = std::min<size_t>((j+1) << (l - b), intsPerFloor[b]);
+        for (size_t i = first; i < last; i++) {
+            fingerprint_mul(primes, &product, node(b, i));
+        }
+        if (product != f) {
+            cout << "   Node " << j << " of level " << l;
+            cout << " does not match its descendants in level " << b << endl;
+            ok = false;
+        }
+        return f;
+    }
+};
+
+/* verify_tree checks the fingerprints of the stored tree in a single
+ * streaming pass: every node must be the product of its children (or of its
+ * descendants in the stored level below, for levels skipped by
+ * product_tree) modulo the fingerprint primes, and every level must match
+ * the fingerprint of the tree. The levels are walked depth-first from the
+ * root, which reads each of them once, in order, and keeps one node per
+ * level in memory. Levels deleted by Part (B) or skipped by product_tree are
+ * not checked. Returns true if the tree is consistent.
+ */
+bool verify_tree(int levels) {
+    tree_check check;
+    check.primes = fingerprint_primes();
+    check.streams.resize(levels);
+    check.level_products.assign(levels, fingerprint_one());
+    check.ok = true;
+    int top = -1;
+    for (int l = 0; l < levels; l++) {
+        if (!boost::filesystem::exists(index_filename(l))) {
+            cout << "   Level " << l << " is not stored, skipping" << endl;
+            continue;
+        }
+        check.streams[l].reset(new level_stream(l));
+        top = l;
+    }
+    if (top >= 0) {
+        cout << "   Verifying levels 0 to " << top << endl;
+        for (size_t j = 0; j < intsPerFloor[top]; j++) {
+            check.node(top, j);
+        }
+    }
+    string stored = manifest_get("fingerprint");
+    for (int l = 0; l < levels; l++) {
+        if (!check.streams[l] || stored == "" ||
+                fingerprint_to_string(check.level_products[l]) == stored) {
+            continue;
+        }
+        cout << "   Level " << l << " does not match the fingerprint of";
+        cout << " the tree" << endl;
+        check.ok = false;
+    }
+    cout << (check.ok ? "   Product tree verified" :
+            "   Corrupted product tree") << endl;
+    return check.ok;
+}
@@ -0,0 +1,21 @@
+#ifndef SRC_FINGERPRINT_HPP_
+#define SRC_FINGERPRINT_HPP_
+
+#include <array>
+#include <cstdint>
+#include "utils.hpp"
+
+static const int FINGERPRINT_PRIMES = 3;
+
+// Residues of an integer (or a product) modulo each fingerprint prime, or the
+// primes themselves.
+typedef std::array<uint64_t, FINGERPRINT_PRIMES> fingerprint;
+
+fingerprint fingerprint_primes();
+fingerprint fingerprint_one();
+fingerprint fingerprint_of(const fingerprint &, mpz_srcptr);
+void fingerprint_mul(const fingerprint &, fingerprint *, const fingerprint &);
+void store_tree_fingerprint(const fingerprint &);
+bool verify_tree(int levels);
+
+#endif /* SRC_FINGERPRINT_HPP_ */
@@ -0,0 +1,146 @@
+#include "known_primes.hpp"
+#include <algorithm>
+#include "opstats.hpp"
+
+using std::cout;
+using std::endl;
+using std::min;
+using std::max;
+
+/* Known-bad-prime screening
+ *
+ * Every prime recovered from a compromised modulus is kept in a database
+ * (a text file with one prime per line, in base 16). Before the full run, the
+ * product P of the known primes is reduced modulo the input moduli with a
+ * remainder tree, which flags every modulus sharing a known prime through
+ * gcd(P mod Xᵢ, Xᵢ). Flagged moduli are reported as compromised and removed
+ * from the main batch. Their cofactors are new primes, which are screened as
+ * well until no more moduli are flagged.
+ *
+ * Moduli are screened in chunks whose product is about the size of P, so
+ * that memory stays bounded and chunks can be processed concurrently.
+ */
+
+// read_known_primes loads the database; a missing file is an empty database.
+void read_known_primes(string filename, vector<mpz_class> *primes) {
+    std::ifstream file(filename);
+    string line;
+    while (std::getline(file, line)) {
+        boost::trim(line);
+        if (line.empty()) continue;
+        primes->push_back(mpz_class(line, 16));
+    }
+    cout << "Read " << primes->size() << " known primes from " << filename;
+    cout << endl;
+}
+
+// write_known_primes stores the database, sorted and without repetitions.
+void write_known_primes(string filename, vector<mpz_class> *primes) {
+    std::sort(primes->begin(), primes->end());
+    primes->erase(std::unique(primes->begin(), primes->end()),
+            primes->end());
+    string tmp = filename + ".tmp";
+    std::ofstream file(tmp);
+    for (size_t i = 0; i < primes->size(); i++) {
+        file << (*primes)[i].get_str(16) << "\n";
+    }
+    file.close();
+    rename(tmp.c_str(), filename.c_str());
+    cout << "Stored " << primes->size() << " known primes in " << filename;
+    cout << endl;
+}
+
+/* screen_chunk sets G[i] <- gcd(P mod Xᵢ, Xᵢ) for the moduli X[first, last),
+ * through an in-memory remainder tree of P.
+ */
+static void screen_chunk(const mpz_class &P, vector<mpz_class> *X,
+        size_t first, size_t last, vector<mpz_class> *G) {
+    vector<mpz_class> chunk(X->begin() + first, X->begin() + last);
+    vector<vector<mpz_class>> tree;
+    product_tree_in_memory(&chunk, &tree, false);
+    vector<mpz_class> R;
+    remainders_in_memory(&tree, P, &R);
+    for (size_t i = first; i < last; i++) {
+        op_gcd((*G)[i].get_mpz_t(), R[i-first].get_mpz_t(),
+                (*X)[i].get_mpz_t());
+    }
+}
+
+/* screen_known_primes removes from X (and IDs) the moduli divisible by some
+ * of the given primes, moving their IDs to 'flagged'. Primes recovered on the
+ * way (i.e. prime cofactors of flagged moduli) are appended to 'primes'.
+ */
+void screen_known_primes(vector<mpz_class> *X, vector<string> *IDs,
+        vector<mpz_class> *primes, vector<string> *flagged) {
+    vector<mpz_class> screening(*primes);
+    while (!screening.empty() && !X->empty()) {
+        cout << "   Screening " << X->size() << " moduli against ";
+        cout << screening.size() << " known primes" << endl;
+        mpz_class P;
+        product_of(&screening, &P);
+
+        // Chunks of about the size of P, processed by N_THREADS threads
+        size_t bits = mpz_sizeinbase((*X)[0].get_mpz_t(), 2);
+        size_t chunk = max<size_t>(1, min<size_t>(1 << 16,
+                    mpz_sizeinbase(P.get_mpz_t(), 2) / bits));
+        vector<mpz_class> G(X->size());
+        vector<boost::thread> threads;
+        int n_threads = min<size_t>(N_THREADS,
+                (X->size() + chunk - 1) / chunk);
+        for (int j = 0; j < n_threads; j++) {
+            threads.push_back(boost::thread([j, n_threads, chunk, &P, X,
+                        &G]() {
+                for (size_t first = j*chunk; first < X->size();
+                        first += n_threads*chunk) {
+                    screen_chunk(P, X, first, min(first + chunk, X->size()),
+                            &G);
+                }
+                }));
+        }
+        for (auto& th : threads)
+            th.join();
+
+        // Strip flagged moduli, and screen again with their cofactors
+        vector<mpz_class>().swap(screening);
+        size_t kept = 0;
+        for (size_t i = 0; i < X->size(); i++) {
+            if (G[i] == 1) {
+                (*X)[kept].swap((*X)[i]);
+                (*IDs)[kept].swap((*IDs)[i]);
+                kept++;
+                continue;
+            }
+            flagged->push_back((*IDs)[i]);
+            mpz_class cofactor = (*X)[i] / G[i];
+            if (cofactor > 1 &&
+                    mpz_probab_prime_p(cofactor.get_mpz_t(), 25)) {
+                screening.push_back(cofactor);
+            }
+        }
+        cout << "   Flagged " << X->size() - kept << " moduli" << endl;
+        X->resize(kept);
+        IDs->resize(kept);
+        std::sort(screening.begin(), screening.end());
+        screening.erase(std::unique(screening.begin(), screening.end()),
+                screening.end());
+        primes->insert(primes->end(), screening.begin(), screening.end());
+    }
+}
+
+/* collect_recovered_primes appends to 'primes' the prime factors revealed by
+ * Part (C), i.e. Rᵢ = gcd and Xᵢ/Rᵢ, whenever they are prime.
+ */
+void collect_recovered_primes(vector<mpz_class> *R, vector<mpz_class> *X,
+        vector<mpz_class> *primes) {
+    for (size_t i = 0; i < X->size(); i++) {
+        if ((*R)[i] == 1 || (*R)[i] == 0 || (*R)[i] == (*X)[i]) {
+            continue;
+        }
+        mpz_class factors[2] = {(*R)[i], (*X)[i] / (*R)[i]};
+        for (int k = 0; k < 2; k++) {
+            if (mpz_probab_prime_p(factors[k].get_mpz_t(), 25)) {
+                primes->push_back(factors[k]);
+            }
+        }
+    }
+}
@@ -0,0 +1,13 @@
+#ifndef SRC_KNOWN_PRIMES_HPP_
+#define SRC_KNOWN_PRIMES_HPP_
+
+#include "utils.hpp"
+
+void read_known_primes(string, vector<mpz_class> *);
+void write_known_primes(string, vector<mpz_class> *);
+void screen_known_primes(vector<mpz_class> *, vector<string> *,
+        vector<mpz_class> *, vector<string> *);
+void collect_recovered_primes(vector<mpz_class> *, vector<mpz_class> *,
+        vector<mpz_class> *);
+
+#endif /* SRC_KNOWN_PRIMES_HPP_ */
@@ -0,0 +1,817 @@
+#include "ntt.hpp"
+#include <immintrin.h>
+#include <functional>
+
+using std::min;
+using std::max;
+
+/* Multi-prime NTT multiplication
+ *
+ * The top levels of the trees multiply operands of hundreds of MB, where the
+ * FFT of GMP runs on a single thread. ntt_mul cuts the operands into 32-bit
+ * digits and computes their convolution with number-theoretic transforms
+ * modulo three primes p < 2^31 whose multiplicative group has a subgroup of
+ * order 2^25:
+ *
+ *      2013265921 = 15·2^27 + 1,  1811939329 = 27·2^26 + 1,
+ *      2113929217 = 63·2^25 + 1.
+ *
+ * Each coefficient of a convolution of up to 2^25 digits is below
+ * 2^25 · (2^32)^2 = 2^89, less than the product of the primes (> 2^92), so
+ * that it is recovered exactly by the Chinese remainder theorem (Garner),
+ * and the carries are then propagated. Larger products are first split with
+ * Karatsuba (or into halves of the larger operand when unbalanced).
+ *
+ * Residues use Montgomery multiplication with R = 2^32, which maps onto the
+ * 32x32->64-bit lane products of AVX2 and AVX-512: the butterflies run on 8
+ * or 16 residues at once, picked at run time from the CPU (see NTT_KERNEL),
+ * with a scalar fallback. The forward transform is a decimation in frequency
+ * and the inverse a decimation in time, so that no bit reversal is needed.
+ * Stages whose butterflies span more than NTT_BLOCK residues are passes over
+ * the whole array; the other stages run block by block while the block is in
+ * cache. Both are split among N_THREADS threads.
+ */
+size_t NTT_MIN_BITS = 1 << 22;
+size_t NTT_MAX_LENGTH = 1 << 25;
+string NTT_KERNEL = "auto";
+
+static const size_t NTT_BLOCK = 1 << 14;
+static const size_t PASS_CHUNK = 1 << 9;
+static_assert(GMP_NUMB_BITS == 64, "ntt_mul expects 64-bit limbs");
+
+// A prime p with a generator g of its multiplicative group, and its
+// Montgomery constants: pinv = -1/p mod 2^32.
+struct ntt_prime {
+    uint32_t p, g, pinv;
+};
+
+static uint32_t neg_inverse(uint32_t p) {
+    // Newton's iteration doubles the correct low bits of 1/p mod 2^32
+    uint32_t x = p;
+    for (int k = 0; k < 4; k++) x *= 2 - p * x;
+    return -x;
+}
+
+static ntt_prime make_prime(uint32_t p, uint32_t g) {
+    return {p, g, neg_inverse(p)};
+}
+
+static const ntt_prime PRIMES[3] = {make_prime(2013265921, 31),
+    make_prime(1811939329, 13), make_prime(2113929217, 5)};
+
+static uint64_t pow_mod(uint64_t base, uint64_t exponent, uint64_t p) {
+    uint64_t result = 1;
+    base %= p;
+    for (; exponent; exponent >>= 1) {
+        if (exponent & 1) result = result * base % p;
+        base = base * base % p;
+    }
+    return result;
+}
+
+static inline uint32_t mod_add(uint32_t a, uint32_t b, uint32_t p) {
+    uint32_t s = a + b;
+    return s >= p ? s - p : s;
+}
+
+static inline uint32_t mod_sub(uint32_t a, uint32_t b, uint32_t p) {
+    return a >= b ? a - b : a + p - b;
+}
+
+// mont_mul returns a*b/2^32 mod p, for a, b < p.
+static inline uint32_t mont_mul(uint32_t a, uint32_t b, const ntt_prime &q) {
+    uint64_t t = static_cast<uint64_t>(a) * b;
+    uint32_t m = static_cast<uint32_t>(t) * q.pinv;
+    uint32_t r = (t + static_cast<uint64_t>(m) * q.p) >> 32;
+    return r >= q.p ? r - q.p : r;
+}
+
+/* The kernels, on 'count' consecutive residues:
+ *   dif        (x, y) <- (x + y, (x - y) w)
+ *   dit        (x, y) <- (x + y w, x - y w)
+ *   pointwise  x <- x y / 2^32
+ *   scale      x <- x c / 2^32
+ * and dif_short and dit_short, which run a whole stage whose pairs are 'len'
+ * < 'lanes' residues apart on 'count' residues (a multiple of 2 lanes).
+ */
+struct ntt_kernel {
+    const char *name;
+    size_t lanes;
+    void (*dif)(uint32_t *, uint32_t *, const uint32_t *, size_t,
+            const ntt_prime &);
+    void (*dit)(uint32_t *, uint32_t *, const uint32_t *, size_t,
+            const ntt_prime &);
+    void (*pointwise)(uint32_t *, const uint32_t *, size_t, const ntt_prime &);
+    void (*scale)(uint32_t *, uint32_t, size_t, const ntt_prime &);
+    void (*dif_short)(uint32_t *, size_t, size_t, const uint32_t *,
+            const ntt_prime &);
+    void (*dit_short)(uint32_t *, size_t, size_t, const uint32_t *,
+            const ntt_prime &);
+};
+
+/* In a short stage, lane t of the vectors x and y takes the pair of residues
+ * 2 len (t / len) + t % len and len further, out of 2 vectors of residues;
+ * 'out' maps them back to lanes of x (< lanes) or y (>= lanes).
+ */
+struct short_pattern {
+    uint32_t x[16], y[16], out[32], w[16];
+
+    short_pattern(size_t len, size_t lanes, const uint32_t *twiddles) {
+        for (size_t t = 0; t < lanes; t++) {
+            x[t] = 2*len*(t / len) + t % len;
+            y[t] = x[t] + len;
+            out[x[t]] = t;
+            out[y[t]] = lanes + t;
+            w[t] = twiddles[len + t % len];
+        }
+    }
+};
+
+static void dif_scalar(uint32_t *x, uint32_t *y, const uint32_t *w,
+        size_t count, const ntt_prime &q) {
+    for (size_t i = 0; i < count; i++) {
+        uint32_t u = x[i], v = y[i];
+        x[i] = mod_add(u, v, q.p);
+        y[i] = mont_mul(mod_sub(u, v, q.p), w[i], q);
+    }
+}
+
+static void dit_scalar(uint32_t *x, uint32_t *y, const uint32_t *w,
+        size_t count, const ntt_prime &q) {
+    for (size_t i = 0; i < count; i++) {
+        uint32_t u = x[i], v = mont_mul(y[i], w[i], q);
+        x[i] = mod_add(u, v, q.p);
+        y[i] = mod_sub(u, v, q.p);
+    }
+}
+
+static void pointwise_scalar(uint32_t *x, const uint32_t *y, size_t count,
+        const ntt_prime &q) {
+    for (size_t i = 0; i < count; i++) x[i] = mont_mul(x[i], y[i], q);
+}
+
+static void scale_scalar(uint32_t *x, uint32_t c, size_t count,
+        const ntt_prime &q) {
+    for (size_t i = 0; i < count; i++) x[i] = mont_mul(x[i], c, q);
+}
+
+#pragma GCC push_options
+#pragma GCC target("avx2")
+
+/* mont_mul_avx2 is mont_mul on 8 lanes: the even and odd lanes are multiplied
+ * separately into 64-bit products, whose high halves are merged back.
+ */
+static inline __m256i mont_mul_avx2(__m256i a, __m256i b, __m256i p,
+        __m256i pinv) {
+    __m256i even = _mm256_mul_epu32(a, b);
+    __m256i odd = _mm256_mul_epu32(_mm256_srli_epi64(a, 32),
+            _mm256_srli_epi64(b, 32));
+    even = _mm256_add_epi64(even,
+            _mm256_mul_epu32(_mm256_mul_epu32(even, pinv), p));
+    odd = _mm256_add_epi64(odd,
+            _mm256_mul_epu32(_mm256_mul_epu32(odd, pinv), p));
+    __m256i r = _mm256_blend_epi32(_mm256_srli_epi64(even, 32), odd, 0xAA);
+    return _mm256_min_epu32(r, _mm256_sub_epi32(r, p));
+}
+
+static inline __m256i mod_add_avx2(__m256i a, __m256i b, __m256i p) {
+    __m256i s = _mm256_add_epi32(a, b);
+    return _mm256_min_epu32(s, _mm256_sub_epi32(s, p));
+}
+
+static inline __m256i mod_sub_avx2(__m256i a, __m256i b, __m256i p) {
+    __m256i d = _mm256_add_epi32(a, _mm256_sub_epi32(p, b));
+    return _mm256_min_epu32(d, _mm256_sub_epi32(d, p));
+}
+
+static inline __m256i load_avx2(const uint32_t *x) {
+    return _mm256_loadu_si256(reinterpret_cast<const __m256i *>(x));
+}
+
+static inline void store_avx2(uint32_t *x, __m256i v) {
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(x), v);
+}
+
+static void dif_avx2(uint32_t *x, uint32_t *y, const uint32_t *w,
+        size_t count, const ntt_prime &q) {
+    __m256i p = _mm256_set1_epi32(q.p), pinv = _mm256_set1_epi32(q.pinv);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i u = load_avx2(x + i), v = load_avx2(y + i);
+        store_avx2(x + i, mod_add_avx2(u, v, p));
+        store_avx2(y + i, mont_mul_avx2(mod_sub_avx2(u, v, p),
+                    load_avx2(w + i), p, pinv));
+    }
+    dif_scalar(x + i, y + i, w + i, count - i, q);
+}
+
+static void dit_avx2(uint32_t *x, uint32_t *y, const uint32_t *w,
+        size_t count, const ntt_prime &q) {
+    __m256i p = _mm256_set1_epi32(q.p), pinv = _mm256_set1_epi32(q.pinv);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i u = load_avx2(x + i);
+        __m256i v = mont_mul_avx2(load_avx2(y + i), load_avx2(w + i), p, pinv);
+        store_avx2(x + i, mod_add_avx2(u, v, p));
+        store_avx2(y + i, mod_sub_avx2(u, v, p));
+    }
+    dit_scalar(x + i, y + i, w + i, count - i, q);
+}
+
+// permute2_avx2 gathers lanes 'index' (< 16) of v0|v1, given 'high' (>= 8).
+static inline __m256i permute2_avx2(__m256i v0, __m256i v1, __m256i index,
+        __m256i high) {
+    return _mm256_blendv_epi8(_mm256_permutevar8x32_epi32(v0, index),
+            _mm256_permutevar8x32_epi32(v1, index), high);
+}
+
+static void dif_short_avx2(uint32_t *a, size_t count, size_t len,
+        const uint32_t *w, const ntt_prime &q) {
+    __m256i p = _mm256_set1_epi32(q.p), pinv = _mm256_set1_epi32(q.pinv);
+    short_pattern pattern(len, 8, w);
+    __m256i seven = _mm256_set1_epi32(7);
+    __m256i ix = load_avx2(pattern.x), iy = load_avx2(pattern.y);
+    __m256i o0 = load_avx2(pattern.out), o1 = load_avx2(pattern.out + 8);
+    __m256i hx = _mm256_cmpgt_epi32(ix, seven);
+    __m256i hy = _mm256_cmpgt_epi32(iy, seven);
+    __m256i h0 = _mm256_cmpgt_epi32(o0, seven);
+    __m256i h1 = _mm256_cmpgt_epi32(o1, seven);
+    __m256i tw = load_avx2(pattern.w);
+    for (size_t i = 0; i < count; i += 16) {
+        __m256i v0 = load_avx2(a + i), v1 = load_avx2(a + i + 8);
+        __m256i x = permute2_avx2(v0, v1, ix, hx);
+        __m256i y = permute2_avx2(v0, v1, iy, hy);
+        __m256i sum = mod_add_avx2(x, y, p);
+        __m256i diff = mont_mul_avx2(mod_sub_avx2(x, y, p), tw, p, pinv);
+        store_avx2(a + i, permute2_avx2(sum, diff, o0, h0));
+        store_avx2(a + i + 8, permute2_avx2(sum, diff, o1, h1));
+    }
+}
+
+static void dit_short_avx2(uint32_t *a, size_t count, size_t len,
+        const uint32_t *w, const ntt_prime &q) {
+    __m256i p = _mm256_set1_epi32(q.p), pinv = _mm256_set1_epi32(q.pinv);
+    short_pattern pattern(len, 8, w);
+    __m256i seven = _mm256_set1_epi32(7);
+    __m256i ix = load_avx2(pattern.x), iy = load_avx2(pattern.y);
+    __m256i o0 = load_avx2(pattern.out), o1 = load_avx2(pattern.out + 8);
+    __m256i hx = _mm256_cmpgt_epi32(ix, seven);
+    __m256i hy = _mm256_cmpgt_epi32(iy, seven);
+    __m256i h0 = _mm256_cmpgt_epi32(o0, seven);
+    __m256i h1 = _mm256_cmpgt_epi32(o1, seven);
+    __m256i tw = load_avx2(pattern.w);
+    for (size_t i = 0; i < count; i += 16) {
+        __m256i v0 = load_avx2(a + i), v1 = load_avx2(a + i + 8);
+        __m256i x = permute2_avx2(v0, v1, ix, hx);
+        __m256i y = mont_mul_avx2(permute2_avx2(v0, v1, iy, hy), tw, p, pinv);
+        store_avx2(a + i, permute2_avx2(mod_add_avx2(x, y, p),
+                    mod_sub_avx2(x, y, p), o0, h0));
+        store_avx2(a + i + 8, permute2_avx2(mod_add_avx2(x, y, p),
+                    mod_sub_avx2(x, y, p), o1, h1));
+    }
+}
+
+static void pointwise_avx2(uint32_t *x, const uint32_t *y, size_t count,
+        const ntt_prime &q) {
+    __m256i p = _mm256_set1_epi32(q.p), pinv = _mm256_set1_epi32(q.pinv);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        store_avx2(x + i, mont_mul_avx2(load_avx2(x + i), load_avx2(y + i), p,
+                    pinv));
+    }
+    pointwise_scalar(x + i, y + i, count - i, q);
+}
+
+static void scale_avx2(uint32_t *x, uint32_t c, size_t count,
+        const ntt_prime &q) {
+    __m256i p = _mm256_set1_epi32(q.p), pinv = _mm256_set1_epi32(q.pinv);
+    __m256i factor = _mm256_set1_epi32(c);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        store_avx2(x + i, mont_mul_avx2(load_avx2(x + i), factor, p, pinv));
+    }
+    scale_scalar(x + i, c, count - i, q);
+}
+
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+// GCC 12 warns about the undefined vectors of its own AVX-512 intrinsics
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+// mont_mul_avx512 is mont_mul_avx2 on 16 lanes.
+static inline __m512i mont_mul_avx512(__m512i a, __m512i b, __m512i p,
+        __m512i pinv) {
+    __m512i even = _mm512_mul_epu32(a, b);
+    __m512i odd = _mm512_mul_epu32(_mm512_srli_epi64(a, 32),
+            _mm512_srli_epi64(b, 32));
+    even = _mm512_add_epi64(even,
+            _mm512_mul_epu32(_mm512_mul_epu32(even, pinv), p));
+    odd = _mm512_add_epi64(odd,
+            _mm512_mul_epu32(_mm512_mul_epu32(odd, pinv), p));
+    __m512i r = _mm512_mask_blend_epi32(0xAAAA, _mm512_srli_epi64(even, 32),
+            odd);
+    return _mm512_min_epu32(r, _mm512_sub_epi32(r, p));
+}
+
+static inline __m512i mod_add_avx512(__m512i a, __m512i b, __m512i p) {
+    __m512i s = _mm512_add_epi32(a, b);
+    return _mm512_min_epu32(s, _mm512_sub_epi32(s, p));
+}
+
+static inline __m512i mod_sub_avx512(__m512i a, __m512i b, __m512i p) {
+    __m512i d = _mm512_add_epi32(a, _mm512_sub_epi32(p, b));
+    return _mm512_min_epu32(d, _mm512_sub_epi32(d, p));
+}
+
+static void dif_avx512(uint32_t *x, uint32_t *y, const uint32_t *w,
+        size_t count, const ntt_prime &q) {
+    __m512i p = _mm512_set1_epi32(q.p), pinv = _mm512_set1_epi32(q.pinv);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m512i u = _mm512_loadu_si512(x + i), v = _mm512_loadu_si512(y + i);
+        _mm512_storeu_si512(x + i, mod_add_avx512(u, v, p));
+        _mm512_storeu_si512(y + i, mont_mul_avx512(mod_sub_avx512(u, v, p),
+                    _mm512_loadu_si512(w + i), p, pinv));
+    }
+    dif_scalar(x + i, y + i, w + i, count - i, q);
+}
+
+static void dit_avx512(uint32_t *x, uint32_t *y, const uint32_t *w,
+        size_t count, const ntt_prime &q) {
+    __m512i p = _mm512_set1_epi32(q.p), pinv = _mm512_set1_epi32(q.pinv);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m512i u = _mm512_loadu_si512(x + i);
+        __m512i v = mont_mul_avx512(_mm512_loadu_si512(y + i),
+                _mm512_loadu_si512(w + i), p, pinv);
+        _mm512_storeu_si512(x + i, mod_add_avx512(u, v, p));
+        _mm512_storeu_si512(y + i, mod_sub_avx512(u, v, p));
+    }
+    dit_scalar(x + i, y + i, w + i, count - i, q);
+}
+
+static void dif_short_avx512(uint32_t *a, size_t count, size_t len,
+        const uint32_t *w, const ntt_prime &q) {
+    __m512i p = _mm512_set1_epi32(q.p), pinv = _mm512_set1_epi32(q.pinv);
+    short_pattern pattern(len, 16, w);
+    __m512i ix = _mm512_loadu_si512(pattern.x);
+    __m512i iy = _mm512_loadu_si512(pattern.y);
+    __m512i o0 = _mm512_loadu_si512(pattern.out);
+    __m512i o1 = _mm512_loadu_si512(pattern.out + 16);
+    __m512i tw = _mm512_loadu_si512(pattern.w);
+    for (size_t i = 0; i < count; i += 32) {
+        __m512i v0 = _mm512_loadu_si512(a + i);
+        __m512i v1 = _mm512_loadu_si512(a + i + 16);
+        __m512i x = _mm512_permutex2var_epi32(v0, ix, v1);
+        __m512i y = _mm512_permutex2var_epi32(v0, iy, v1);
+        __m512i sum = mod_add_avx512(x, y, p);
+        __m512i diff = mont_mul_avx512(mod_sub_avx512(x, y, p), tw, p, pinv);
+        _mm512_storeu_si512(a + i, _mm512_permutex2var_epi32(sum, o0, diff));
+        _mm512_storeu_si512(a + i + 16,
+                _mm512_permutex2var_epi32(sum, o1, diff));
+    }
+}
+
+static void dit_short_avx512(uint32_t *a, size_t count, size_t len,
+        const uint32_t *w, const ntt_prime &q) {
+    __m512i p = _mm512_set1_epi32(q.p), pinv = _mm512_set1_epi32(q.pinv);
+    short_pattern pattern(len, 16, w);
+    __m512i ix = _mm512_loadu_si512(pattern.x);
+    __m512i iy = _mm512_loadu_si512(pattern.y);
+    __m512i o0 = _mm512_loadu_si512(pattern.out);
+    __m512i o1 = _mm512_loadu_si512(pattern.out + 16);
+    __m512i tw = _mm512_loadu_si512(pattern.w);
+    for (size_t i = 0; i < count; i += 32) {
+        __m512i v0 = _mm512_loadu_si512(a + i);
+        __m512i v1 = _mm512_loadu_si512(a + i + 16);
+        __m512i x = _mm512_permutex2var_epi32(v0, ix, v1);
+        __m512i y = mont_mul_avx512(_mm512_permutex2var_epi32(v0, iy, v1), tw,
+                p, pinv);
+        __m512i sum = mod_add_avx512(x, y, p);
+        __m512i diff = mod_sub_avx512(x, y, p);
+        _mm512_storeu_si512(a + i, _mm512_permutex2var_epi32(sum, o0, diff));
+        _mm512_storeu_si512(a + i + 16,
+                _mm512_permutex2var_epi32(sum, o1, diff));
+    }
+}
+
+static void pointwise_avx512(uint32_t *x, const uint32_t *y, size_t count,
+        const ntt_prime &q) {
+    __m512i p = _mm512_set1_epi32(q.p), pinv = _mm512_set1_epi32(q.pinv);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        _mm512_storeu_si512(x + i, mont_mul_avx512(_mm512_loadu_si512(x + i),
+                    _mm512_loadu_si512(y + i), p, pinv));
+    }
+    pointwise_scalar(x + i, y + i, count - i, q);
+}
+
+static void scale_avx512(uint32_t *x, uint32_t c, size_t count,
+        const ntt_prime &q) {
+    __m512i p = _mm512_set1_epi32(q.p), pinv = _mm512_set1_epi32(q.pinv);
+    __m512i factor = _mm512_set1_epi32(c);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        _mm512_storeu_si512(x + i, mont_mul_avx512(_mm512_loadu_si512(x + i),
+                    factor, p, pinv));
+    }
+    scale_scalar(x + i, c, count - i, q);
+}
+
+#pragma GCC diagnostic pop
+#pragma GCC pop_options
+
+// From the narrowest to the widest
+static const ntt_kernel KERNELS[] = {
+    {"scalar", 1, dif_scalar, dit_scalar, pointwise_scalar, scale_scalar,
+        nullptr, nullptr},
+    {"avx2", 8, dif_avx2, dit_avx2, pointwise_avx2, scale_avx2,
+        dif_short_avx2, dit_short_avx2},
+    {"avx512", 16, dif_avx512, dit_avx512, pointwise_avx512, scale_avx512,
+        dif_short_avx512, dit_short_avx512},
+};
+
+static bool kernel_supported(const ntt_kernel &kernel) {
+    __builtin_cpu_init();
+    string name = kernel.name;
+    if (name == "avx2") return __builtin_cpu_supports("avx2");
+    if (name == "avx512") return __builtin_cpu_supports("avx512f");
+    return true;
+}
+
+// ntt_kernels returns the kernels supported by this CPU.
+vector<string> ntt_kernels() {
+    vector<string> names;
+    for (const ntt_kernel &kernel : KERNELS) {
+        if (kernel_supported(kernel)) names.push_back(kernel.name);
+    }
+    return names;
+}
+
+static const ntt_kernel *current_kernel() {
+    const ntt_kernel *chosen = &KERNELS[0];
+    for (const ntt_kernel &kernel : KERNELS) {
+        if (!kernel_supported(kernel)) continue;
+        if (NTT_KERNEL == "auto" || NTT_KERNEL == kernel.name) {
+            chosen = &kernel;
+        }
+    }
+    return chosen;
+}
+
+/* parallel_for runs body(begin, end) over [0, count) on up to N_THREADS
+ * threads, each getting at least 'grain' indexes.
+ */
+static void parallel_for(size_t count, size_t grain,
+        const std::function<void(size_t, size_t)> &body) {
+    size_t threads = min<size_t>(max(1, N_THREADS), count / max<size_t>(1,
+                grain));
+    if (threads <= 1) {
+        body(0, count);
+        return;
+    }
+    vector<boost::thread> workers;
+    for (size_t t = 0; t < threads; t++) {
+        size_t begin = count * t / threads, end = count * (t+1) / threads;
+        workers.push_back(boost::thread([&body, begin, end]() {
+                    body(begin, end);
+                    }));
+    }
+    for (auto &worker : workers) worker.join();
+}
+
+/* twiddles sets w[len + j] = root_{2 len}^j · 2^32 mod p for all powers of two
+ * len < n and j < len, where root_{2 len} is the primitive 2len-th root of
+ * unity g^((p-1)/(2 len)), or its inverse. Since w does not depend on n, the
+ * table of a length serves all the shorter ones, and only the entries from
+ * 'from' (a smaller length whose table is already in w) are computed.
+ */
+static void twiddles(uint32_t *w, size_t from, size_t n, bool inverse,
+        const ntt_prime &q) {
+    size_t len = n/2;
+    uint64_t step = pow_mod(q.g, (q.p - 1) / n, q.p);
+    if (inverse) step = pow_mod(step, q.p - 2, q.p);
+    // The last half, in 4 interleaved chains of products
+    uint32_t step4 = (pow_mod(step, 4, q.p) << 32) % q.p;
+    parallel_for(len, NTT_BLOCK, [&](size_t begin, size_t end) {
+            uint32_t x[4];
+            for (int c = 0; c < 4; c++) {
+                x[c] = (pow_mod(step, begin + c, q.p) << 32) % q.p;
+            }
+            size_t j = begin;
+            for (; j + 4 <= end; j += 4) {
+                for (int c = 0; c < 4; c++) {
+                    w[len + j + c] = x[c];
+                    x[c] = mont_mul(x[c], step4, q);
+                }
+            }
+            for (; j < end; j++) {
+                w[len + j] = (pow_mod(step, j, q.p) << 32) % q.p;
+            }
+            });
+    // root_{2 len}^j = root_{4 len}^{2j}
+    for (len /= 2; len >= max<size_t>(from, 1); len /= 2) {
+        for (size_t j = 0; j < len; j++) w[len + j] = w[2*len + 2*j];
+    }
+}
+
+/* twiddle_table returns the twiddles of prime k for lengths up to n, which
+ * are kept for the next products.
+ */
+static std::shared_ptr<const vector<uint32_t>> twiddle_table(int k,
+        bool inverse, size_t n) {
+    static boost::mutex mutex;
+    static std::shared_ptr<const vector<uint32_t>> tables[3][2];
+    boost::lock_guard<boost::mutex> lock(mutex);
+    std::shared_ptr<const vector<uint32_t>> &table = tables[k][inverse];
+    size_t from = table ? table->size() : 0;
+    if (from < n) {
+        auto grown = std::make_shared<vector<uint32_t>>(n);
+        if (table) std::copy(table->begin(), table->end(), grown->begin());
+        twiddles(grown->data(), from, n, inverse, PRIMES[k]);
+        table = grown;
+    }
+    return table;
+}
+
+/* stage runs the butterflies [begin, end) of the n/2 of a stage whose pairs
+ * are 'len' residues apart.
+ */
+static void stage(bool inverse, uint32_t *a, size_t len, const uint32_t *w,
+        size_t begin, size_t end, const ntt_kernel *kernel,
+        const ntt_prime &q) {
+    size_t lanes = kernel->lanes;
+    if (len < lanes && begin % lanes == 0 && end % lanes == 0) {
+        (inverse ? kernel->dit_short : kernel->dif_short)(a + 2*begin,
+            2*(end - begin), len, w, q);
+        return;
+    }
+    if (len < 16) {
+        // Whole groups (within a block) of short butterflies: inlined
+        // scalar code rather than a kernel call per group
+        for (size_t k = begin; k < end; k += len) {
+            uint32_t *x = a + 2*k;
+            if (inverse) {
+                dit_scalar(x, x + len, w + len, len, q);
+            } else {
+                dif_scalar(x, x + len, w + len, len, q);
+            }
+        }
+        return;
+    }
+    for (size_t k = begin; k < end;) {
+        size_t group = k / len, j = k % len;
+        size_t count = min(len - j, end - k);
+        uint32_t *x = a + 2*len*group + j;
+        (inverse ? kernel->dit : kernel->dif)(x, x + len, w + len + j, count,
+            q);
+        k += count;
+    }
+}
+
+/* pass runs 's' (<= 3) consecutive stages over the whole array, from the one
+ * whose pairs are 'top' residues apart (or to it, if inverse). Each group of
+ * 2 top residues is cut into 2^s streams, processed PASS_CHUNK residues at a
+ * time, so that the s stages read and write the array once.
+ */
+static void pass(bool inverse, uint32_t *a, size_t n, size_t top, int s,
+        const uint32_t *w, const ntt_kernel *kernel, const ntt_prime &q) {
+    size_t d = top >> (s - 1);
+    size_t chunk = min(d, PASS_CHUNK), chunks = d / chunk;
+    parallel_for(n / (2*top) * chunks, 1, [&](size_t begin, size_t end) {
+            for (size_t u = begin; u < end; u++) {
+                size_t j = (u % chunks) * chunk;
+                uint32_t *group = a + (u / chunks) * 2*top + j;
+                for (int step = 0; step < s; step++) {
+                    int k = inverse ? s - 1 - step : step;
+                    // Stage of pairs top >> k = half·d residues apart
+                    size_t half = size_t(1) << (s - 1 - k);
+                    const uint32_t *tw = w + (top >> k) + j;
+                    for (size_t m = 0; m < (size_t(1) << s); m++) {
+                        if (m & half) continue;
+                        uint32_t *x = group + m*d;
+                        (inverse ? kernel->dit : kernel->dif)(x, x + half*d,
+                            tw + (m % half)*d, chunk, q);
+                    }
+                }
+            }
+            });
+}
+
+// forward transforms a (n residues) in place, leaving it in bit-reversed order.
+static void forward(uint32_t *a, size_t n, const uint32_t *w,
+        const ntt_kernel *kernel, const ntt_prime &q) {
+    size_t block = min(n, NTT_BLOCK);
+    size_t len = n/2;
+    while (2*len > block) {
+        int s = 1;
+        while (s < 3 && 2*(len >> s) > block) s++;
+        pass(false, a, n, len, s, w, kernel, q);
+        len >>= s;
+    }
+    parallel_for(n/block, 1, [&](size_t begin, size_t end) {
+            for (size_t b = begin; b < end; b++) {
+                for (size_t l = len; l >= 1; l /= 2) {
+                    stage(false, a + b*block, l, w, 0, block/2, kernel, q);
+                }
+            }
+            });
+}
+
+// inverse undoes forward, up to a factor n, back to the natural order.
+static void inverse(uint32_t *a, size_t n, const uint32_t *w,
+        const ntt_kernel *kernel, const ntt_prime &q) {
+    size_t block = min(n, NTT_BLOCK);
+    parallel_for(n/block, 1, [&](size_t begin, size_t end) {
+            for (size_t b = begin; b < end; b++) {
+                for (size_t l = 1; l < block; l *= 2) {
+                    stage(true, a + b*block, l, w, 0, block/2, kernel, q);
+                }
+            }
+            });
+    for (size_t len = block; len < n;) {
+        int s = 1;
+        while (s < 3 && (len << s) < n) s++;
+        pass(true, a, n, len << (s - 1), s, w, kernel, q);
+        len <<= s;
+    }
+}
+
+// load sets x to the 32-bit digits of |a| mod p, padded with zeros to n.
+static void load(uint32_t *x, size_t n, mpz_srcptr a, const ntt_prime &q) {
+    const mp_limb_t *limbs = mpz_limbs_read(a);
+    size_t size = mpz_size(a);
+    parallel_for(n/2, NTT_BLOCK, [=, &q](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                mp_limb_t limb = i < size ? limbs[i] : 0;
+                uint32_t low = limb, high = limb >> 32;
+                // A digit is below 3p
+                if (low >= q.p) low -= q.p;
+                if (low >= q.p) low -= q.p;
+                if (high >= q.p) high -= q.p;
+                if (high >= q.p) high -= q.p;
+                x[2*i] = low;
+                x[2*i+1] = high;
+            }
+            });
+}
+
+/* ntt_product sets rop <- a * b (or a² if b is a) with one transform length
+ * n >= the amount of digits of the product.
+ */
+static void ntt_product(mpz_ptr rop, mpz_srcptr a, mpz_srcptr b, size_t n) {
+    const ntt_kernel *kernel = current_kernel();
+    bool square = (a == b);
+    vector<uint32_t> residues[3];
+    vector<uint32_t> x, y;
+    for (int k = 0; k < 3; k++) {
+        const ntt_prime &q = PRIMES[k];
+        x.resize(n);
+        load(x.data(), n, a, q);
+        auto w = twiddle_table(k, false, n);
+        forward(x.data(), n, w->data(), kernel, q);
+        if (!square) {
+            y.resize(n);
+            load(y.data(), n, b, q);
+            forward(y.data(), n, w->data(), kernel, q);
+        }
+        const uint32_t *other = square ? x.data() : y.data();
+        parallel_for(n, NTT_BLOCK, [&](size_t begin, size_t end) {
+                kernel->pointwise(x.data() + begin, other + begin,
+                    end - begin, q);
+                });
+        w = twiddle_table(k, true, n);
+        inverse(x.data(), n, w->data(), kernel, q);
+        // The pointwise products and the inverse left conv · n / 2^32
+        uint64_t r2 = pow_mod(2, 64, q.p);
+        uint32_t c = pow_mod(n, q.p - 2, q.p) * r2 % q.p;
+        parallel_for(n, NTT_BLOCK, [&](size_t begin, size_t end) {
+                kernel->scale(x.data() + begin, c, end - begin, q);
+                });
+        residues[k].swap(x);
+    }
+    vector<uint32_t>().swap(y);
+
+    /* Garner: x = r0 + p0 t1 + p0 p1 t2, with t1 = (r1 - r0) / p0 mod p1 and
+     * t2 = (r2 - r0 - p0 t1) / (p0 p1) mod p2. Since r0 < p2, r0 - p1 < p1 and
+     * t1 < p2, only the constants need a division, computed here in
+     * Montgomery form.
+     */
+    const ntt_prime &q1 = PRIMES[1], &q2 = PRIMES[2];
+    const uint64_t p0 = PRIMES[0].p, p1 = q1.p, p2 = q2.p;
+    const uint32_t inv_p0 = (pow_mod(p0, p1 - 2, p1) << 32) % p1;
+    const uint32_t p0_r = (p0 << 32) % p2;
+    const uint32_t inv_p0p1 = (pow_mod(p0 * p1 % p2, p2 - 2, p2) << 32) % p2;
+    size_t size = mpz_size(a) + mpz_size(b);
+    mpz_t product;
+    mpz_init(product);
+    mp_limb_t *limbs = mpz_limbs_write(product, size);
+    vector<size_t> ends;
+    vector<unsigned __int128> carries;
+    boost::mutex mutex;
+    parallel_for(size, NTT_BLOCK, [&](size_t begin, size_t end) {
+            unsigned __int128 carry = 0;
+            for (size_t i = begin; i < end; i++) {
+                mp_limb_t limb = 0;
+                for (int half = 0; half < 2; half++) {
+                    size_t d = 2*i + half;
+                    if (d < n) {
+                        uint32_t r0 = residues[0][d], r1 = residues[1][d];
+                        uint32_t r2 = residues[2][d];
+                        uint32_t t1 = mont_mul(mod_sub(r1,
+                                    r0 >= p1 ? r0 - p1 : r0, p1), inv_p0, q1);
+                        uint32_t x01 = mod_add(r0, mont_mul(t1, p0_r, q2), p2);
+                        uint32_t t2 = mont_mul(mod_sub(r2, x01, p2), inv_p0p1,
+                                q2);
+                        carry += r0 + p0 * t1 +
+                            static_cast<unsigned __int128>(p0 * p1) * t2;
+                    }
+                    limb |= static_cast<mp_limb_t>(static_cast<uint32_t>(
+                                carry)) << (32 * half);
+                    carry >>= 32;
+                }
+                limbs[i] = limb;
+            }
+            boost::lock_guard<boost::mutex> lock(mutex);
+            ends.push_back(end);
+            carries.push_back(carry);
+            });
+    // Each range leaves a carry for the next ones
+    for (size_t k = 0; k < ends.size(); k++) {
+        if (ends[k] >= size) continue;
+        mp_limb_t low = carries[k], high = carries[k] >> 64;
+        mpn_add_1(limbs + ends[k], limbs + ends[k], size - ends[k], low);
+        if (high && ends[k] + 1 < size) {
+            mpn_add_1(limbs + ends[k] + 1, limbs + ends[k] + 1,
+                    size - ends[k] - 1, high);
+        }
+    }
+    mpz_limbs_finish(product, size);
+    if (mpz_sgn(a) * mpz_sgn(b) < 0) mpz_neg(product, product);
+    mpz_swap(rop, product);
+    mpz_clear(product);
+}
+
+/* ntt_mul sets rop <- a * b, through ntt_product if both operands have at
+ * least NTT_MIN_BITS, and with mpz_mul otherwise.
+ */
+void ntt_mul(mpz_ptr rop, mpz_srcptr a, mpz_srcptr b) {
+    size_t na = mpz_size(a), nb = mpz_size(b);
+    if (min(na, nb) * GMP_NUMB_BITS < NTT_MIN_BITS) {
+        mpz_mul(rop, a, b);
+        return;
+    }
+    size_t max_length = min<size_t>(NTT_MAX_LENGTH, 1 << 25);
+    // The convolution has 2(na + nb) - 1 digits
+    size_t n = 1;
+    while (n < 2*(na + nb) - 1) n *= 2;
+    if (n <= max_length) {
+        ntt_product(rop, a, b, n);
+        return;
+    }
+    bool square = (a == b);
+    if (na < nb) {
+        std::swap(a, b);
+        std::swap(na, nb);
+    }
+    mp_bitcnt_t half = (na + 1) / 2 * GMP_NUMB_BITS;
+    mpz_class a0, a1, b0, b1;
+    mpz_fdiv_q_2exp(a1.get_mpz_t(), a, half);
+    mpz_fdiv_r_2exp(a0.get_mpz_t(), a, half);
+    if (!square && 2*nb <= na) {
+        // Unbalanced: a1·b and a0·b
+        mpz_class low, high;
+        ntt_mul(low.get_mpz_t(), a0.get_mpz_t(), b);
+        ntt_mul(high.get_mpz_t(), a1.get_mpz_t(), b);
+        mpz_mul_2exp(high.get_mpz_t(), high.get_mpz_t(), half);
+        mpz_add(rop, high.get_mpz_t(), low.get_mpz_t());
+        return;
+    }
+    // Karatsuba, keeping squares as squares
+    mpz_class z0, z1, z2, sum_a = a0 + a1, sum_b;
+    if (square) {
+        ntt_mul(z0.get_mpz_t(), a0.get_mpz_t(), a0.get_mpz_t());
+        ntt_mul(z2.get_mpz_t(), a1.get_mpz_t(), a1.get_mpz_t());
+        ntt_mul(z1.get_mpz_t(), sum_a.get_mpz_t(), sum_a.get_mpz_t());
+    } else {
+        mpz_fdiv_q_2exp(b1.get_mpz_t(), b, half);
+        mpz_fdiv_r_2exp(b0.get_mpz_t(), b, half);
+        sum_b = b0 + b1;
+        ntt_mul(z0.get_mpz_t(), a0.get_mpz_t(), b0.get_mpz_t());
+        ntt_mul(z2.get_mpz_t(), a1.get_mpz_t(), b1.get_mpz_t());
+        ntt_mul(z1.get_mpz_t(), sum_a.get_mpz_t(), sum_b.get_mpz_t());
+    }
+    z1 -= z0;
+    z1 -= z2;
+    mpz_mul_2exp(z2.get_mpz_t(), z2.get_mpz_t(), 2*half);
+    mpz_mul_2exp(z1.get_mpz_t(), z1.get_mpz_t(), half);
+    z2 += z1;
+    mpz_add(rop, z2.get_mpz_t(), z0.get_mpz_t());
+}
+
+void ntt_sqr(mpz_ptr rop, mpz_srcptr a) {
+    ntt_mul(rop, a, a);
+}
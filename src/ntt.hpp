@@ -0,0 +1,18 @@
+#ifndef SRC_NTT_HPP_
+#define SRC_NTT_HPP_
+
+#include "utils.hpp"
+
+// Products with a smaller operand are left to GMP.
+extern size_t NTT_MIN_BITS;
+// Longest transform, in 32-bit digits (at most 2^25); larger products are
+// split first.
+extern size_t NTT_MAX_LENGTH;
+// "auto" (the widest supported), "avx512", "avx2" or "scalar"
+extern string NTT_KERNEL;
+
+vector<string> ntt_kernels();
+void ntt_mul(mpz_ptr, mpz_srcptr, mpz_srcptr);
+void ntt_sqr(mpz_ptr, mpz_srcptr);
+
+#endif /* SRC_NTT_HPP_ */
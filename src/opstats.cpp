@@ -0,0 +1,132 @@
+#include "opstats.hpp"
+#include "backend.hpp"
+#include <array>
+
+using std::cout;
+using std::endl;
+
+/* Histograms of the GMP operations
+ *
+ * The op_* functions perform the arithmetic of the tree engines, with the
+ * backend of their operand size (see backend.cpp). If
+ * OPSTATS_FILE is set (option -opstats), each call is also counted and timed
+ * in a histogram of its kind (mul, sqr, mod, divexact,
+ * gcd) and of the log2 of its
+ * largest operand size in bits. Histograms are thread-local, so that counting
+ * takes no lock; they are merged into the global one when their thread exits,
+ * and write_opstats reports the merge as JSON once all workers are joined.
+ */
+string OPSTATS_FILE = "";
+
+static const int BUCKETS = 64;
+
+struct op_histogram {
+    std::array<std::array<uint64_t, BUCKETS>, OP_KINDS> count{}, nanoseconds{};
+
+    void merge(const op_histogram &other) {
+        for (int k = 0; k < OP_KINDS; k++) {
+            for (int b = 0; b < BUCKETS; b++) {
+                count[k][b] += other.count[k][b];
+                nanoseconds[k][b] += other.nanoseconds[k][b];
+            }
+        }
+    }
+};
+
+static op_histogram merged;
+static boost::mutex merged_mutex;
+
+// Per-thread histogram, merged into 'merged' when the thread exits.
+struct local_histogram : op_histogram {
+    ~local_histogram() {
+        boost::lock_guard<boost::mutex> lock(merged_mutex);
+        merged.merge(*this);
+    }
+};
+static thread_local local_histogram local;
+
+static uint64_t now() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+// bucket_of returns the log2 of the size in bits of the largest operand.
+static int bucket_of(mpz_srcptr a, mpz_srcptr b) {
+    size_t bits = std::max(mpz_sizeinbase(a, 2), mpz_sizeinbase(b, 2));
+    int bucket = 0;
+    while (bucket < BUCKETS-1 && (2ULL << bucket) <= bits) bucket++;
+    return bucket;
+}
+
+/* timed runs 'call', recording it under 'kind' if enabled. The bucket is
+ * computed first, since the result may overwrite an operand.
+ */
+template <typename F>
+static void timed(op_kind kind, mpz_srcptr a, mpz_srcptr b, F call) {
+    if (OPSTATS_FILE.empty()) {
+        call();
+        return;
+    }
+    int bucket = bucket_of(a, b);
+    uint64_t start = now();
+    call();
+    local.count[kind][bucket]++;
+    local.nanoseconds[kind][bucket] += now() - start;
+}
+
+void op_mul(mpz_ptr rop, mpz_srcptr a, mpz_srcptr b) {
+    timed(MUL, a, b, [=]() { backend_for(MUL, a, b)->mul(rop, a, b); });
+}
+
+void op_sqr(mpz_ptr rop, mpz_srcptr a) {
+    timed(SQR, a, a, [=]() { backend_for(SQR, a, a)->sqr(rop, a); });
+}
+
+void op_mod(mpz_ptr rop, mpz_srcptr a, mpz_srcptr b) {
+    timed(MOD, a, b, [=]() { backend_for(MOD, a, b)->mod(rop, a, b); });
+}
+
+// op_divexact is the quotient a/b, where b must divide a.
+void op_divexact(mpz_ptr rop, mpz_srcptr a, mpz_srcptr b) {
+    timed(DIVEXACT, a, b, [=]() {
+            backend_for(DIVEXACT, a, b)->divexact(rop, a, b);
+            });
+}
+
+void op_gcd(mpz_ptr rop, mpz_srcptr a, mpz_srcptr b) {
+    timed(GCD, a, b, [=]() { backend_for(GCD, a, b)->gcd(rop, a, b); });
+}
+
+/* write_opstats writes the histograms to OPSTATS_FILE, as
+ *   {"mul": [{"bits_log2": 11, "count": 1500, "seconds": 0.0021}, ...], ...}
+ * Only non-empty buckets are listed. Must be called once all worker threads
+ * have exited.
+ */
+void write_opstats() {
+    if (OPSTATS_FILE.empty()) return;
+    op_histogram total;
+    {
+        boost::lock_guard<boost::mutex> lock(merged_mutex);
+        total = merged;
+    }
+    // The calling thread has not exited yet
+    total.merge(local);
+    std::ofstream file(OPSTATS_FILE);
+    file << "{";
+    for (int k = 0; k < OP_KINDS; k++) {
+        file << (k ? ",\n " : "\n ") << "\"" << OP_NAMES[k] << "\": [";
+        bool first = true;
+        for (int b = 0; b < BUCKETS; b++) {
+            if (total.count[k][b] == 0) continue;
+            file << (first ? "\n  " : ",\n  ");
+            file << "{\"bits_log2\": " << b << ", \"count\": ";
+            file << total.count[k][b] << ", \"seconds\": ";
+            file << total.nanoseconds[k][b] / 1e9 << "}";
+            first = false;
+        }
+        file << (first ? "]" : "\n ]");
+    }
+    file << "\n}\n";
+    cout << "Operation histograms written to " << OPSTATS_FILE << endl;
+}
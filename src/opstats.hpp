@@ -0,0 +1,16 @@
+#ifndef SRC_OPSTATS_HPP_
+#define SRC_OPSTATS_HPP_
+
+#include "utils.hpp"
+
+// Instrumentation of the GMP operations, disabled unless OPSTATS_FILE is set.
+extern string OPSTATS_FILE;
+
+void op_mul(mpz_ptr, mpz_srcptr, mpz_srcptr);
+void op_sqr(mpz_ptr, mpz_srcptr);
+void op_mod(mpz_ptr, mpz_srcptr, mpz_srcptr);
+void op_divexact(mpz_ptr, mpz_srcptr, mpz_srcptr);
+void op_gcd(mpz_ptr, mpz_srcptr, mpz_srcptr);
+void write_opstats();
+
+#endif /* SRC_OPSTATS_HPP_ */
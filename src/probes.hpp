@@ -0,0 +1,39 @@
+#ifndef SRC_PROBES_HPP_
+#define SRC_PROBES_HPP_
+
+/* USDT (SystemTap SDT) probes of provider 'batchgcd', for tracing live runs
+ * with e.g. bpftrace:
+ *
+ *   bpftrace -e 'usdt:./batchgcd:batchgcd:task_start { ... }'
+ *
+ *   level_start(op, level, count)    level_end(op, level)
+ *   task_start(op, index, bits)      task_end(op, index)
+ *   level_write_start(level, count)  level_write_end(level)
+ *   level_read_start(level, count)   level_read_end(level)
+ *   classify(index, result)          0 clean, 1 compromised, 2 duplicate,
+ *                                    3 false positive
+ *
+ * 'op' is a string: "mult", "squares", "mod", "cofactor" or "dfs". A probe is
+ * a single nop in the binary until a tracer attaches to it. Without
+ * <sys/sdt.h> (systemtap-sdt-dev), or with -DBATCHGCD_NO_PROBES, probes
+ * compile to nothing and their arguments are not evaluated.
+ */
+
+#if !defined(BATCHGCD_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define BATCHGCD_PROBES 1
+#endif
+#endif
+
+#ifdef BATCHGCD_PROBES
+#define PROBE1(name, a) STAP_PROBE1(batchgcd, name, a)
+#define PROBE2(name, a, b) STAP_PROBE2(batchgcd, name, a, b)
+#define PROBE3(name, a, b, c) STAP_PROBE3(batchgcd, name, a, b, c)
+#else
+#define PROBE1(name, a) do {} while (0)
+#define PROBE2(name, a, b) do {} while (0)
+#define PROBE3(name, a, b, c) do {} while (0)
+#endif
+
+#endif /* SRC_PROBES_HPP_ */
@@ -0,0 +1,182 @@
+#include "remainders_dfs.hpp"
+#include "probes.hpp"
+#include "opstats.hpp"
+#include "backend.hpp"
+
+using std::cout;
+using std::endl;
+using std::min;
+
+/* level_cursor keeps the level files (one per stripe) and the index file of
+ * each level open, so that a thread can read arbitrary nodes of the stored
+ * product tree without re-opening files for each node.
+ */
+struct level_cursor {
+    vector<vector<FILE*>> files;
+    vector<FILE*> indexes;
+    vector<bool> stored;
+
+    explicit level_cursor(int levels) : files(levels), indexes(levels),
+            stored(levels) {
+        for (int l = 0; l < levels; l++) {
+            stored[l] = level_stored(l, levels) ||
+                boost::filesystem::exists(index_filename(l));
+        }
+    }
+
+    ~level_cursor() {
+        for (unsigned int l = 0; l < files.size(); l++) {
+            for (FILE* file : files[l]) {
+                if (file) fclose(file);
+            }
+            if (indexes[l]) fclose(indexes[l]);
+        }
+    }
+
+    void read(int l, uint64_t i, mpz_class *x) {
+        if (!indexes[l]) {
+            indexes[l] = fopen(index_filename(l).c_str(), "rb");
+            files[l].assign(level_stripes(), NULL);
+            if (!indexes[l]) {
+                cout << "Fatal error: missing level " << l << endl;
+                throw std::exception();
+            }
+        }
+        unsigned int s = stripe_of(l, i);
+        if (!files[l][s]) {
+            files[l][s] = fopen(level_filename(l, s).c_str(), "rb");
+            if (!files[l][s]) {
+                cout << "Fatal error: missing " << level_filename(l, s) << endl;
+                throw std::exception();
+            }
+        }
+        uint64_t offset;
+        fseeko(indexes[l], static_cast<off_t>(i) * sizeof(uint64_t),
+                SEEK_SET);
+        if (fread(&offset, sizeof(uint64_t), 1, indexes[l]) != 1) {
+            cout << "Fatal error: corrupted index of level " << l << endl;
+            throw std::exception();
+        }
+        fseeko(files[l][s], offset, SEEK_SET);
+        read_raw(x->get_mpz_t(), files[l][s]);
+    }
+
+    /* node sets x to node 'i' of level 'l'. A level skipped by -level-stride
+     * is not regenerated on disk, as the descent would need all of them at
+     * once: the node is the product of its descendants in the stored level
+     * below instead, so that the run stays within -disk-budget.
+     */
+    void node(int l, uint64_t i, mpz_class *x) {
+        if (stored[l]) {
+            read(l, i, x);
+            return;
+        }
+        int base = l - l % LEVEL_STRIDE;
+        uint64_t first = i << (l - base);
+        uint64_t last = min((i+1) << (l - base), intsPerFloor[base]);
+        vector<mpz_class> nodes(last - first);
+        for (uint64_t k = 0; k < nodes.size(); k++) {
+            read(base, first + k, &nodes[k]);
+        }
+        while (nodes.size() > 1) {
+            size_t half = nodes.size() / 2;
+            for (size_t k = 0; k < half; k++) {
+                op_mul(nodes[k].get_mpz_t(), nodes[2*k].get_mpz_t(),
+                        nodes[2*k+1].get_mpz_t());
+            }
+            // Orphan node is carried up, as in product_tree
+            if (nodes.size() % 2 != 0) {
+                nodes[half].swap(nodes.back());
+            }
+            nodes.resize((nodes.size() + 1) / 2);
+        }
+        x->swap(nodes[0]);
+    }
+};
+
+/* descend takes the remainder R of node 'i' of level 'l', computes the
+ * remainders of its children and frees R before going down, one child after
+ * the other. Only the remainders along the current path (and the pending
+ * right siblings) are alive, i.e. O(height) nodes instead of a whole level.
+ * While 'spawn' > 1, the left subtree is handed to a new thread.
+ */
+static void descend(int l, uint64_t i, mpz_class *R, int spawn,
+        level_cursor *cursor, const leaf_callback &emit) {
+    int levels = static_cast<int>(cursor->indexes.size());
+    mpz_class children[2];
+    int n_children = 0;
+    for (uint64_t c = 2*i; c < min(2*i+2, intsPerFloor[l-1]); c++) {
+        mpz_class X;
+        cursor->node(l-1, c, &X);
+        PROBE3(task_start, "dfs", c, mpz_sizeinbase(X.get_mpz_t(), 2));
+        mpz_class square, rem;
+        op_sqr(square.get_mpz_t(), X.get_mpz_t());
+        op_mod(rem.get_mpz_t(), R->get_mpz_t(), square.get_mpz_t());
+        PROBE2(task_end, "dfs", c);
+        if (l-1 == 0) {
+            emit(c, X, rem);
+        } else {
+            children[n_children++] = rem;
+        }
+    }
+    // Parent is no longer needed
+    mpz_class().swap(*R);
+    if (n_children == 0) {
+        return;
+    }
+    if (spawn > 1 && n_children == 2) {
+        boost::thread left([&children, l, i, spawn, levels, &emit]() {
+                level_cursor own(levels);
+                descend(l-1, 2*i, &children[0], spawn/2, &own, emit);
+                });
+        descend(l-1, 2*i+1, &children[1], spawn - spawn/2, cursor, emit);
+        left.join();
+        return;
+    }
+    for (int c = 0; c < n_children; c++) {
+        descend(l-1, 2*i+c, &children[c], 1, cursor, emit);
+    }
+}
+
+/* remainders_squares_dfs computes remᵢ <- Z mod Xᵢ² depth-first, reading the
+ * nodes from the indexed level files on demand, and hands each leaf result to
+ * 'emit' as soon as it is ready. Up to N_THREADS subtrees are processed
+ * concurrently. Nodes of skipped levels are recomputed from the stored level
+ * below (see level_cursor::node), which costs up to LEVEL_STRIDE/2 times the
+ * multiplications of ensure_level but no disk.
+ */
+void remainders_squares_dfs(int levels, leaf_callback emit) {
+    level_cursor cursor(levels);
+    mpz_class R;
+    cursor.read(levels-1, 0, &R);
+    if (intsPerFloor[levels-1] != 1) {
+        cout << "Fatal error: Incomplete product tree" << endl;
+        throw std::exception();
+    }
+    if (levels == 1) {
+        mpz_class X = R;
+        emit(0, X, R);
+        return;
+    }
+    cout << "   Computing remainders depth-first with " << N_THREADS;
+    cout << " threads" << endl;
+    descend(levels-1, 0, &R, N_THREADS, &cursor, emit);
+    // Level 0 is kept for Part (C)
+    for (int l = 1; l < levels && !KEEP_LEVELS; l++) {
+        delete_level(l);
+    }
+}
+
+/* remainders_gcds_dfs runs Parts (B) and (C) at once: R[i] is set to
+ * gcd(remᵢ/Xᵢ, Xᵢ) as soon as remᵢ is known, so that no full level of
+ * remainders is ever held in RAM.
+ */
+void remainders_gcds_dfs(int levels, vector<mpz_class> *R) {
+    R->resize(intsPerFloor[0]);
+    remainders_squares_dfs(levels, [R](uint64_t i, const mpz_class &X,
+                const mpz_class &rem) {
+            op_divexact((*R)[i].get_mpz_t(), rem.get_mpz_t(),
+                    X.get_mpz_t());
+            op_gcd((*R)[i].get_mpz_t(), (*R)[i].get_mpz_t(), X.get_mpz_t());
+            });
+}
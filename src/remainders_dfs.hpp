@@ -0,0 +1,17 @@
+#ifndef SRC_REMAINDERS_DFS_HPP_
+#define SRC_REMAINDERS_DFS_HPP_
+
+#include <functional>
+#include "utils.hpp"
+
+/* A leaf_callback receives the position 'i' of a leaf, the leaf Xᵢ and its
+ * remainder remᵢ = Z mod Xᵢ². It may be called concurrently from several
+ * threads, but never twice for the same position.
+ */
+typedef std::function<void(uint64_t, const mpz_class &,
+        const mpz_class &)> leaf_callback;
+
+void remainders_squares_dfs(int levels, leaf_callback emit);
+void remainders_gcds_dfs(int levels, vector<mpz_class> *R);
+
+#endif /* SRC_REMAINDERS_DFS_HPP_ */
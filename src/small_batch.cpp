@@ -0,0 +1,193 @@
+#include "small_batch.hpp"
+#include "tuner.hpp"
+#include "opstats.hpp"
+#include <unistd.h>
+#include <atomic>
+
+using std::cout;
+using std::endl;
+using std::min;
+using std::to_string;
+
+/* Algorithm selection for small batches
+ *
+ * For up to a few thousand moduli, the disk-backed pipeline is mostly
+ * overhead: level files, manifest updates, and threads started for each
+ * level. Such batches are computed in RAM instead, by one of
+ *
+ *   pairwise   remᵢ <- ∏_{j≠i} Xⱼ mod Xᵢ with n-1 modular products for each
+ *              modulus (n² in total, split among N_THREADS threads), then
+ *              gcd(remᵢ, Xᵢ) as in cofactor_gcds;
+ *   memory     product tree and remainder tree (modulo the squares) in RAM,
+ *              on a single thread, then final_gcds;
+ *
+ * which give the same gcds as the stored tree ('disk'). choose_algorithm
+ * picks one from the amount of moduli and their size. The crossovers are
+ * measured by 'batchgcd tune' and stored in the host profile, as the largest
+ * batch of moduli of about 2^b bits that each method handles fastest (keys
+ * pairwise_max_<b> and memory_max_<b>). The in-memory tree is also limited to
+ * a quarter of the RAM.
+ */
+static const size_t DEFAULT_PAIRWISE_MAX = 32;
+static const size_t DEFAULT_MEMORY_MAX = 4096;
+// Largest batch timed by calibrate_small_batches
+static const size_t CALIBRATION_MAX = 1 << 14;
+
+static int size_bucket(size_t bits) {
+    int bucket = 0;
+    while ((2ULL << bucket) <= bits) bucket++;
+    return bucket;
+}
+
+static size_t profile_value(const std::map<string, string> &profile,
+        string key, size_t fallback) {
+    auto it = profile.find(key);
+    return it != profile.end() ? std::stoull(it->second) : fallback;
+}
+
+/* choose_algorithm returns "pairwise", "memory" or "disk" for the moduli X.
+ */
+string choose_algorithm(vector<mpz_class> *X) {
+    size_t n = X->size(), bits = 0;
+    for (size_t i = 0; i < n; i++) {
+        bits = std::max(bits, mpz_sizeinbase((*X)[i].get_mpz_t(), 2));
+    }
+    std::map<string, string> profile = read_key_value_file(profile_file());
+    string bucket = to_string(size_bucket(bits));
+    if (n <= profile_value(profile, "pairwise_max_" + bucket,
+                DEFAULT_PAIRWISE_MAX)) {
+        return "pairwise";
+    }
+    // Each level of the tree has about the size of the leaves
+    uint64_t tree_bytes = n * bits / 8 * (tree_levels(n) + 2);
+    uint64_t ram = static_cast<uint64_t>(sysconf(_SC_PHYS_PAGES)) *
+        sysconf(_SC_PAGE_SIZE);
+    if (n <= profile_value(profile, "memory_max_" + bucket,
+                DEFAULT_MEMORY_MAX) && tree_bytes <= ram / 4) {
+        return "memory";
+    }
+    return "disk";
+}
+
+static void pairwise_gcds(vector<mpz_class> *X, vector<mpz_class> *R) {
+    R->resize(X->size());
+    std::atomic<size_t> next(0);
+    vector<boost::thread> threads;
+    int n_threads = min<size_t>(N_THREADS, X->size());
+    for (int j = 0; j < n_threads; j++) {
+        threads.push_back(boost::thread([&next, X, R]() {
+            size_t i;
+            while ((i = next++) < X->size()) {
+                mpz_ptr rem = (*R)[i].get_mpz_t();
+                mpz_srcptr modulus = (*X)[i].get_mpz_t();
+                mpz_set_ui(rem, 1);
+                for (size_t k = 0; k < X->size(); k++) {
+                    if (k == i) continue;
+                    op_mul(rem, rem, (*X)[k].get_mpz_t());
+                    op_mod(rem, rem, modulus);
+                }
+            }
+            }));
+    }
+    for (auto& th : threads)
+        th.join();
+    cofactor_gcds(R, X);
+}
+
+static void memory_gcds(vector<mpz_class> *X, vector<mpz_class> *R) {
+    vector<vector<mpz_class>> tree;
+    product_tree_in_memory(X, &tree, false);
+    remainders_in_memory(&tree, tree.back()[0], R, true);
+    final_gcds(R, X);
+}
+
+/* small_batch_gcds sets R[i] to the gcd of X[i] with the product of the other
+ * moduli, with the "pairwise" or "memory" algorithm. X is kept.
+ */
+void small_batch_gcds(string algorithm, vector<mpz_class> *X,
+        vector<mpz_class> *R) {
+    if (algorithm == "pairwise") {
+        pairwise_gcds(X, R);
+    } else {
+        memory_gcds(X, R);
+    }
+}
+
+// disk_gcds runs Parts (A) to (C) on a stored tree in TREE_DIR.
+static void disk_gcds(vector<mpz_class> *X, vector<mpz_class> *R) {
+    int levels = product_tree(X);
+    remainders_squares(levels, R);
+    read_level_from_file(0, X);
+    final_gcds(R, X);
+}
+
+/* time_algorithm returns the time taken by 'algorithm' on a copy of X, as the
+ * best of 3 runs for runs under a second.
+ */
+static double time_algorithm(string algorithm, const vector<mpz_class> &X) {
+    // Silence the progress messages of the pipeline
+    std::ofstream null("/dev/null");
+    std::streambuf *saved = cout.rdbuf(null.rdbuf());
+    double best = 0;
+    for (int k = 0; k < 3 && (k == 0 || best < 1); k++) {
+        vector<mpz_class> moduli(X), R;
+        struct timespec start, finish;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (algorithm == "disk") {
+            disk_gcds(&moduli, &R);
+        } else {
+            small_batch_gcds(algorithm, &moduli, &R);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &finish);
+        double elapsed = finish.tv_sec - start.tv_sec +
+            (finish.tv_nsec - start.tv_nsec) / 1000000000.0;
+        if (k == 0 || elapsed < best) best = elapsed;
+    }
+    cout.rdbuf(saved);
+    return best;
+}
+
+/* calibrate_small_batches times the three algorithms on batches of 8 to
+ * CALIBRATION_MAX random moduli of 1024, 2048 and 4096 bits, and stores the
+ * crossovers in the profile. Pairwise is no longer timed once it loses to the
+ * in-memory tree, and the batches stop growing once the stored tree wins.
+ */
+void calibrate_small_batches() {
+    gmp_randclass random(gmp_randinit_default);
+    std::map<string, string> profile = read_key_value_file(profile_file());
+    string tree_dir = TREE_DIR;
+    TREE_DIR = "data/tune_tree";
+    cout << "   bits   moduli   pairwise (s)   memory (s)   disk (s)" << endl;
+    for (size_t bits : {1024, 2048, 4096}) {
+        size_t pairwise_max = 0, memory_max = 0;
+        bool pairwise_lost = false;
+        for (size_t n = 8; n <= CALIBRATION_MAX; n *= 2) {
+            vector<mpz_class> X(n);
+            for (size_t i = 0; i < n; i++) {
+                X[i] = random.get_z_bits(bits);
+                mpz_setbit(X[i].get_mpz_t(), bits-1);
+                mpz_setbit(X[i].get_mpz_t(), 0);
+            }
+            double pairwise = pairwise_lost ? 0 : time_algorithm("pairwise", X);
+            double memory = time_algorithm("memory", X);
+            double disk = time_algorithm("disk", X);
+            cout << "   " << bits << "\t" << n << "\t";
+            cout << (pairwise_lost ? "-" : to_string(pairwise)) << "\t";
+            cout << memory << "\t" << disk << endl;
+            if (!pairwise_lost && pairwise <= memory) {
+                pairwise_max = n;
+            } else {
+                pairwise_lost = true;
+            }
+            if (memory > disk) break;
+            memory_max = n;
+        }
+        string bucket = to_string(size_bucket(bits));
+        profile["pairwise_max_" + bucket] = to_string(pairwise_max);
+        profile["memory_max_" + bucket] = to_string(memory_max);
+    }
+    boost::filesystem::remove_all(TREE_DIR);
+    TREE_DIR = tree_dir;
+    write_profile(profile);
+    cout << "Small batch crossovers stored in " << profile_file() << endl;
+}
@@ -0,0 +1,10 @@
+#ifndef SRC_SMALL_BATCH_HPP_
+#define SRC_SMALL_BATCH_HPP_
+
+#include "utils.hpp"
+
+string choose_algorithm(vector<mpz_class> *);
+void small_batch_gcds(string, vector<mpz_class> *, vector<mpz_class> *);
+void calibrate_small_batches();
+
+#endif /* SRC_SMALL_BATCH_HPP_ */
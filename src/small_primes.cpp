@@ -0,0 +1,155 @@
+#include "small_primes.hpp"
+#include <algorithm>
+#include <cmath>
+#include "opstats.hpp"
+
+using std::cout;
+using std::endl;
+using std::min;
+
+/* Small-prime stage and smooth parts
+ *
+ * Batch GCD only finds a small factor of a modulus if another modulus happens
+ * to share it. This optional stage runs Bernstein's remainder tree of the
+ * product P of all primes below a bound down the stored product tree of the
+ * moduli (remainders_mod), so that gcd(P mod Xᵢ, Xᵢ) reveals the small
+ * factors of every modulus at once, in quasilinear time.
+ *
+ * More generally, for any set of primes (a "prime base"), the same trees give
+ * the smooth part of every modulus with respect to that base, as in
+ * Bernstein's "How to find smooth parts of integers".
+ */
+
+// Primes are multiplied in chunks of this size before the product tree.
+static const unsigned int PRIMES_PER_CHUNK = 1 << 12;
+
+/* primes_product sets P to the product of all primes below 'bound', sieving
+ * segment by segment so that memory does not depend on the bound.
+ */
+void primes_product(uint64_t bound, mpz_class *P) {
+    cout << "   Computing product of primes below " << bound << endl;
+    uint64_t root = static_cast<uint64_t>(sqrtl(bound)) + 1;
+    vector<char> is_prime(root + 1, 1);
+    vector<uint64_t> base;
+    for (uint64_t p = 2; p <= root; p++) {
+        if (!is_prime[p]) continue;
+        base.push_back(p);
+        for (uint64_t m = p*p; m <= root; m += p) is_prime[m] = 0;
+    }
+    vector<mpz_class> chunks;
+    mpz_class chunk = 1;
+    unsigned int in_chunk = 0;
+    uint64_t count = 0;
+    const uint64_t segment = 1 << 20;
+    vector<char> sieve(segment);
+    for (uint64_t low = 2; low < bound; low += segment) {
+        uint64_t high = min(low + segment, bound);
+        std::fill(sieve.begin(), sieve.end(), 1);
+        for (unsigned int k = 0; k < base.size(); k++) {
+            uint64_t p = base[k];
+            if (p*p >= high) break;
+            uint64_t start = std::max(p*p, (low + p - 1) / p * p);
+            for (uint64_t m = start; m < high; m += p) sieve[m - low] = 0;
+        }
+        for (uint64_t x = low; x < high; x++) {
+            if (!sieve[x - low]) continue;
+            mpz_mul_ui(chunk.get_mpz_t(), chunk.get_mpz_t(), x);
+            count++;
+            if (++in_chunk == PRIMES_PER_CHUNK) {
+                chunks.push_back(chunk);
+                chunk = 1;
+                in_chunk = 0;
+            }
+        }
+    }
+    if (in_chunk) chunks.push_back(chunk);
+    product_of(&chunks, P);
+    cout << "   Product of " << count << " primes has ";
+    cout << mpz_sizeinbase(P->get_mpz_t(), 2) << " bits" << endl;
+}
+
+/* smooth_parts sets S[i] to the P-smooth part of the leaf Xᵢ of the stored
+ * product tree, i.e. the largest divisor of Xᵢ made of primes dividing P.
+ * As in Bernstein's algorithm, remᵢ <- P mod Xᵢ is computed with the
+ * remainder tree, and then
+ *
+ *          S[i] = gcd(remᵢ^(2^e) mod Xᵢ, Xᵢ),     with 2^(2^e) >= Xᵢ,
+ *
+ * where the repeated squarings account for the multiplicities. Leaves are
+ * split among N_THREADS threads.
+ */
+void smooth_parts(int levels, const mpz_class &P, vector<mpz_class> *S) {
+    vector<mpz_class> X;
+    remainders_mod(levels, P, S);
+    read_level_from_file(0, &X);
+    cout << "   Repeated squarings of " << X.size() << " remainders" << endl;
+    vector<boost::thread> threads;
+    int n_threads = min<size_t>(N_THREADS, X.size());
+    for (int j = 0; j < n_threads; j++) {
+        threads.push_back(boost::thread([j, n_threads, S, &X]() {
+            for (size_t i = j; i < X.size(); i += n_threads) {
+                mpz_ptr y = (*S)[i].get_mpz_t();
+                mpz_srcptr x = X[i].get_mpz_t();
+                mpz_class square;
+                size_t bits = mpz_sizeinbase(x, 2);
+                for (size_t e = 1; e < bits; e *= 2) {
+                    op_sqr(square.get_mpz_t(), y);
+                    op_mod(y, square.get_mpz_t(), x);
+                }
+                op_gcd(y, y, x);
+            }
+            }));
+    }
+    for (auto& th : threads)
+        th.join();
+}
+
+/* small_factors finds the moduli of the stored product tree having a factor
+ * dividing P, and writes them to smallfactors.csv as
+ *
+ *          <ID>,<P-part of the modulus in base 16>,<smooth|partial>
+ *
+ * where 'smooth' means that the modulus is a product of primes dividing P.
+ * Returns the amount of such moduli.
+ */
+size_t small_factors(int levels, const mpz_class &P, vector<string> *IDs) {
+    vector<mpz_class> S, X;
+    smooth_parts(levels, P, &S);
+    read_level_from_file(0, &X);
+    std::ofstream file("smallfactors.csv");
+    size_t found = 0, smooth = 0;
+    for (size_t i = 0; i < X.size(); i++) {
+        if (S[i] == 1) continue;
+        found++;
+        if (S[i] == X[i]) smooth++;
+        file << (*IDs)[i] << "," << S[i].get_str(16) << ",";
+        file << (S[i] == X[i] ? "smooth" : "partial") << "\n";
+    }
+    file.close();
+    cout << "   Moduli with small factors: " << found << " (" << smooth;
+    cout << " smooth), see smallfactors.csv" << endl;
+    return found;
+}
+
+/* write_smooth_parts writes the nontrivial P-smooth parts of the leaves of
+ * the stored product tree to smoothparts.csv, as
+ *
+ *          <ID>,<smooth part in base 16>
+ *
+ * Returns the amount of moduli with a nontrivial smooth part.
+ */
+size_t write_smooth_parts(int levels, const mpz_class &P, vector<string> *IDs) {
+    vector<mpz_class> S;
+    smooth_parts(levels, P, &S);
+    std::ofstream file("smoothparts.csv");
+    size_t found = 0;
+    for (size_t i = 0; i < S.size(); i++) {
+        if (S[i] == 1) continue;
+        found++;
+        file << (*IDs)[i] << "," << S[i].get_str(16) << "\n";
+    }
+    file.close();
+    cout << "   Moduli with nontrivial smooth part: " << found;
+    cout << ", see smoothparts.csv" << endl;
+    return found;
+}
@@ -0,0 +1,12 @@
+#ifndef SRC_SMALL_PRIMES_HPP_
+#define SRC_SMALL_PRIMES_HPP_
+
+#include <cstdint>
+#include "utils.hpp"
+
+void primes_product(uint64_t bound, mpz_class *P);
+void smooth_parts(int levels, const mpz_class &P, vector<mpz_class> *S);
+size_t small_factors(int levels, const mpz_class &P, vector<string> *IDs);
+size_t write_smooth_parts(int levels, const mpz_class &P, vector<string> *IDs);
+
+#endif /* SRC_SMALL_PRIMES_HPP_ */
@@ -0,0 +1,284 @@
+#include "spill.hpp"
+#include "backend.hpp"
+#include <malloc.h>
+#include <atomic>
+#include <cstdio>
+
+using std::cout;
+using std::endl;
+using std::min;
+using std::to_string;
+
+/* Out-of-core remainder levels
+ *
+ * Breadth-first remainder trees hold the remainders of a level (R) and of the
+ * next one (newR) in RAM, which peaks at the wide bottom levels. The workers
+ * of partial_remainders and partial_cofactors track both levels with
+ * spill_chunks:
+ *
+ *   - a chunk of R is freed as soon as all its children are computed;
+ *   - under memory pressure, a chunk of newR is written to TREE_DIR/spill and
+ *     freed as soon as it is complete, and so are the chunks of R not reached
+ *     yet, from the end of the level. Spilled chunks are read back when a
+ *     worker needs them, and newR becomes the R of the next level with its
+ *     chunks still on disk.
+ *
+ * Memory pressure means either that the limbs allocated by GMP, counted by
+ * track_gmp_memory, exceed SPILL_RATIO of MEMORY_BUDGET (option
+ * -memory-budget), or that the cgroup of the process is close to its limit:
+ * memory.current above SPILL_RATIO of memory.max (or memory.high), or a new
+ * 'high' or 'max' event in memory.events (cgroup v2).
+ */
+uint64_t MEMORY_BUDGET = 0;
+
+static const size_t SPILL_CHUNK = 1 << 12;
+static const double SPILL_RATIO = 0.9;
+// The cgroup files are read at most this often
+static const double CGROUP_PERIOD = 0.1;
+
+static std::atomic<int64_t> gmp_bytes(0);
+
+static void *counted_alloc(size_t n) {
+    gmp_bytes += n;
+    void *p = malloc(n);
+    if (!p) {
+        cout << "Fatal error: out of memory" << endl;
+        abort();
+    }
+    return p;
+}
+
+static void *counted_realloc(void *p, size_t old_size, size_t new_size) {
+    gmp_bytes += static_cast<int64_t>(new_size) - old_size;
+    p = realloc(p, new_size);
+    if (!p) {
+        cout << "Fatal error: out of memory" << endl;
+        abort();
+    }
+    return p;
+}
+
+static void counted_free(void *p, size_t n) {
+    gmp_bytes -= n;
+    free(p);
+}
+
+/* track_gmp_memory counts the bytes allocated by GMP from now on. It must be
+ * called before any integer is allocated.
+ */
+void track_gmp_memory() {
+    mp_set_memory_functions(counted_alloc, counted_realloc, counted_free);
+}
+
+static string cgroup_dir() {
+    std::ifstream file("/proc/self/cgroup");
+    string line;
+    while (std::getline(file, line)) {
+        // cgroup v2: "0::<path>"
+        if (line.compare(0, 3, "0::") == 0) {
+            return "/sys/fs/cgroup" + line.substr(3);
+        }
+    }
+    return "";
+}
+
+static uint64_t read_cgroup_value(string path) {
+    std::ifstream file(path);
+    string value;
+    if (!(file >> value) || value == "max") return 0;
+    return std::stoull(value);
+}
+
+// cgroup_events returns the sum of the 'high' and 'max' counters.
+static uint64_t cgroup_events(string path) {
+    std::ifstream file(path);
+    string key;
+    uint64_t value, events = 0;
+    while (file >> key >> value) {
+        if (key == "high" || key == "max") events += value;
+    }
+    return events;
+}
+
+static bool cgroup_pressure() {
+    static const string dir = cgroup_dir();
+    static boost::mutex mutex;
+    static struct timespec last = {0, 0};
+    static bool pressure = false, first = true;
+    static uint64_t events = 0;
+    if (dir == "") return false;
+    boost::unique_lock<boost::mutex> lock(mutex);
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (now.tv_sec - last.tv_sec +
+            (now.tv_nsec - last.tv_nsec) / 1000000000.0 < CGROUP_PERIOD) {
+        return pressure;
+    }
+    last = now;
+    uint64_t limit = read_cgroup_value(dir + "/memory.max");
+    uint64_t high = read_cgroup_value(dir + "/memory.high");
+    if (high && (!limit || high < limit)) limit = high;
+    uint64_t current = read_cgroup_value(dir + "/memory.current");
+    uint64_t new_events = cgroup_events(dir + "/memory.events");
+    pressure = (limit && current > SPILL_RATIO * limit) ||
+        (!first && new_events > events);
+    events = new_events;
+    first = false;
+    return pressure;
+}
+
+// memory_pressure returns true if remainders should be moved to disk.
+bool memory_pressure() {
+    if (MEMORY_BUDGET && gmp_bytes > SPILL_RATIO * MEMORY_BUDGET) {
+        return true;
+    }
+    return cgroup_pressure();
+}
+
+spill_chunks::spill_chunks() : size(0), spills(0) {
+    static std::atomic<int> instances(0);
+    name = to_string(getpid()) + "_" + to_string(instances++);
+}
+
+spill_chunks::~spill_chunks() {
+    remove_files();
+    // Remove TREE_DIR/spill too, unless another level still has chunks there
+    boost::system::error_code error;
+    boost::filesystem::remove(TREE_DIR + "/spill", error);
+}
+
+/* reset starts tracking a level of 'size' values, whose value i is the parent
+ * of values 2i and 2i+1 of a level of 'children' values (0 for the leaves).
+ */
+void spill_chunks::reset(size_t size, size_t children) {
+    remove_files();
+    this->size = size;
+    size_t chunks = (size + SPILL_CHUNK - 1) / SPILL_CHUNK;
+    on_disk.assign(chunks, 0);
+    freed.assign(chunks, 0);
+    users.assign(chunks, 0);
+    done.assign(chunks, 0);
+    filled.assign(chunks, 0);
+    expected.assign(chunks, 0);
+    for (size_t c = 0; c < chunks; c++) {
+        size_t first = 2 * c * SPILL_CHUNK;
+        size_t last = min(2 * chunk_end(c), children);
+        expected[c] = last > first ? last - first : 0;
+    }
+}
+
+// swap exchanges the tracked levels, as R->swap(newR) does with the values.
+void spill_chunks::swap(spill_chunks &other) {
+    std::swap(name, other.name);
+    std::swap(size, other.size);
+    on_disk.swap(other.on_disk);
+    freed.swap(other.freed);
+    users.swap(other.users);
+    done.swap(other.done);
+    expected.swap(other.expected);
+    filled.swap(other.filled);
+}
+
+// acquire makes value i resident until the matching release.
+void spill_chunks::acquire(vector<mpz_class> *values, size_t i) {
+    boost::unique_lock<boost::mutex> lock(mutex);
+    size_t c = i / SPILL_CHUNK;
+    if (on_disk[c]) load(values, c);
+    users[c]++;
+}
+
+/* release ends the use of value i, which was the parent of 'children' values
+ * of the next level. The chunk is freed once all its children are computed.
+ */
+void spill_chunks::release(vector<mpz_class> *values, size_t i,
+        size_t children) {
+    boost::unique_lock<boost::mutex> lock(mutex);
+    size_t c = i / SPILL_CHUNK;
+    users[c]--;
+    done[c] += children;
+    if (expected[c] && done[c] == expected[c] && users[c] == 0) {
+        for (size_t k = c * SPILL_CHUNK; k < chunk_end(c); k++) {
+            mpz_class().swap((*values)[k]);
+        }
+        freed[c] = 1;
+    }
+}
+
+/* produced records that 'count' values from i on are computed. A complete
+ * chunk is moved to disk under memory pressure.
+ */
+void spill_chunks::produced(vector<mpz_class> *values, size_t i,
+        size_t count) {
+    boost::unique_lock<boost::mutex> lock(mutex);
+    size_t c = i / SPILL_CHUNK;
+    filled[c] += count;
+    if (filled[c] == chunk_end(c) - c * SPILL_CHUNK && memory_pressure()) {
+        spill(values, c);
+    }
+}
+
+// spill_ahead moves to disk the last chunk which no worker has reached yet.
+void spill_chunks::spill_ahead(vector<mpz_class> *values) {
+    boost::unique_lock<boost::mutex> lock(mutex);
+    for (size_t c = on_disk.size(); c-- > 0;) {
+        if (on_disk[c] || freed[c]) continue;
+        if (users[c] || done[c]) return;
+        spill(values, c);
+        return;
+    }
+}
+
+// load_all reads back every chunk on disk.
+void spill_chunks::load_all(vector<mpz_class> *values) {
+    boost::unique_lock<boost::mutex> lock(mutex);
+    for (size_t c = 0; c < on_disk.size(); c++) {
+        if (on_disk[c]) load(values, c);
+    }
+}
+
+string spill_chunks::chunk_filename(size_t c) const {
+    return TREE_DIR + "/spill/" + name + "_" + to_string(c) + ".gmp";
+}
+
+size_t spill_chunks::chunk_end(size_t c) const {
+    return min((c+1) * SPILL_CHUNK, size);
+}
+
+void spill_chunks::spill(vector<mpz_class> *values, size_t c) {
+    boost::filesystem::create_directories(TREE_DIR + "/spill");
+    FILE *file = fopen(chunk_filename(c).c_str(), "wb");
+    if (!file) {
+        cout << "Fatal error: cannot write " << chunk_filename(c) << endl;
+        throw std::exception();
+    }
+    for (size_t k = c * SPILL_CHUNK; k < chunk_end(c); k++) {
+        write_raw(file, (*values)[k].get_mpz_t());
+        mpz_class().swap((*values)[k]);
+    }
+    fclose(file);
+    on_disk[c] = 1;
+    spills++;
+    // Give the freed pages back, so that the cgroup sees them go
+    malloc_trim(0);
+}
+
+void spill_chunks::load(vector<mpz_class> *values, size_t c) {
+    FILE *file = fopen(chunk_filename(c).c_str(), "rb");
+    if (!file) {
+        cout << "Fatal error: missing " << chunk_filename(c) << endl;
+        throw std::exception();
+    }
+    for (size_t k = c * SPILL_CHUNK; k < chunk_end(c); k++) {
+        read_raw((*values)[k].get_mpz_t(), file);
+    }
+    fclose(file);
+    remove(chunk_filename(c).c_str());
+    on_disk[c] = 0;
+}
+
+void spill_chunks::remove_files() {
+    for (size_t c = 0; c < on_disk.size(); c++) {
+        if (on_disk[c]) remove(chunk_filename(c).c_str());
+    }
+    on_disk.assign(on_disk.size(), 0);
+}
@@ -0,0 +1,47 @@
+#ifndef SRC_SPILL_HPP_
+#define SRC_SPILL_HPP_
+
+#include "utils.hpp"
+
+// Memory budget of the remainders, in bytes. 0 means the cgroup limit only.
+extern uint64_t MEMORY_BUDGET;
+
+void track_gmp_memory();
+bool memory_pressure();
+
+/* spill_chunks tracks a level of remainders in chunks of SPILL_CHUNK values,
+ * which are freed once consumed, or moved to disk under memory pressure and
+ * reloaded on demand. The values themselves stay in the caller's vector, which
+ * is passed to every call.
+ */
+class spill_chunks {
+ public:
+    spill_chunks();
+    ~spill_chunks();
+    void reset(size_t size, size_t children);
+    void swap(spill_chunks &other);
+    void acquire(vector<mpz_class> *values, size_t i);
+    void release(vector<mpz_class> *values, size_t i, size_t children);
+    void produced(vector<mpz_class> *values, size_t i, size_t count);
+    void spill_ahead(vector<mpz_class> *values);
+    void load_all(vector<mpz_class> *values);
+    size_t spilled_chunks() const { return spills; }
+
+ private:
+    string chunk_filename(size_t c) const;
+    size_t chunk_end(size_t c) const;
+    void spill(vector<mpz_class> *values, size_t c);
+    void load(vector<mpz_class> *values, size_t c);
+    void remove_files();
+
+    string name;
+    size_t size;
+    // Per chunk: on disk, freed, threads reading it, children computed from
+    // it, children expected, and values produced
+    vector<char> on_disk, freed;
+    vector<size_t> users, done, expected, filled;
+    size_t spills;
+    boost::mutex mutex;
+};
+
+#endif /* SRC_SPILL_HPP_ */
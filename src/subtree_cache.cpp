@@ -0,0 +1,257 @@
+#include "subtree_cache.hpp"
+#include "backend.hpp"
+#include "tuner.hpp"
+#include "probes.hpp"
+#include <sys/stat.h>
+#include <utime.h>
+#include <algorithm>
+#include <atomic>
+#include <boost/uuid/detail/sha1.hpp>
+
+using std::cout;
+using std::endl;
+using std::min;
+using std::to_string;
+
+/* Content-addressed cache of product tree nodes
+ *
+ * Each node is identified by a Merkle-style hash of the leaves below it:
+ * leaves hash their value, internal nodes hash the hashes of their children
+ * (with distinct prefixes, so that a leaf never has the hash of a node), and
+ * orphan nodes keep the hash of their only child. Consecutive runs over
+ * mostly the same moduli share the subtrees whose leaves did not change, as
+ * long as the tree groups the leaves the same way: bucket_leaves_by_hash
+ * places the leaves whose hashes share a prefix of k bits in an aligned
+ * subtree of BUCKET_SIZE leaves, padded with leaves equal to 1. The tree above
+ * the buckets is then the binary trie of the prefixes, and adding or removing
+ * a modulus only changes the nodes on the path from its bucket to the root.
+ *
+ * The products of shared subtrees are read from <CACHE_DIR>/<hash>.gmp,
+ * followed by the SHA-1 of their limbs, instead of being recomputed. Only
+ * nodes of at least CACHE_MIN_BITS bits are cached, since small products are
+ * cheaper to compute than to read. The least recently used entries are
+ * deleted when the cache exceeds CACHE_MAX_BYTES.
+ */
+string CACHE_DIR = "";
+uint64_t CACHE_MAX_BYTES = 10ULL << 30;
+size_t CACHE_MIN_BITS = 1 << 18;
+
+// Leaves per bucket; buckets hold BUCKET_SIZE/2 to BUCKET_SIZE moduli on
+// average
+static const size_t BUCKET_SIZE = 64;
+// Stale temporary entries, left by interrupted runs, are older than this (s)
+static const time_t STALE_TMP_SECONDS = 3600;
+
+// Prefixes of the hashed data of leaves and of internal nodes
+static const unsigned char LEAF_PREFIX = 0, NODE_PREFIX = 1;
+
+static subtree_hash sha1_of(unsigned char prefix, const void *data,
+        size_t length) {
+    boost::uuids::detail::sha1 sha;
+    sha.process_byte(prefix);
+    sha.process_bytes(data, length);
+    unsigned int digest[5];
+    sha.get_digest(digest);
+    subtree_hash h;
+    std::copy(digest, digest + 5, h.begin());
+    return h;
+}
+
+static string hash_to_hex(const subtree_hash &h) {
+    char hex[41];
+    for (int k = 0; k < 5; k++) {
+        snprintf(hex + 8*k, 9, "%08x", h[k]);
+    }
+    return string(hex);
+}
+
+// leaf_hashes sets the hash of each leaf, i.e. the SHA-1 of its raw bytes.
+void leaf_hashes(vector<mpz_class> *X, vector<subtree_hash> *hashes) {
+    hashes->resize(X->size());
+    for (size_t i = 0; i < X->size(); i++) {
+        size_t count;
+        void *bytes = mpz_export(NULL, &count, 1, 1, 0, 0,
+                (*X)[i].get_mpz_t());
+        (*hashes)[i] = sha1_of(LEAF_PREFIX, bytes, count);
+        free(bytes);
+    }
+}
+
+/* bucket_leaves_by_hash orders the moduli (and their IDs) by leaf hash, in
+ * 2^k buckets by the first k bits of the hash, with the smallest k for which
+ * buckets hold fewer than BUCKET_SIZE moduli on average. Each bucket is
+ * padded with leaves equal to 1 (and empty IDs) to BUCKET_SIZE leaves, so
+ * that it is a whole subtree of the product tree whose value only depends on
+ * its own moduli. The moduli that do not fit in their bucket follow all the
+ * buckets, by hash, as a separate subtree. The shape of the tree thus only
+ * changes when n crosses a power of two, or with the overflow. Padding leaves
+ * never have a nontrivial gcd, so they are not reported.
+ */
+void bucket_leaves_by_hash(vector<mpz_class> *X, vector<string> *IDs) {
+    if (X->empty()) return;
+    vector<subtree_hash> hashes;
+    leaf_hashes(X, &hashes);
+    vector<size_t> order(X->size());
+    for (size_t i = 0; i < order.size(); i++) order[i] = i;
+    std::sort(order.begin(), order.end(), [&hashes](size_t a, size_t b) {
+            return hashes[a] < hashes[b]; });
+    int k = 0;
+    while (k < 32 && (X->size() >> k) >= BUCKET_SIZE) k++;
+    auto bucket = [&hashes, k](size_t i) {
+        return k ? hashes[i][0] >> (32 - k) : 0;
+    };
+    size_t buckets = 1ULL << k;
+    vector<size_t> counts(buckets, 0);
+    vector<size_t> overflow;
+    for (size_t i : order) {
+        if (counts[bucket(i)] < BUCKET_SIZE) {
+            counts[bucket(i)]++;
+        } else {
+            overflow.push_back(i);
+        }
+    }
+    vector<mpz_class> sorted_X(buckets * BUCKET_SIZE + overflow.size(), 1);
+    vector<string> sorted_IDs(sorted_X.size());
+    std::fill(counts.begin(), counts.end(), 0);
+    size_t end = buckets * BUCKET_SIZE;
+    for (size_t i : order) {
+        size_t b = bucket(i);
+        size_t position = counts[b] < BUCKET_SIZE ?
+            b * BUCKET_SIZE + counts[b]++ : end++;
+        sorted_X[position].swap((*X)[i]);
+        sorted_IDs[position].swap((*IDs)[i]);
+    }
+    cout << "   Subtree cache: " << X->size() << " moduli in " << buckets;
+    cout << " buckets of " << BUCKET_SIZE << " leaves, ";
+    cout << overflow.size() << " overflowing" << endl;
+    X->swap(sorted_X);
+    IDs->swap(sorted_IDs);
+}
+
+// limbs_digest is the SHA-1 of the limbs of x, stored after cached values.
+static subtree_hash limbs_digest(const mpz_class &x) {
+    return sha1_of(LEAF_PREFIX, mpz_limbs_read(x.get_mpz_t()),
+            mpz_size(x.get_mpz_t()) * sizeof(mp_limb_t));
+}
+
+/* cache_load reads the node with the given hash, if cached, and marks it as
+ * recently used. A valid entry has the size of the product of the children,
+ * 'expected_bits' (up to one bit), and matches its digest.
+ */
+static bool cache_load(const subtree_hash &h, size_t expected_bits,
+        mpz_class *x) {
+    string path = CACHE_DIR + "/" + hash_to_hex(h) + ".gmp";
+    FILE* file = fopen(path.c_str(), "rb");
+    if (!file) {
+        return false;
+    }
+    size_t read = read_raw(x->get_mpz_t(), file);
+    subtree_hash digest;
+    bool complete = fread(digest.data(), sizeof(digest), 1, file) == 1;
+    fclose(file);
+    size_t bits = mpz_sizeinbase(x->get_mpz_t(), 2);
+    if (read == 0 || !complete || bits > expected_bits ||
+            bits + 1 < expected_bits || digest != limbs_digest(*x)) {
+        cout << "     Discarding corrupted cache entry " << path << endl;
+        remove(path.c_str());
+        return false;
+    }
+    utime(path.c_str(), NULL);
+    return true;
+}
+
+// cache_store writes the node atomically, so that readers never see halves.
+static void cache_store(const subtree_hash &h, const mpz_class &x) {
+    string path = CACHE_DIR + "/" + hash_to_hex(h) + ".gmp";
+    string tmp = path + ".tmp" + to_string(pthread_self());
+    FILE* file = fopen(tmp.c_str(), "wb");
+    if (!file) {
+        return;
+    }
+    subtree_hash digest = limbs_digest(x);
+    bool ok = write_raw(file, x.get_mpz_t()) != 0 &&
+        fwrite(digest.data(), sizeof(digest), 1, file) == 1;
+    ok = (fclose(file) == 0) && ok;
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+        remove(tmp.c_str());
+    }
+}
+
+/* cached_level_mult is mt_level_mult, taking the products of cached subtrees
+ * from the cache instead of computing them. It also computes the hashes of
+ * the next level (except for the orphan node, if any).
+ */
+void cached_level_mult(vector<mpz_class> *_level, vector<mpz_class> *_next,
+        vector<subtree_hash> *hashes, vector<subtree_hash> *next_hashes) {
+    _next->resize(_level->size()/2);
+    next_hashes->resize(_level->size()/2);
+    std::atomic<size_t> next(0), hits(0), stores(0);
+    size_t bits = mpz_sizeinbase((*_level)[0].get_mpz_t(), 2);
+    level_plan plan = run_tuned("mult", _next->size(), bits,
+            [&next, &hits, &stores, _level, _next, hashes,
+            next_hashes](int depth) {
+            size_t i = next++;
+            if (i >= _next->size()) return false;
+            subtree_hash children[2] = {(*hashes)[2*i], (*hashes)[2*i+1]};
+            subtree_hash h = sha1_of(NODE_PREFIX, children,
+                    sizeof(children));
+            (*next_hashes)[i] = h;
+            mpz_srcptr a = (*_level)[2*i].get_mpz_t();
+            mpz_srcptr b = (*_level)[2*i+1].get_mpz_t();
+            size_t bits = mpz_sizeinbase(a, 2) + mpz_sizeinbase(b, 2);
+            PROBE3(task_start, "mult", i, mpz_sizeinbase(a, 2));
+            if (bits >= CACHE_MIN_BITS && cache_load(h, bits, &(*_next)[i])) {
+                hits++;
+            } else {
+                parallel_mul((*_next)[i].get_mpz_t(), a, b, depth);
+                if (bits >= CACHE_MIN_BITS) {
+                    cache_store(h, (*_next)[i]);
+                    stores++;
+                }
+            }
+            PROBE2(task_end, "mult", i);
+            return true;
+            });
+    cout << "     " + to_string(plan.threads) + " threads finished.\n";
+    if (hits + stores > 0) {
+        cout << "     Subtree cache: " << hits << " hits, ";
+        cout << stores << " new entries" << endl;
+    }
+}
+
+/* evict_cache deletes the least recently used entries (by modification time,
+ * which cache_load refreshes) until the cache fits in CACHE_MAX_BYTES, and
+ * the temporary entries left by interrupted stores.
+ */
+void evict_cache() {
+    namespace fs = boost::filesystem;
+    vector<std::pair<time_t, fs::path>> entries;
+    uint64_t total = 0;
+    time_t now = time(NULL);
+    for (fs::directory_iterator it(CACHE_DIR), end; it != end; ++it) {
+        if (it->path().filename().string().find(".gmp.tmp") != string::npos) {
+            // Another run may still be writing a recent one
+            boost::system::error_code error;
+            if (now - fs::last_write_time(it->path(), error) >
+                    STALE_TMP_SECONDS && !error) {
+                fs::remove(it->path(), error);
+            }
+            continue;
+        }
+        if (it->path().extension() != ".gmp") continue;
+        total += fs::file_size(it->path());
+        entries.push_back({fs::last_write_time(it->path()), it->path()});
+    }
+    if (total <= CACHE_MAX_BYTES) {
+        return;
+    }
+    std::sort(entries.begin(), entries.end());
+    unsigned int evicted = 0;
+    for (unsigned int k = 0; k < entries.size() && total > CACHE_MAX_BYTES;
+            k++) {
+        total -= fs::file_size(entries[k].second);
+        fs::remove(entries[k].second);
+        evicted++;
+    }
+    cout << "   Subtree cache: evicted " << evicted << " entries" << endl;
+}
@@ -0,0 +1,22 @@
+#ifndef SRC_SUBTREE_CACHE_HPP_
+#define SRC_SUBTREE_CACHE_HPP_
+
+#include <array>
+#include <cstdint>
+#include "utils.hpp"
+
+// Cache of product tree nodes, disabled if CACHE_DIR is empty.
+extern string CACHE_DIR;
+extern uint64_t CACHE_MAX_BYTES;
+extern size_t CACHE_MIN_BITS;
+
+// SHA-1 of the leaves below a node (Merkle-style).
+typedef std::array<uint32_t, 5> subtree_hash;
+
+void leaf_hashes(vector<mpz_class> *, vector<subtree_hash> *);
+void bucket_leaves_by_hash(vector<mpz_class> *, vector<string> *);
+void cached_level_mult(vector<mpz_class> *, vector<mpz_class> *,
+        vector<subtree_hash> *, vector<subtree_hash> *);
+void evict_cache();
+
+#endif /* SRC_SUBTREE_CACHE_HPP_ */
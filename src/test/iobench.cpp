@@ -0,0 +1,431 @@
+/* ------------------------------------------------------
+ * Storage throughput benchmark of product tree levels
+ * ------------------------------------------------------
+ *
+ *  Writes and reads synthetic levels through each serialization path, and
+ *  reports the time and sustained throughput of each level, so that storage
+ *  can be sized for a given corpus. Level l of a tree of 'count' moduli of
+ *  'bits' bits holds count/2^l integers of bits*2^l bits, i.e. each level has
+ *  about the size of the leaves.
+ *
+ *  Each of the 'threads' writers (then readers) handles a contiguous part of
+ *  the level in its own file, as with striped storage. Writes are synced to
+ *  the device, and the page cache of the files is dropped before reading.
+ *
+ *    raw     mpz_out_raw / mpz_inp_raw (patched GMP format, used by the tree)
+ *    limbs   native limbs through stdio: signed limb count, then the limbs
+ *    mmap    limbs format through a shared file mapping
+ *    direct  limbs format with O_DIRECT, bypassing the page cache
+ *    async   limbs format with POSIX AIO, QUEUE_DEPTH requests in flight
+ *
+ *  Usage: ./iobench [-count N] [-bits B] [-levels L] [-threads 1,2,4]
+ *                   [-methods raw,limbs,mmap,direct,async] [-dir data/iobench]
+ */
+
+#include <getopt.h>
+#include <aio.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include "../utils.hpp"
+
+using std::cout;
+using std::endl;
+using std::min;
+using std::to_string;
+
+int N_THREADS = 1;
+
+static const size_t ALIGN = 4096;
+// Size of each request of the direct and async methods
+static const size_t CHUNK = 4 << 20;
+static const int QUEUE_DEPTH = 8;
+
+// Buffer aligned for O_DIRECT, whose size is rounded up to ALIGN.
+struct aligned_buffer {
+    char *data;
+    size_t size;
+
+    explicit aligned_buffer(size_t bytes)
+        : size((bytes + ALIGN-1) / ALIGN * ALIGN) {
+        data = static_cast<char *>(aligned_alloc(ALIGN, std::max(size, ALIGN)));
+        memset(data, 0, size);
+    }
+    ~aligned_buffer() { free(data); }
+};
+
+static size_t limbs_bytes(const mpz_class &x) {
+    return sizeof(int64_t) + mpz_size(x.get_mpz_t()) * sizeof(mp_limb_t);
+}
+
+static size_t stripe_bytes(const vector<mpz_class> &X, size_t first,
+        size_t last) {
+    size_t bytes = 0;
+    for (size_t i = first; i < last; i++) bytes += limbs_bytes(X[i]);
+    return bytes;
+}
+
+// serialize writes X[first, last) in limbs format to 'buffer'.
+static void serialize(const vector<mpz_class> &X, size_t first, size_t last,
+        char *buffer) {
+    for (size_t i = first; i < last; i++) {
+        int64_t n = X[i].get_mpz_t()->_mp_size;
+        memcpy(buffer, &n, sizeof(n));
+        buffer += sizeof(n);
+        size_t bytes = mpz_size(X[i].get_mpz_t()) * sizeof(mp_limb_t);
+        memcpy(buffer, mpz_limbs_read(X[i].get_mpz_t()), bytes);
+        buffer += bytes;
+    }
+}
+
+// deserialize reads X[first, last) in limbs format from 'buffer'.
+static void deserialize(const char *buffer, vector<mpz_class> *X,
+        size_t first, size_t last) {
+    for (size_t i = first; i < last; i++) {
+        int64_t n;
+        memcpy(&n, buffer, sizeof(n));
+        buffer += sizeof(n);
+        size_t limbs = n < 0 ? -n : n;
+        mp_limb_t *p = mpz_limbs_write((*X)[i].get_mpz_t(), limbs);
+        memcpy(p, buffer, limbs * sizeof(mp_limb_t));
+        buffer += limbs * sizeof(mp_limb_t);
+        mpz_limbs_finish((*X)[i].get_mpz_t(), n);
+    }
+}
+
+static size_t file_size(string path) {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 ? st.st_size : 0;
+}
+
+/* Each method writes or reads X[first, last) to or from 'path', and returns
+ * false if it is not supported (e.g. O_DIRECT on tmpfs).
+ */
+static bool write_raw(string path, const vector<mpz_class> &X, size_t first,
+        size_t last) {
+    FILE *file = fopen(path.c_str(), "wb");
+    if (!file) return false;
+    for (size_t i = first; i < last; i++) {
+        mpz_out_raw(file, X[i].get_mpz_t());
+    }
+    fflush(file);
+    fsync(fileno(file));
+    fclose(file);
+    return true;
+}
+
+static bool read_raw(string path, vector<mpz_class> *X, size_t first,
+        size_t last) {
+    FILE *file = fopen(path.c_str(), "rb");
+    if (!file) return false;
+    for (size_t i = first; i < last; i++) {
+        mpz_inp_raw((*X)[i].get_mpz_t(), file);
+    }
+    fclose(file);
+    return true;
+}
+
+static bool write_limbs(string path, const vector<mpz_class> &X, size_t first,
+        size_t last) {
+    FILE *file = fopen(path.c_str(), "wb");
+    if (!file) return false;
+    for (size_t i = first; i < last; i++) {
+        int64_t n = X[i].get_mpz_t()->_mp_size;
+        fwrite(&n, sizeof(n), 1, file);
+        fwrite(mpz_limbs_read(X[i].get_mpz_t()), sizeof(mp_limb_t),
+                mpz_size(X[i].get_mpz_t()), file);
+    }
+    fflush(file);
+    fsync(fileno(file));
+    fclose(file);
+    return true;
+}
+
+static bool read_limbs(string path, vector<mpz_class> *X, size_t first,
+        size_t last) {
+    FILE *file = fopen(path.c_str(), "rb");
+    if (!file) return false;
+    for (size_t i = first; i < last; i++) {
+        int64_t n;
+        if (fread(&n, sizeof(n), 1, file) != 1) break;
+        size_t limbs = n < 0 ? -n : n;
+        mp_limb_t *p = mpz_limbs_write((*X)[i].get_mpz_t(), limbs);
+        if (fread(p, sizeof(mp_limb_t), limbs, file) != limbs) break;
+        mpz_limbs_finish((*X)[i].get_mpz_t(), n);
+    }
+    fclose(file);
+    return true;
+}
+
+static bool write_mmap(string path, const vector<mpz_class> &X, size_t first,
+        size_t last) {
+    size_t bytes = stripe_bytes(X, first, last);
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, bytes) != 0) return false;
+    void *map = mmap(NULL, bytes, PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        close(fd);
+        return false;
+    }
+    serialize(X, first, last, static_cast<char *>(map));
+    msync(map, bytes, MS_SYNC);
+    munmap(map, bytes);
+    close(fd);
+    return true;
+}
+
+static bool read_mmap(string path, vector<mpz_class> *X, size_t first,
+        size_t last) {
+    size_t bytes = file_size(path);
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    void *map = mmap(NULL, bytes, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        close(fd);
+        return false;
+    }
+    madvise(map, bytes, MADV_SEQUENTIAL);
+    deserialize(static_cast<char *>(map), X, first, last);
+    munmap(map, bytes);
+    close(fd);
+    return true;
+}
+
+static bool write_direct(string path, const vector<mpz_class> &X,
+        size_t first, size_t last) {
+    size_t bytes = stripe_bytes(X, first, last);
+    aligned_buffer buffer(bytes);
+    serialize(X, first, last, buffer.data);
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+    if (fd < 0) return false;
+    bool ok = true;
+    for (size_t offset = 0; offset < buffer.size && ok; offset += CHUNK) {
+        size_t length = min(CHUNK, buffer.size - offset);
+        ok = pwrite(fd, buffer.data + offset, length, offset) ==
+            static_cast<ssize_t>(length);
+    }
+    // Drop the padding of the last block
+    ok = ok && ftruncate(fd, bytes) == 0;
+    fsync(fd);
+    close(fd);
+    return ok;
+}
+
+static bool read_direct(string path, vector<mpz_class> *X, size_t first,
+        size_t last) {
+    aligned_buffer buffer(file_size(path));
+    int fd = open(path.c_str(), O_RDONLY | O_DIRECT);
+    if (fd < 0) return false;
+    bool ok = true;
+    for (size_t offset = 0; offset < buffer.size && ok; offset += CHUNK) {
+        size_t length = min(CHUNK, buffer.size - offset);
+        ok = pread(fd, buffer.data + offset, length, offset) >= 0;
+    }
+    close(fd);
+    if (ok) deserialize(buffer.data, X, first, last);
+    return ok;
+}
+
+/* async_transfer writes (or reads) buffer[0, bytes) to (or from) fd with up
+ * to QUEUE_DEPTH requests of CHUNK bytes in flight.
+ */
+static bool async_transfer(int fd, char *buffer, size_t bytes, bool write) {
+    size_t chunks = (bytes + CHUNK-1) / CHUNK;
+    vector<struct aiocb> requests(chunks);
+    size_t submitted = 0, completed = 0;
+    bool ok = true;
+    while (completed < chunks) {
+        while (ok && submitted < chunks && submitted - completed < QUEUE_DEPTH) {
+            struct aiocb &request = requests[submitted];
+            memset(&request, 0, sizeof(request));
+            request.aio_fildes = fd;
+            request.aio_offset = submitted * CHUNK;
+            request.aio_buf = buffer + submitted * CHUNK;
+            request.aio_nbytes = min(CHUNK, bytes - submitted * CHUNK);
+            ok = (write ? aio_write(&request) : aio_read(&request)) == 0;
+            if (ok) submitted++;
+        }
+        if (completed == submitted) break;
+        const struct aiocb *oldest[1] = {&requests[completed]};
+        while (aio_error(oldest[0]) == EINPROGRESS) {
+            aio_suspend(oldest, 1, NULL);
+        }
+        ok = ok && aio_return(&requests[completed]) >= 0;
+        completed++;
+    }
+    return ok && completed == chunks;
+}
+
+static bool write_async(string path, const vector<mpz_class> &X, size_t first,
+        size_t last) {
+    size_t bytes = stripe_bytes(X, first, last);
+    vector<char> buffer(bytes);
+    serialize(X, first, last, buffer.data());
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return false;
+    bool ok = async_transfer(fd, buffer.data(), bytes, true);
+    fsync(fd);
+    close(fd);
+    return ok;
+}
+
+static bool read_async(string path, vector<mpz_class> *X, size_t first,
+        size_t last) {
+    size_t bytes = file_size(path);
+    vector<char> buffer(bytes);
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    bool ok = async_transfer(fd, buffer.data(), bytes, false);
+    close(fd);
+    if (ok) deserialize(buffer.data(), X, first, last);
+    return ok;
+}
+
+typedef bool (*write_method)(string, const vector<mpz_class> &, size_t,
+        size_t);
+typedef bool (*read_method)(string, vector<mpz_class> *, size_t, size_t);
+
+struct method {
+    string name;
+    write_method write;
+    read_method read;
+};
+
+static const vector<method> METHODS = {
+    {"raw", write_raw, read_raw},
+    {"limbs", write_limbs, read_limbs},
+    {"mmap", write_mmap, read_mmap},
+    {"direct", write_direct, read_direct},
+    {"async", write_async, read_async},
+};
+
+// evict drops the cached pages of a file, so that reads hit the device.
+static void evict(string path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return;
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+static double elapsed_since(const struct timespec &start) {
+    struct timespec finish;
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+    return finish.tv_sec - start.tv_sec +
+        (finish.tv_nsec - start.tv_nsec) / 1000000000.0;
+}
+
+/* run_stripes runs 'work(s, first, last)' for the 'threads' stripes of a
+ * level of n integers concurrently, and returns the elapsed time, or -1 if
+ * any stripe failed.
+ */
+static double run_stripes(int threads, size_t n,
+        std::function<bool(int, size_t, size_t)> work) {
+    vector<boost::thread> workers;
+    vector<char> ok(threads, 1);
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int s = 0; s < threads; s++) {
+        workers.push_back(boost::thread([s, threads, n, &work, &ok]() {
+                    ok[s] = work(s, n * s / threads, n * (s+1) / threads);
+                    }));
+    }
+    for (auto& th : workers)
+        th.join();
+    double elapsed = elapsed_since(start);
+    for (char stripe_ok : ok) {
+        if (!stripe_ok) return -1;
+    }
+    return elapsed;
+}
+
+int main(int argc, char** argv) {
+    size_t count = 100000;
+    unsigned int bits = 2048;
+    int levels = 4;
+    string threads_list = "1,2,4";
+    string methods_list = "raw,limbs,mmap,direct,async";
+    string dir = "data/iobench";
+    static struct option long_options[] = {
+          {"count", required_argument, 0, 'n'},
+          {"bits", required_argument, 0, 'b'},
+          {"levels", required_argument, 0, 'l'},
+          {"threads", required_argument, 0, 't'},
+          {"methods", required_argument, 0, 'm'},
+          {"dir", required_argument, 0, 'd'},
+          {0, 0, 0, 0}
+        };
+    int option_index = 0;
+    int c;
+    while ((c = getopt_long_only(argc, argv, "", long_options,
+                    &option_index)) != -1) {
+        if (c == 'n') count = strtoull(optarg, NULL, 10);
+        if (c == 'b') bits = atoi(optarg);
+        if (c == 'l') levels = atoi(optarg);
+        if (c == 't') threads_list = optarg;
+        if (c == 'm') methods_list = optarg;
+        if (c == 'd') dir = optarg;
+        if (c == '?') exit(1);
+    }
+    vector<string> thread_counts, method_names;
+    boost::split(thread_counts, threads_list, boost::is_any_of(","));
+    boost::split(method_names, methods_list, boost::is_any_of(","));
+    boost::filesystem::create_directories(dir);
+
+    gmp_randclass random(gmp_randinit_default);
+    printf("%5s %9s %9s %7s %7s %8s %9s %10s %9s %10s\n", "level", "ints",
+            "bits", "method", "threads", "MB", "write (s)", "write MB/s",
+            "read (s)", "read MB/s");
+    for (int l = 0; l < levels; l++) {
+        size_t n = std::max<size_t>(1, count >> l);
+        vector<mpz_class> X(n), Y(n);
+        for (size_t i = 0; i < n; i++) {
+            X[i] = random.get_z_bits(static_cast<mp_bitcnt_t>(bits) << l);
+        }
+        double megabytes = stripe_bytes(X, 0, n) / 1048576.0;
+        for (const method &m : METHODS) {
+            if (std::find(method_names.begin(), method_names.end(), m.name) ==
+                    method_names.end()) {
+                continue;
+            }
+            for (const string &t : thread_counts) {
+                int threads = std::max(1, atoi(t.c_str()));
+                auto path = [&dir](int s) {
+                    return dir + "/stripe" + to_string(s) + ".bin";
+                };
+                double write_time = run_stripes(threads, n,
+                        [&](int s, size_t first, size_t last) {
+                        return m.write(path(s), X, first, last);
+                        });
+                for (int s = 0; s < threads; s++) evict(path(s));
+                double read_time = write_time < 0 ? -1 : run_stripes(threads,
+                        n, [&](int s, size_t first, size_t last) {
+                        return m.read(path(s), &Y, first, last);
+                        });
+                for (int s = 0; s < threads; s++) remove(path(s).c_str());
+                if (write_time < 0 || read_time < 0) {
+                    printf("%5d %9zu %9zu %7s %7d   not supported here\n", l,
+                            n, static_cast<size_t>(bits) << l, m.name.c_str(),
+                            threads);
+                    continue;
+                }
+                if (X != Y) {
+                    cout << "Fatal error: " << m.name << " did not read back ";
+                    cout << "level " << l << endl;
+                    exit(1);
+                }
+                printf("%5d %9zu %9zu %7s %7d %8.1f %9.3f %10.1f %9.3f %10.1f\n",
+                        l, n, static_cast<size_t>(bits) << l, m.name.c_str(),
+                        threads, megabytes, write_time, megabytes / write_time,
+                        read_time, megabytes / read_time);
+                for (size_t i = 0; i < n; i++) Y[i] = 0;
+            }
+        }
+    }
+    return 0;
+}
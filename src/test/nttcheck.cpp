@@ -0,0 +1,215 @@
+/* ------------------------------------------------------
+ * Check of the NTT multiplier against GMP
+ * ------------------------------------------------------
+ *
+ *  Compares ntt_mul and ntt_sqr with mpz_mul, with every kernel supported by
+ *  the CPU (scalar, avx2, avx512), on:
+ *
+ *    - random operands from 1 limb to 2^15 limbs, balanced and unbalanced,
+ *      signed, and zero;
+ *    - operands whose digits are all 2^32 - 1, which give the largest
+ *      convolution coefficients;
+ *    - products above a lowered NTT_MAX_LENGTH, which are split first.
+ *
+ *  Every operation of each built backend (ntt, and flint with 'make FLINT=1')
+ *  is also compared with GMP, including results written over an operand.
+ *
+ *  With -bench, also times mpz_mul and ntt_mul on operands of 2^20 bits up
+ *  to -max-bits (2^28 by default), on -threads threads.
+ *
+ *  Usage: ./nttcheck [-threads T] [-bench] [-max-bits B]
+ */
+
+#include <getopt.h>
+#include "../utils.hpp"
+#include "../ntt.hpp"
+#include "../backend.hpp"
+
+using std::cout;
+using std::endl;
+
+int N_THREADS = 1;
+
+static gmp_randclass random_state(gmp_randinit_default);
+
+static double elapsed_since(const struct timespec &start) {
+    struct timespec finish;
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+    return finish.tv_sec - start.tv_sec +
+        (finish.tv_nsec - start.tv_nsec) / 1000000000.0;
+}
+
+// check compares ntt_mul(a, b) (ntt_sqr if square) with mpz_mul.
+static bool check(const mpz_class &a, const mpz_class &b, bool square,
+        string what) {
+    mpz_class expected, product;
+    if (square) {
+        mpz_mul(expected.get_mpz_t(), a.get_mpz_t(), a.get_mpz_t());
+        ntt_sqr(product.get_mpz_t(), a.get_mpz_t());
+    } else {
+        mpz_mul(expected.get_mpz_t(), a.get_mpz_t(), b.get_mpz_t());
+        ntt_mul(product.get_mpz_t(), a.get_mpz_t(), b.get_mpz_t());
+    }
+    if (product != expected) {
+        cout << "   Wrong " << (square ? "square" : "product") << ": " << what;
+        cout << " (" << mpz_size(a.get_mpz_t()) << " x ";
+        cout << mpz_size(b.get_mpz_t()) << " limbs)" << endl;
+        return false;
+    }
+    return true;
+}
+
+static mpz_class random_limbs(size_t limbs) {
+    return random_state.get_z_bits(limbs * GMP_NUMB_BITS);
+}
+
+static bool check_kernel() {
+    bool ok = true;
+    const vector<size_t> sizes = {1, 2, 3, 7, 64, 100, 1000, 4097, 1 << 15};
+    for (size_t na : sizes) {
+        for (size_t nb : sizes) {
+            if (nb > na) continue;
+            mpz_class a = random_limbs(na), b = random_limbs(nb);
+            ok &= check(a, b, false, "random");
+            ok &= check(-a, b, false, "negative");
+        }
+        mpz_class a = random_limbs(na);
+        ok &= check(a, a, true, "random");
+        mpz_class ones = (mpz_class(1) << (na * GMP_NUMB_BITS)) - 1;
+        ok &= check(ones, ones, false, "all ones");
+        ok &= check(ones, ones, true, "all ones");
+        ok &= check(ones, 0, false, "zero");
+    }
+    // Split products
+    size_t max_length = NTT_MAX_LENGTH;
+    NTT_MAX_LENGTH = 1 << 12;
+    for (size_t na : {3000, 5000, 20000}) {
+        mpz_class a = random_limbs(na);
+        ok &= check(a, random_limbs(na - 17), false, "split");
+        ok &= check(a, random_limbs(na / 5), false, "split, unbalanced");
+        ok &= check(a, a, true, "split");
+    }
+    NTT_MAX_LENGTH = max_length;
+    return ok;
+}
+
+// check_result compares the result of an operation of 'backend' with GMP.
+static bool check_result(const mpz_class &result, const mpz_class &expected,
+        const bigint_backend *backend, string what, size_t na, size_t nb) {
+    if (result != expected) {
+        cout << "   Wrong " << what << " of backend " << backend->name;
+        cout << " (" << na << " x " << nb << " limbs)" << endl;
+        return false;
+    }
+    return true;
+}
+
+static bool check_backend_ops(const bigint_backend *backend) {
+    bool ok = true;
+    const vector<size_t> sizes = {1, 2, 3, 64, 1000, 4097, 1 << 15};
+    for (size_t na : sizes) {
+        for (size_t nb : sizes) {
+            if (nb > na) continue;
+            mpz_class a = random_limbs(na), b = random_limbs(nb) + 1;
+            mpz_class expected, result;
+            for (const mpz_class &x : {a, mpz_class(-a)}) {
+                backend->mul(result.get_mpz_t(), x.get_mpz_t(),
+                        b.get_mpz_t());
+                ok &= check_result(result, x * b, backend, "product", na, nb);
+                backend->sqr(result.get_mpz_t(), x.get_mpz_t());
+                ok &= check_result(result, x * x, backend, "square", na, na);
+                mpz_mod(expected.get_mpz_t(), x.get_mpz_t(), b.get_mpz_t());
+                backend->mod(result.get_mpz_t(), x.get_mpz_t(),
+                        b.get_mpz_t());
+                ok &= check_result(result, expected, backend, "remainder", na,
+                        nb);
+                mpz_class product = x * b;
+                backend->divexact(result.get_mpz_t(), product.get_mpz_t(),
+                        b.get_mpz_t());
+                ok &= check_result(result, x, backend, "exact quotient",
+                        na + nb, nb);
+            }
+            // Common factor, as found by Part (C)
+            mpz_class g = random_limbs(nb / 2 + 1);
+            mpz_class x = a * g, y = b * g;
+            mpz_gcd(expected.get_mpz_t(), x.get_mpz_t(), y.get_mpz_t());
+            backend->gcd(result.get_mpz_t(), x.get_mpz_t(), y.get_mpz_t());
+            ok &= check_result(result, expected, backend, "gcd", na, nb);
+            // Results written over an operand, as the engines do
+            backend->gcd(x.get_mpz_t(), x.get_mpz_t(), y.get_mpz_t());
+            ok &= check_result(x, expected, backend, "aliased gcd", na, nb);
+            mpz_mod(expected.get_mpz_t(), a.get_mpz_t(), b.get_mpz_t());
+            backend->mod(a.get_mpz_t(), a.get_mpz_t(), b.get_mpz_t());
+            ok &= check_result(a, expected, backend, "aliased remainder", na,
+                    nb);
+        }
+    }
+    return ok;
+}
+
+static void bench(size_t max_bits) {
+    cout << "   bits\tmpz_mul (s)\tntt_mul (s)" << endl;
+    for (size_t bits = 1 << 20; bits <= max_bits; bits *= 2) {
+        mpz_class a = random_state.get_z_bits(bits);
+        mpz_class b = random_state.get_z_bits(bits), c;
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        mpz_mul(c.get_mpz_t(), a.get_mpz_t(), b.get_mpz_t());
+        double gmp = elapsed_since(start);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        ntt_mul(c.get_mpz_t(), a.get_mpz_t(), b.get_mpz_t());
+        cout << "   " << bits << "\t" << gmp << "\t" << elapsed_since(start);
+        cout << endl;
+    }
+}
+
+int main(int argc, char** argv) {
+    bool bench_flag = false;
+    size_t max_bits = 1 << 28;
+    static struct option long_options[] = {
+          {"threads", required_argument, 0, 't'},
+          {"bench", no_argument, 0, 'b'},
+          {"max-bits", required_argument, 0, 'm'},
+          {0, 0, 0, 0}
+        };
+    int option_index = 0;
+    int c;
+    while ((c = getopt_long_only(argc, argv, "", long_options,
+                    &option_index)) != -1) {
+        switch (c) {
+            case 't':
+                N_THREADS = std::max(1, atoi(optarg));
+                break;
+            case 'b':
+                bench_flag = true;
+                break;
+            case 'm':
+                max_bits = strtoull(optarg, NULL, 10);
+                break;
+            default:
+                exit(1);
+        }
+    }
+    bool ok = true;
+    // Every product goes through the NTT
+    NTT_MIN_BITS = 0;
+    for (string kernel : ntt_kernels()) {
+        NTT_KERNEL = kernel;
+        bool passed = check_kernel();
+        cout << "Kernel " << kernel << ": " << (passed ? "ok" : "FAILED");
+        cout << endl;
+        ok &= passed;
+    }
+    NTT_KERNEL = "auto";
+    for (string name : backend_names()) {
+        bool passed = check_backend_ops(find_backend(name));
+        cout << "Backend " << name << ": " << (passed ? "ok" : "FAILED");
+        cout << endl;
+        ok &= passed;
+    }
+    if (bench_flag) {
+        bench(max_bits);
+    }
+    cout << (ok ? "NTT check passed" : "NTT check FAILED") << endl;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,188 @@
+/* ------------------------------------------------------
+ * Scale test of the 64-bit counts and offsets
+ * ------------------------------------------------------
+ *
+ *  Builds the stored product tree of 'count' synthetic leaves, runs Parts (B)
+ *  and (C) with the chosen engine, and checks every result. The leaves are
+ *  distinct primes above 2^34 (found with a segmented sieve), so that a leaf
+ *  takes a single limb and a tree of billions of leaves stays affordable,
+ *  except at the planted positions, which are multiplied by the same large
+ *  prime Q:
+ *
+ *          3, 2^31 + 5, 2^32 + 7, count/2 and count-1    (those < count)
+ *
+ *  The final gcd must be Q exactly at these positions and 1 everywhere else.
+ *  The planted leaves are also read back one by one through the level index,
+ *  past the 32-bit positions.
+ *
+ *  The default count, 2^32 + 1024, goes beyond any 32-bit index. It needs
+ *  about 100 bytes of RAM and 50 bytes of disk per leaf (i.e. ~450 GB of RAM);
+ *  pass a smaller -count for a quick run of the same code paths.
+ *
+ *  Usage: ./scaletest [-count N] [-engine squares|cofactor|dfs]
+ *                     [-threads T] [-dir data/scaletest]
+ */
+
+#include <getopt.h>
+#include <cmath>
+#include <set>
+#include "../utils.hpp"
+#include "../remainders_dfs.hpp"
+
+using std::cout;
+using std::endl;
+using std::min;
+
+int N_THREADS = 1;
+
+static const uint64_t SIEVE_BASE = 1ULL << 34;
+static const uint64_t SEGMENT = 1ULL << 24;
+
+// small_primes_up_to returns the odd primes <= n.
+static vector<uint64_t> small_primes_up_to(uint64_t n) {
+    vector<bool> composite(n+1, false);
+    vector<uint64_t> primes;
+    for (uint64_t p = 3; p <= n; p += 2) {
+        if (composite[p]) continue;
+        primes.push_back(p);
+        for (uint64_t q = p*p; q <= n; q += 2*p) composite[q] = true;
+    }
+    return primes;
+}
+
+/* synthetic_leaves sets X to the first 'count' primes above SIEVE_BASE, in
+ * increasing order.
+ */
+static void synthetic_leaves(uint64_t count, vector<mpz_class> *X) {
+    // p_n < n (ln n + ln ln n) bounds the span of the primes needed
+    double span = (count + 1) * (log(SIEVE_BASE + 64.0*count) + 1) + SEGMENT;
+    uint64_t limit = sqrt(SIEVE_BASE + span) + 1;
+    vector<uint64_t> base = small_primes_up_to(limit);
+    X->clear();
+    X->reserve(count);
+    vector<char> composite(SEGMENT/2);
+    for (uint64_t low = SIEVE_BASE; X->size() < count; low += SEGMENT) {
+        // composite[k] stands for the odd number low + 2k + 1
+        std::fill(composite.begin(), composite.end(), 0);
+        for (uint64_t p : base) {
+            uint64_t first = (low + 1 + p - 1) / p * p;
+            if (first % 2 == 0) first += p;
+            for (uint64_t q = first; q < low + SEGMENT; q += 2*p) {
+                composite[(q - low - 1) / 2] = 1;
+            }
+        }
+        for (uint64_t k = 0; k < SEGMENT/2 && X->size() < count; k++) {
+            if (!composite[k]) {
+                X->push_back(mpz_class(static_cast<unsigned long>(
+                                low + 2*k + 1)));
+            }
+        }
+    }
+}
+
+int main(int argc, char** argv) {
+    uint64_t count = (1ULL << 32) + 1024;
+    string engine = "squares";
+    static struct option long_options[] = {
+          {"count", required_argument, 0, 'n'},
+          {"engine", required_argument, 0, 'e'},
+          {"threads", required_argument, 0, 't'},
+          {"dir", required_argument, 0, 'd'},
+          {0, 0, 0, 0}
+        };
+    int option_index = 0;
+    int c;
+    TREE_DIR = "data/scaletest";
+    while ((c = getopt_long_only(argc, argv, "", long_options,
+                    &option_index)) != -1) {
+        switch (c) {
+            case 'n':
+                count = strtoull(optarg, NULL, 10);
+                break;
+            case 'e':
+                engine = optarg;
+                break;
+            case 't':
+                N_THREADS = std::max(1, atoi(optarg));
+                break;
+            case 'd':
+                TREE_DIR = optarg;
+                break;
+            default:
+                exit(1);
+        }
+    }
+    if (count < 4 || (engine != "squares" && engine != "cofactor" &&
+                engine != "dfs")) {
+        cout << "Usage: ./scaletest [-count N >= 4] ";
+        cout << "[-engine squares|cofactor|dfs] [-threads T] [-dir D]" << endl;
+        exit(1);
+    }
+    boost::filesystem::remove_all(TREE_DIR);
+
+    std::set<uint64_t> planted;
+    for (uint64_t i : {uint64_t(3), (uint64_t(1) << 31) + 5,
+            (uint64_t(1) << 32) + 7, count/2, count-1}) {
+        if (i < count) planted.insert(i);
+    }
+    mpz_class Q = mpz_class(1) << 62;
+    mpz_nextprime(Q.get_mpz_t(), Q.get_mpz_t());
+
+    cout << "Sieving " << count << " leaves" << endl;
+    vector<mpz_class> X, R;
+    synthetic_leaves(count, &X);
+    for (uint64_t i : planted) X[i] *= Q;
+
+    struct timespec start, finish;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int levels = product_tree(&X);
+    cout << "Remainders (" << engine << ")" << endl;
+    if (engine == "dfs") {
+        remainders_gcds_dfs(levels, &R);
+    } else {
+        if (engine == "cofactor") {
+            remainders_cofactors(levels, &R);
+        } else {
+            remainders_squares(levels, &R);
+        }
+        read_level_from_file(0, &X);
+        if (engine == "cofactor") {
+            cofactor_gcds(&R, &X);
+        } else {
+            final_gcds(&R, &X);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+
+    bool ok = (R.size() == count);
+    uint64_t hits = 0;
+    for (uint64_t i = 0; ok && i < count; i++) {
+        bool expected = planted.count(i);
+        if ((expected && R[i] != Q) || (!expected && R[i] != 1)) {
+            cout << "Wrong gcd at leaf " << i << ": " << R[i].get_str(16);
+            cout << endl;
+            ok = false;
+        }
+        hits += (R[i] != 1);
+    }
+    vector<mpz_class>().swap(R);
+    vector<mpz_class>().swap(X);
+    // The leaves stay stored: read the planted ones through the level index
+    for (uint64_t i : planted) {
+        mpz_class leaf;
+        read_variable_from_file(0, i, &leaf);
+        if (leaf % Q != 0 || leaf == Q) {
+            cout << "Wrong leaf " << i << " read from " << index_filename(0);
+            cout << endl;
+            ok = false;
+        }
+    }
+    double elapsed = finish.tv_sec - start.tv_sec;
+    elapsed += (finish.tv_nsec - start.tv_nsec) / 1000000000.0;
+    cout << "Leaves: " << intsPerFloor[0] << ", levels: " << levels;
+    cout << ", shared factors found: " << hits << " of " << planted.size();
+    cout << ", time (s): " << elapsed << endl;
+    boost::filesystem::remove_all(TREE_DIR);
+    cout << (ok ? "Scale test passed" : "Scale test FAILED") << endl;
+    return ok ? 0 : 1;
+}
@@ -1,6 +1,7 @@
 #include "../utils.hpp"
 
 using std::cout;
+using std::endl;
 int N_THREADS = 1;
 
 void check_gmp_import_overflow() {
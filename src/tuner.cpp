@@ -0,0 +1,225 @@
+#include "tuner.hpp"
+#include "opstats.hpp"
+#include <unistd.h>
+#include <atomic>
+#include <climits>
+#include <fstream>
+
+using std::cout;
+using std::endl;
+using std::min;
+using std::to_string;
+
+/* Auto-tuner of the parallelism of each level
+ *
+ * The bottom levels hold many small operations and want one per core, the
+ * middle levels may run faster with fewer threads competing for memory
+ * bandwidth, and the top levels hold fewer operations than cores, which are
+ * then split into parallel Karatsuba products (parallel_mul).
+ *
+ * Levels are bucketed by operation and log2 of the operand size. The first
+ * time a bucket is met, the first operations of the level are run with
+ * N_THREADS, N_THREADS/2, ..., 1 threads in turn, and the amount with the best
+ * throughput is used for the rest of the level and stored in the per-host
+ * profile, so that later runs skip the measurement. The operand size above
+ * which operations are split is measured by 'batchgcd tune' (calibrate_split)
+ * and stored in the profile as well.
+ */
+bool AUTO_TUNE = false;
+string PROFILE_FILE = "";
+size_t SPLIT_MIN_BITS = 1 << 20;
+string THREADS_FILE = "";
+
+// Operations are only split into Karatsuba products above this size.
+static const size_t KARATSUBA_MIN_LIMBS = 64;
+
+// default_profile_file returns data/profile_<hostname>.txt.
+string default_profile_file() {
+    char host[256] = "";
+    gethostname(host, sizeof(host)-1);
+    return "data/profile_" + string(host) + ".txt";
+}
+
+// profile_file returns PROFILE_FILE, or the default profile of the host.
+string profile_file() {
+    return PROFILE_FILE != "" ? PROFILE_FILE : default_profile_file();
+}
+
+void write_profile(const std::map<string, string> &profile) {
+    boost::filesystem::path path(profile_file());
+    if (path.has_parent_path()) {
+        boost::filesystem::create_directories(path.parent_path());
+    }
+    write_key_value_file(profile_file(), profile);
+}
+
+static double elapsed_since(const struct timespec &start) {
+    struct timespec finish;
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+    return finish.tv_sec - start.tv_sec +
+        (finish.tv_nsec - start.tv_nsec) / 1000000000.0;
+}
+
+/* parallel_mul sets rop <- a * b, with 'depth' levels of Karatsuba splitting
+ * whose 3 half-size products are computed concurrently, i.e. on up to 3^depth
+ * threads. a and b must be non-negative.
+ */
+void parallel_mul(mpz_ptr rop, mpz_srcptr a, mpz_srcptr b, int depth) {
+    size_t n = std::max(mpz_size(a), mpz_size(b));
+    if (depth <= 0 || n < 2*KARATSUBA_MIN_LIMBS) {
+        if (a == b) {
+            op_sqr(rop, a);
+        } else {
+            op_mul(rop, a, b);
+        }
+        return;
+    }
+    mp_bitcnt_t half = (n/2) * GMP_NUMB_BITS;
+    mpz_class a0, a1, b0, b1, z0, z1, z2;
+    mpz_fdiv_q_2exp(a1.get_mpz_t(), a, half);
+    mpz_fdiv_r_2exp(a0.get_mpz_t(), a, half);
+    mpz_fdiv_q_2exp(b1.get_mpz_t(), b, half);
+    mpz_fdiv_r_2exp(b0.get_mpz_t(), b, half);
+    boost::thread low([&]() {
+            parallel_mul(z0.get_mpz_t(), a0.get_mpz_t(), b0.get_mpz_t(),
+                    depth-1);
+            });
+    boost::thread high([&]() {
+            parallel_mul(z2.get_mpz_t(), a1.get_mpz_t(), b1.get_mpz_t(),
+                    depth-1);
+            });
+    mpz_class sum_a = a0 + a1, sum_b = b0 + b1;
+    parallel_mul(z1.get_mpz_t(), sum_a.get_mpz_t(), sum_b.get_mpz_t(),
+            depth-1);
+    low.join();
+    high.join();
+    // z1 <- (a0+a1)(b0+b1) - a0b0 - a1b1 = a0b1 + a1b0
+    z1 -= z0;
+    z1 -= z2;
+    mpz_mul_2exp(z2.get_mpz_t(), z2.get_mpz_t(), 2*half);
+    mpz_mul_2exp(z1.get_mpz_t(), z1.get_mpz_t(), half);
+    z0 += z1;
+    mpz_add(rop, z0.get_mpz_t(), z2.get_mpz_t());
+}
+
+/* run_plan performs at most 'limit' operations with the given plan, and
+ * returns how many were performed.
+ */
+static size_t run_plan(level_plan plan, size_t limit, const tuned_step &step) {
+    std::atomic<size_t> started(0), done(0);
+    vector<boost::thread> threads;
+    for (int j = 0; j < plan.threads; j++) {
+        threads.push_back(boost::thread([&]() {
+                    while (started++ < limit && step(plan.depth)) done++;
+                    }));
+    }
+    for (auto& th : threads)
+        th.join();
+    return done;
+}
+
+/* update_threads sets N_THREADS to the quota in THREADS_FILE, if any. A
+ * scheduler (see batchgcd_sched) rewrites the file to shrink or grow the
+ * threads of a running job: the quota is read again before each level.
+ */
+void update_threads() {
+    if (THREADS_FILE == "") return;
+    std::ifstream file(THREADS_FILE);
+    int threads;
+    if (!(file >> threads) || threads < 1 || threads == N_THREADS) return;
+    cout << "     Thread quota changed from " << N_THREADS << " to ";
+    cout << threads << endl;
+    N_THREADS = threads;
+}
+
+/* run_tuned performs all the 'count' operations of a level, of operands of
+ * about 'bits' bits, by calling 'step' from the threads of the tuned plan,
+ * which it returns. 'op' names the kind of operation in the profile. Unless
+ * AUTO_TUNE is set, the plan is N_THREADS threads without splitting.
+ */
+level_plan run_tuned(string op, size_t count, size_t bits, tuned_step step) {
+    update_threads();
+    level_plan plan = {static_cast<int>(min<size_t>(N_THREADS, count)), 0};
+    if (!AUTO_TUNE) {
+        run_plan(plan, SIZE_MAX, step);
+        return plan;
+    }
+    std::map<string, string> profile = read_key_value_file(profile_file());
+    if (profile.count("split_min_bits")) {
+        SPLIT_MIN_BITS = std::stoull(profile["split_min_bits"]);
+    }
+    // Fewer operations than threads: split them
+    int parallel = plan.threads * 3;
+    while (bits >= SPLIT_MIN_BITS && parallel <= N_THREADS) {
+        plan.depth++;
+        parallel *= 3;
+    }
+    int bucket = 0;
+    while ((2ULL << bucket) <= bits) bucket++;
+    string key = op + "_" + to_string(bucket);
+    if (profile.count(key)) {
+        plan.threads = min(std::stoi(profile[key]), plan.threads);
+    } else if (plan.depth == 0) {
+        vector<int> candidates;
+        int total = 0;
+        for (int t = N_THREADS; t >= 1; t /= 2) {
+            candidates.push_back(t);
+            total += t;
+        }
+        // Measure on at most a quarter of the level
+        size_t per_thread = min<size_t>(16, count / (4*total));
+        if (per_thread > 0) {
+            double best = 0;
+            for (int t : candidates) {
+                struct timespec start;
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                size_t done = run_plan({t, 0}, t*per_thread, step);
+                double rate = done / elapsed_since(start);
+                if (rate > best) {
+                    best = rate;
+                    plan.threads = t;
+                }
+            }
+            cout << "     Tuned " << key << ": " << plan.threads;
+            cout << " threads" << endl;
+            profile[key] = to_string(plan.threads);
+            write_profile(profile);
+        }
+    }
+    run_plan(plan, SIZE_MAX, step);
+    return plan;
+}
+
+/* calibrate_split measures, for operands of 2^14 to 2^26 bits, whether
+ * splitting a product over 3 threads beats a single mpz_mul, and stores the
+ * smallest size where it does in the profile as 'split_min_bits'.
+ */
+void calibrate_split() {
+    gmp_randclass random(gmp_randinit_default);
+    size_t threshold = 0;
+    cout << "   bits        mpz_mul (s)   parallel_mul (s)" << endl;
+    for (size_t bits = 1 << 14; bits <= (1 << 26); bits *= 2) {
+        mpz_class a = random.get_z_bits(bits), b = random.get_z_bits(bits);
+        mpz_class c;
+        double times[2];
+        for (int depth = 0; depth < 2; depth++) {
+            // Repeat small products to get measurable times
+            int repeats = std::max<size_t>(1, (1 << 22) / bits);
+            struct timespec start;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            for (int k = 0; k < repeats; k++) {
+                parallel_mul(c.get_mpz_t(), a.get_mpz_t(), b.get_mpz_t(),
+                        depth);
+            }
+            times[depth] = elapsed_since(start) / repeats;
+        }
+        cout << "   " << bits << "\t" << times[0] << "\t" << times[1] << endl;
+        if (threshold == 0 && times[1] < 0.8 * times[0]) threshold = bits;
+    }
+    if (threshold == 0) threshold = SIZE_MAX;
+    std::map<string, string> profile = read_key_value_file(profile_file());
+    profile["split_min_bits"] = to_string(threshold);
+    write_profile(profile);
+    cout << "Splitting products of at least " << threshold << " bits, ";
+    cout << "stored in " << profile_file() << endl;
+}
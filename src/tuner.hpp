@@ -0,0 +1,34 @@
+#ifndef SRC_TUNER_HPP_
+#define SRC_TUNER_HPP_
+
+#include <functional>
+#include "utils.hpp"
+
+// Per-level tuning of the parallelism, disabled unless AUTO_TUNE is set.
+extern bool AUTO_TUNE;
+extern string PROFILE_FILE;
+extern size_t SPLIT_MIN_BITS;
+// Thread quota renegotiated while running, empty unless given -threads-file.
+extern string THREADS_FILE;
+
+/* A level_plan is how the operations of a level are run: 'threads' of them
+ * at once, each split into 3^depth Karatsuba products computed in parallel.
+ */
+struct level_plan {
+    int threads;
+    int depth;
+};
+
+// A tuned_step performs one operation with the given depth, or returns false
+// if there is none left.
+typedef std::function<bool(int depth)> tuned_step;
+
+string default_profile_file();
+string profile_file();
+void write_profile(const std::map<string, string> &);
+void update_threads();
+void parallel_mul(mpz_ptr, mpz_srcptr, mpz_srcptr, int);
+level_plan run_tuned(string, size_t, size_t, tuned_step);
+void calibrate_split();
+
+#endif /* SRC_TUNER_HPP_ */
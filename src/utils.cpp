@@ -1,5 +1,18 @@
 #include "utils.hpp"
 #include <algorithm>
+#include "subtree_cache.hpp"
+#include "fingerprint.hpp"
+#include "tuner.hpp"
+#include "probes.hpp"
+#include "opstats.hpp"
+#include "backend.hpp"
+#include "spill.hpp"
+#include "arrow_input.hpp"
+#include <atomic>
+#include <cstdint>
+#include <fcntl.h>
+#include <map>
+#include <sstream>
 
 using std::cout;
 using std::endl;
@@ -8,7 +21,236 @@ using std::to_string;
 
 // intsPerFloor keeps track of the amount of integers in each floor of the
 // tree.
-vector<unsigned int> intsPerFloor;
+vector<uint64_t> intsPerFloor;
+
+// TREE_DIR is the directory holding the product tree (manifest, indexes and,
+// unless striped, the level files).
+string TREE_DIR = "data/product_tree";
+
+// STORAGE_DIRS are the directories (ideally on different devices) across which
+// level files are striped. If empty, level files are stored in TREE_DIR.
+vector<string> STORAGE_DIRS;
+
+// KEEP_LEVELS disables the deletion of the levels consumed by Part (B).
+bool KEEP_LEVELS = false;
+
+// LEVEL_STRIDE is the distance between the stored levels of the product tree.
+// Only levels multiple of it (and the root) are written, the others are
+// regenerated by Part (B) when it needs them (see ensure_level).
+unsigned int LEVEL_STRIDE = 1;
+
+// DISK_BUDGET, in bytes, is the disk space the product tree may use. If set,
+// product_tree chooses LEVEL_STRIDE to fit in it. 0 means unlimited.
+uint64_t DISK_BUDGET = 0;
+
+// level_stripes returns the amount of files each level is split into.
+unsigned int level_stripes() {
+    return std::max<size_t>(1, STORAGE_DIRS.size());
+}
+
+/* stripe_begin returns the position of the first integer of stripe 's' of a
+ * level of 'count' integers. Stripes are contiguous and of equal length (up
+ * to one).
+ */
+size_t stripe_begin(size_t count, unsigned int s) {
+    return static_cast<unsigned __int128>(count) * s / level_stripes();
+}
+
+// stripe_of returns the stripe of the integer at position 'i' of level 'l'.
+unsigned int stripe_of(int l, size_t i) {
+    unsigned int s = static_cast<unsigned __int128>(i) * level_stripes() /
+        intsPerFloor[l];
+    while (s+1 < level_stripes() && stripe_begin(intsPerFloor[l], s+1) <= i) s++;
+    while (s > 0 && stripe_begin(intsPerFloor[l], s) > i) s--;
+    return s;
+}
+
+// stripe_dir returns the directory holding stripe 's' of the level files.
+string stripe_dir(unsigned int s) {
+    if (STORAGE_DIRS.empty()) {
+        return TREE_DIR;
+    }
+    return STORAGE_DIRS[s] + "/" + TREE_DIR;
+}
+
+/* level_filename returns the path of the file storing stripe 's' of level 'l'
+ * of the tree (the whole level, if levels are not striped).
+ */
+string level_filename(int l, unsigned int s) {
+    return stripe_dir(s) + "/level" + to_string(l) + ".gmp";
+}
+
+/* index_filename returns the path of the index of level 'l': the byte offset
+ * of each integer in its stripe file, as native 64-bit integers.
+ */
+string index_filename(int l) {
+    return TREE_DIR + "/level" + to_string(l) + ".idx";
+}
+
+// delete_level removes the files of level 'l', once they are not needed.
+void delete_level(int l) {
+    for (unsigned int s = 0; s < level_stripes(); s++) {
+        remove(level_filename(l, s).c_str());
+    }
+    remove(index_filename(l).c_str());
+}
+
+// tree_levels returns the amount of levels of the product tree of n integers.
+int tree_levels(size_t n) {
+    int levels = 1;
+    while ((1ULL << (levels-1)) < n) levels++;
+    return levels;
+}
+
+// level_stored tells if level 'l' of a tree of 'levels' levels is written.
+bool level_stored(int l, int levels) {
+    return l % LEVEL_STRIDE == 0 || l == levels-1;
+}
+
+/* peak_levels returns the largest amount of levels on disk at once, in units
+ * of the size of the leaves: the stored levels, plus the LEVEL_STRIDE-1
+ * levels that Part (B) regenerates together.
+ */
+static uint64_t peak_levels(int levels) {
+    uint64_t stored = 0;
+    for (int l = 0; l < levels; l++) {
+        if (level_stored(l, levels)) stored++;
+    }
+    return stored + LEVEL_STRIDE-1;
+}
+
+// level_bytes estimates the size on disk of a level of the tree of X.
+static uint64_t level_bytes(vector<mpz_class> *X) {
+    uint64_t bytes = 0;
+    for (size_t i = 0; i < X->size(); i++) {
+        // 8 bytes for the size, and 8 in the index
+        bytes += mpz_sizeinbase((*X)[i].get_mpz_t(), 256) + 16;
+    }
+    return bytes;
+}
+
+/* choose_level_stride sets LEVEL_STRIDE to the smallest stride for which the
+ * product tree of X fits in DISK_BUDGET, i.e. the one that saves the most
+ * recomputation. If none does, the stride using the least disk is chosen.
+ */
+void choose_level_stride(vector<mpz_class> *X) {
+    LEVEL_STRIDE = 1;
+    if (DISK_BUDGET == 0) return;
+    uint64_t bytes = level_bytes(X);
+    int levels = tree_levels(X->size());
+    unsigned int best = 1;
+    uint64_t least = peak_levels(levels);
+    for (int stride = 1; stride <= levels; stride++) {
+        LEVEL_STRIDE = stride;
+        if (bytes * peak_levels(levels) <= DISK_BUDGET) {
+            best = stride;
+            least = peak_levels(levels);
+            break;
+        }
+        if (peak_levels(levels) < least) {
+            best = stride;
+            least = peak_levels(levels);
+        }
+    }
+    LEVEL_STRIDE = best;
+    if (bytes * least > DISK_BUDGET) {
+        cout << "   Warning: the product tree needs at least ";
+        cout << ((bytes * least) >> 20) << " MB of disk" << endl;
+    }
+    cout << "   Storing one level out of " << LEVEL_STRIDE << endl;
+}
+
+/* check_free_space verifies, before computing the product tree of X, that
+ * each storage directory has room for its stripes of all stored levels. Each
+ * level is about the size of the leaves, and there are ~log2(n) levels.
+ */
+void check_free_space(vector<mpz_class> *X) {
+    uint64_t needed = level_bytes(X) * peak_levels(tree_levels(X->size()))
+        / level_stripes();
+    for (unsigned int s = 0; s < level_stripes(); s++) {
+        boost::filesystem::create_directories(stripe_dir(s));
+        uint64_t available = boost::filesystem::space(stripe_dir(s)).available;
+        if (available < needed) {
+            cout << "Fatal error: " << stripe_dir(s) << " needs about ";
+            cout << (needed >> 20) << " MB, but only " << (available >> 20);
+            cout << " MB are available" << endl;
+            throw std::exception();
+        }
+    }
+}
+
+level_stream::level_stream(int l) : level(l), stripe(0), pos(0), file(NULL) {
+    end = stripe_begin(intsPerFloor[l], 1);
+    open();
+}
+
+level_stream::~level_stream() {
+    if (file) fclose(file);
+}
+
+void level_stream::open() {
+    file = fopen(level_filename(level, stripe).c_str(), "rb");
+    if (!file) {
+        cout << "Fatal error: missing " << level_filename(level, stripe);
+        cout << endl;
+        throw std::exception();
+    }
+    // Levels are read front to back: ask the kernel for aggressive readahead
+    posix_fadvise(fileno(file), 0, 0, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(fileno(file), 0, 0, POSIX_FADV_WILLNEED);
+}
+
+// next reads the next integer of the level, moving to the next stripe if needed.
+void level_stream::next(mpz_ptr x) {
+    while (pos == end) {
+        fclose(file);
+        stripe++;
+        end = stripe_begin(intsPerFloor[level], stripe+1);
+        open();
+    }
+    read_raw(x, file);
+    pos++;
+}
+
+level_prefetcher::level_prefetcher(int l, unsigned int group,
+        size_t capacity) : stream(l), group(group), capacity(capacity),
+        done(false) {
+    reader = boost::thread([this]() { read(); });
+}
+
+level_prefetcher::~level_prefetcher() {
+    reader.join();
+}
+
+void level_prefetcher::read() {
+    size_t count = intsPerFloor[stream.level];
+    PROBE2(level_read_start, stream.level, count);
+    for (size_t first = 0; first < count; first += group) {
+        vector<mpz_class> values(min<size_t>(group, count - first));
+        for (unsigned int k = 0; k < values.size(); k++) {
+            stream.next(values[k].get_mpz_t());
+        }
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (queue.size() >= capacity) not_full.wait(lock);
+        queue.emplace_back(first, std::move(values));
+        not_empty.notify_one();
+    }
+    PROBE1(level_read_end, stream.level);
+    boost::unique_lock<boost::mutex> lock(mutex);
+    done = true;
+    not_empty.notify_all();
+}
+
+bool level_prefetcher::next(size_t *first, vector<mpz_class> *values) {
+    boost::unique_lock<boost::mutex> lock(mutex);
+    while (queue.empty() && !done) not_empty.wait(lock);
+    if (queue.empty()) return false;
+    *first = queue.front().first;
+    values->swap(queue.front().second);
+    queue.pop_front();
+    not_full.notify_one();
+    return true;
+}
 
 /* read_moduli_from_csv allocates and initializes the moduli referenced by
  * input_moduli, from the given file.
@@ -18,9 +260,36 @@ void read_moduli_from_csv(
         vector<mpz_class> *moduli,
         vector<string>*IDs,
         int base = 16) {
+    read_moduli_range_from_csv(filename, moduli, IDs, base, 0, SIZE_MAX);
+}
+
+/* read_moduli_range_from_csv is read_moduli_from_csv restricted to the
+ * records with index in [first, last). This allows a process to load only its
+ * shard of the input: the records before 'first' are parsed but not stored,
+ * unless 'offset' gives the position of record 'first' in the file (see
+ * csv_record_offsets), and parsing stops at 'last'.
+ * Arrow files are recognized by their first bytes (see arrow_input.cpp).
+ */
+void read_moduli_range_from_csv(
+        string filename,
+        vector<mpz_class> *moduli,
+        vector<string>*IDs,
+        int base,
+        size_t first,
+        size_t last,
+        int64_t offset) {
+    if (is_arrow_file(filename)) {
+        read_moduli_range_from_arrow(filename, moduli, IDs, first, last);
+        return;
+    }
     cout << "Reading moduli from " << filename << endl;
     FILE* file = fopen(filename.c_str(), "rb");
     assert(file);
+    size_t index = 0;
+    if (offset >= 0) {
+        fseeko(file, offset, SEEK_SET);
+        index = first;
+    }
     // Set base 10 or 16 (default)
     string format;
     switch (base) {
@@ -35,7 +304,7 @@ void read_moduli_from_csv(
     int read_fields = 0;
     bool zero = false;
     cout << "Reading moduli from file.csv (using base " << base <<  ")" << endl;
-    while (true) {
+    while (index < last) {
         char id[32];
         read_fields = gmp_fscanf(file, format.c_str(), id, n);
         if (mpz_cmp_ui(n, 0) == 0) {
@@ -49,8 +318,11 @@ void read_moduli_from_csv(
             cout << "ERROR: Cannot process moduli file" << endl;
             throw std::exception();
         }
-        IDs->push_back(id);
-        moduli->push_back(mpz_class(n));
+        if (index >= first && index < last) {
+            IDs->push_back(id);
+            moduli->push_back(mpz_class(n));
+        }
+        index++;
     }
     if (zero) {
         cout << "ERROR: Cannot process moduli file" << endl;
@@ -61,22 +333,87 @@ void read_moduli_from_csv(
     cout << "Done. Read " << moduli->size() << " moduli" << endl;
 }
 
+// count_moduli_in_csv returns the amount of records (lines) of the given file.
+size_t count_moduli_in_csv(string filename) {
+    if (is_arrow_file(filename)) return count_moduli_in_arrow(filename);
+    FILE* file = fopen(filename.c_str(), "rb");
+    assert(file);
+    size_t count = 0;
+    int c, previous = '\n';
+    while ((c = getc(file)) != EOF) {
+        if (c == '\n') count++;
+        previous = c;
+    }
+    // Last record without trailing newline
+    if (previous != '\n') count++;
+    fclose(file);
+    return count;
+}
+
+/* csv_record_offsets returns the position in the file of each of the given
+ * records, in increasing order; records past the end are at the end of the
+ * file.
+ */
+vector<int64_t> csv_record_offsets(string filename,
+        const vector<size_t> &records) {
+    FILE* file = fopen(filename.c_str(), "rb");
+    assert(file);
+    vector<int64_t> offsets;
+    size_t record = 0;
+    int64_t position = 0;
+    int c;
+    while (offsets.size() < records.size()) {
+        while (offsets.size() < records.size() &&
+                records[offsets.size()] == record) {
+            offsets.push_back(position);
+        }
+        if (offsets.size() == records.size()) break;
+        // Skip to the next record
+        while ((c = getc(file)) != EOF) {
+            position++;
+            if (c == '\n') break;
+        }
+        if (c == EOF) {
+            offsets.resize(records.size(), position);
+            break;
+        }
+        record++;
+    }
+    fclose(file);
+    return offsets;
+}
+
 /* product_tree computes the product tree of the input moduli; the leaves
  * contain the input moduli and the root contains their product.
  * Each level is computed and written to disk in a separate folder.
  * This function returns the amount of levels contained in the tree.
  *
+ * If 'write_leaves' is false, level 0 is assumed to be stored already.
+ *
  * Warning: Input IS DESTROYED, in order to use the occupied RAM if necessary.
  */
-int product_tree(vector<mpz_class> *X) {
+int product_tree(vector<mpz_class> *X, bool write_leaves) {
     cout << "Computing product tree of " << X->size() << " moduli." << endl;
     vector<mpz_class> current_level, new_level;
     mpz_class *prod = new(mpz_class);
     int l = 0;
+    intsPerFloor.clear();
     current_level = *X;
+    int levels = tree_levels(X->size());
+    choose_level_stride(X);
+    check_free_space(X);
+    // Hashes of the current level, only if the subtree cache is enabled
+    vector<subtree_hash> hashes, new_hashes;
+    bool cached = CACHE_DIR != "";
+    if (cached) {
+        boost::filesystem::create_directories(CACHE_DIR);
+        leaf_hashes(&current_level, &hashes);
+    }
     while (current_level.size() > 1) {
         intsPerFloor.push_back(current_level.size());
-        write_level_to_file(l, &current_level);
+        if ((l > 0 || write_leaves) && level_stored(l, levels)) {
+            write_level_to_file(l, &current_level);
+        }
 
         // Free new level
         vector<mpz_class>().swap(new_level);
@@ -85,12 +422,21 @@ int product_tree(vector<mpz_class> *X) {
         cout << "   Multiplying " << current_level.size() << " ints of ";
         cout << mpz_sizeinbase(current_level[0].get_mpz_t(), 2) << " bits ";
         cout << endl;
-        mt_level_mult(&current_level, &new_level);
+        PROBE3(level_start, "mult", l, current_level.size());
+        if (cached) {
+            cached_level_mult(&current_level, &new_level, &hashes,
+                    &new_hashes);
+        } else {
+            mt_level_mult(&current_level, &new_level);
+        }
+        PROBE2(level_end, "mult", l);
 
         // Append orphan node
         if (current_level.size()%2 != 0) {
             new_level.push_back(current_level.back());
+            if (cached) new_hashes.push_back(hashes.back());
         }
+        hashes.swap(new_hashes);
 
         current_level = new_level;
         if (l == 0) {
@@ -103,7 +449,13 @@ int product_tree(vector<mpz_class> *X) {
 
     // Last floor
     intsPerFloor.push_back(current_level.size());
-    write_level_to_file(l, &current_level);
+    if (l > 0 || write_leaves) {
+        write_level_to_file(l, &current_level);
+    }
+    write_tree_manifest();
+    if (cached) {
+        evict_cache();
+    }
 
     vector<mpz_class>().swap(current_level);
     vector<mpz_class>().swap(new_level);
@@ -116,22 +468,68 @@ int product_tree(vector<mpz_class> *X) {
  */
 void mt_level_mult(vector<mpz_class> *_level, vector<mpz_class> *_next) {
     _next->resize(_level->size()/2);
-    vector<boost::thread> threads;
-    int n_threads = min(N_THREADS, static_cast<int>(_next->size()));
-    // Thread 'j' will handle all products in position eq. j mod n_threads.
-    for (int j = 0; j < n_threads; j++) {
-        threads.push_back(
-            boost::thread([j, _level, _next, n_threads]() mutable {
-                for (unsigned int i = j; i < _next->size(); i += n_threads) {
-                (*_next)[i] = (*_level)[2*i] * (*_level)[2*i+1];
-                }
-                string s = "     Thread " + to_string(j) + " finished.\n";
-                cout << s;
-                }));
+    std::atomic<size_t> next(0);
+    size_t bits = mpz_sizeinbase((*_level)[0].get_mpz_t(), 2);
+    level_plan plan = run_tuned("mult", _next->size(), bits,
+            [&next, _level, _next](int depth) {
+            size_t i = next++;
+            if (i >= _next->size()) return false;
+            PROBE3(task_start, "mult", i,
+                    mpz_sizeinbase((*_level)[2*i].get_mpz_t(), 2));
+            parallel_mul((*_next)[i].get_mpz_t(), (*_level)[2*i].get_mpz_t(),
+                    (*_level)[2*i+1].get_mpz_t(), depth);
+            PROBE2(task_end, "mult", i);
+            return true;
+            });
+    cout << "     " + to_string(plan.threads) + " threads finished.\n";
+}
+
+/* product_of sets P to the product of X, multiplying level by level and only
+ * keeping the current level (X is destroyed).
+ */
+void product_of(vector<mpz_class> *X, mpz_class *P) {
+    if (X->empty()) {
+        *P = 1;
+        return;
+    }
+    vector<mpz_class> next;
+    while (X->size() > 1) {
+        mt_level_mult(X, &next);
+        // Append orphan node
+        if (X->size() % 2 != 0) next.push_back(X->back());
+        X->swap(next);
+        vector<mpz_class>().swap(next);
+    }
+    mpz_swap(P->get_mpz_t(), (*X)[0].get_mpz_t());
+    vector<mpz_class>().swap(*X);
+}
+
+/* ensure_level regenerates level 'l' if it was skipped by product_tree, along
+ * with the skipped levels between it and the stored level below, which Part
+ * (B) needs next. They are written like any other level, so that they are
+ * deleted once consumed.
+ */
+void ensure_level(int l) {
+    int levels = static_cast<int>(intsPerFloor.size());
+    if (level_stored(l, levels) ||
+            boost::filesystem::exists(index_filename(l))) {
+        return;
+    }
+    int base = l - l % LEVEL_STRIDE;
+    cout << "   Regenerating levels " << base+1 << " to " << l;
+    cout << " from level " << base << endl;
+    vector<mpz_class> current_level, new_level;
+    read_level_from_file(base, &current_level);
+    for (int m = base+1; m <= l; m++) {
+        vector<mpz_class>().swap(new_level);
+        mt_level_mult(&current_level, &new_level);
+        // Append orphan node
+        if (current_level.size()%2 != 0) {
+            new_level.push_back(current_level.back());
+        }
+        current_level.swap(new_level);
+        write_level_to_file(m, &current_level);
     }
-    for (auto& th : threads)
-        th.join();
-    vector<boost::thread>().swap(threads);
 }
 
 /* remainders_squares computes the list remᵢ <- Z mod Xᵢ² where X are the
@@ -148,10 +546,10 @@ void remainders_squares_simple(int levels, vector<mpz_class> *R) {
     mpz_class Z = (*R)[0];
     read_level_from_file(0, R);
     cout << "   Computing partial remainders ";
-    for (unsigned int i = 0; i < R->size(); i++) {
+    for (size_t i = 0; i < R->size(); i++) {
         cout << i << endl;
-        (*R)[i] *= (*R)[i];
-        (*R)[i] = Z % (*R)[i];
+        op_sqr((*R)[i].get_mpz_t(), (*R)[i].get_mpz_t());
+        op_mod((*R)[i].get_mpz_t(), Z.get_mpz_t(), (*R)[i].get_mpz_t());
     }
 }
 
@@ -163,68 +561,223 @@ void remainders_squares_simple(int levels, vector<mpz_class> *R) {
  * in terms of memory.
  */
 void remainders_squares_fast(int levels, vector<mpz_class> *R) {
-    vector<mpz_class> newR;
     read_level_from_file(levels-1, R);
     // Sanity check
-    if (static_cast<int>(R->size()) != 1) {
+    if (R->size() != 1) {
         cout << "Fatal error: Incomplete product tree" << endl;
         throw std::exception();
     }
-    for (int l = levels-2; l >= 0; l--) {
+    if (!KEEP_LEVELS && levels > 1) {
+        delete_level(levels-1);
+    }
+    remainders_squares_from_level(levels-1, R);
+}
+
+// operand_bits returns the size of the first remainder of R.
+static size_t operand_bits(vector<mpz_class> *R, spill_chunks *R_chunks) {
+    R_chunks->acquire(R, 0);
+    size_t bits = mpz_sizeinbase((*R)[0].get_mpz_t(), 2);
+    R_chunks->release(R, 0, 0);
+    return bits;
+}
+
+/* reload_spilled reads back the remainders of the leaves moved to disk, for
+ * Part (C), and reports how many chunks were spilled on the way.
+ */
+static void reload_spilled(vector<mpz_class> *R, spill_chunks *R_chunks,
+        spill_chunks *new_chunks) {
+    size_t spilled = R_chunks->spilled_chunks() + new_chunks->spilled_chunks();
+    if (spilled) {
+        cout << "   Memory pressure: " << spilled << " chunks of ";
+        cout << "remainders were moved to disk" << endl;
+    }
+    R_chunks->load_all(R);
+}
+
+/* remainders_squares_from_level descends the stored product tree from level
+ * 'top', where R holds the remainders of the nodes of that level, down to the
+ * leaves. The root is its own remainder, i.e. R = {Z} for the top level.
+ * Unless KEEP_LEVELS is set, each level above the leaves is deleted as soon
+ * as it has been consumed.
+ */
+void remainders_squares_from_level(int top, vector<mpz_class> *R) {
+    vector<mpz_class> newR;
+    spill_chunks R_chunks, new_chunks;
+    R_chunks.reset(R->size(), top > 0 ? intsPerFloor[top-1] : 0);
+    for (int l = top-1; l >= 0; l--) {
         vector<mpz_class>().swap(newR);
         cout << "   Computing partial remainders ";
-        cout << levels-2-l << " of " << levels-2 << endl;
-        partial_remainders(l, R, &newR);
-        *R = newR;
+        cout << top-1-l << " of " << top-1 << endl;
+        partial_remainders(l, R, &newR, &R_chunks, &new_chunks);
+        R->swap(newR);
+        R_chunks.swap(new_chunks);
+        // Level 0 is kept for Part (C)
+        if (!KEEP_LEVELS && l > 0) {
+            delete_level(l);
+        }
     }
     // Free used memory
     vector<mpz_class>().swap(newR);
+    reload_spilled(R, &R_chunks, &new_chunks);
+}
+
+/* remainders_cofactors is the cofactor formulation of the remainder tree.
+ * Instead of carrying Z mod X² down the tree, it carries the cofactor of each
+ * node modulo the node itself:
+ *
+ *             C_root = 1,   C_child = C_parent * X_sibling mod X_child
+ *
+ * so that the leaves hold remᵢ <- (Z/Xᵢ) mod Xᵢ directly. Operands are half
+ * the size of those of remainders_squares, no node is squared, and Part (C)
+ * reduces to gcd(remᵢ, Xᵢ) (see cofactor_gcds).
+ */
+void remainders_cofactors(int levels, vector<mpz_class> *R) {
+    read_level_from_file(levels-1, R);
+    if (R->size() != 1) {
+        cout << "Fatal error: Incomplete product tree" << endl;
+        throw std::exception();
+    }
+    if (!KEEP_LEVELS && levels > 1) {
+        delete_level(levels-1);
+    }
+    (*R)[0] = 1;
+    vector<mpz_class> newR;
+    spill_chunks R_chunks, new_chunks;
+    R_chunks.reset(R->size(), levels > 1 ? intsPerFloor[levels-2] : 0);
+    for (int l = levels-2; l >= 0; l--) {
+        vector<mpz_class>().swap(newR);
+        cout << "   Computing partial cofactors ";
+        cout << levels-2-l << " of " << levels-2 << endl;
+        partial_cofactors(l, R, &newR, &R_chunks, &new_chunks);
+        R->swap(newR);
+        R_chunks.swap(new_chunks);
+        // Level 0 is kept for Part (C)
+        if (!KEEP_LEVELS && l > 0) {
+            delete_level(l);
+        }
+    }
+    vector<mpz_class>().swap(newR);
+    reload_spilled(R, &R_chunks, &new_chunks);
 }
 
-// multithread_partial_remaiders sets _new[k] = R[k/2] % (a square) for all k.
-void partial_remainders(int l, vector<mpz_class> *_R, vector<mpz_class> *_new) {
+/* partial_cofactors sets _new[k] = R[k/2] * (sibling of k) % (node k) for all
+ * nodes k of level l. An orphan node has no sibling: it is its own parent,
+ * and _new[k] = R[k/2] % (node k). Both levels are tracked by spill_chunks.
+ */
+void partial_cofactors(int l, vector<mpz_class> *_R, vector<mpz_class> *_new,
+        spill_chunks *R_chunks, spill_chunks *new_chunks) {
+    ensure_level(l);
     _new->resize(intsPerFloor[l]);
-    string dir = "data/product_tree/level";
-    string filename = dir + to_string(l) + ".gmp";
-    FILE* file = fopen(filename.c_str(), "r");
-    int pos = 0;
-    int n_threads = min(N_THREADS, static_cast<int>(_new->size()));
-    vector<boost::thread> threads;
-    for (unsigned int i = 0; i < _new->size(); i += n_threads) {
-        vector<boost::thread>().swap(threads);
-        for (int j = 0; j < n_threads; j++) {
-            pos = i + j;
-            if (i+j >= _new->size()) {
-                break;
+    new_chunks->reset(_new->size(), l > 0 ? intsPerFloor[l-1] : 0);
+    PROBE3(level_start, "cofactor", l, _new->size());
+    // Each operation handles a pair of siblings
+    level_prefetcher prefetcher(l, 2, 2*N_THREADS);
+    size_t bits = operand_bits(_R, R_chunks);
+    level_plan plan = run_tuned("cofactor", (_new->size() + 1) / 2, bits,
+            [_R, _new, R_chunks, new_chunks, &prefetcher](int depth) {
+            size_t pos;
+            vector<mpz_class> nodes;
+            if (!prefetcher.next(&pos, &nodes)) return false;
+            PROBE3(task_start, "cofactor", pos,
+                    mpz_sizeinbase(nodes[0].get_mpz_t(), 2));
+            R_chunks->acquire(_R, pos/2);
+            const mpz_class &parent = _R->at(pos/2);
+            if (nodes.size() == 1) {
+                op_mod(_new->at(pos).get_mpz_t(), parent.get_mpz_t(),
+                        nodes[0].get_mpz_t());
+            } else {
+                mpz_class product;
+                parallel_mul(product.get_mpz_t(), parent.get_mpz_t(),
+                        nodes[1].get_mpz_t(), depth);
+                op_mod(_new->at(pos).get_mpz_t(), product.get_mpz_t(),
+                        nodes[0].get_mpz_t());
+                parallel_mul(product.get_mpz_t(), parent.get_mpz_t(),
+                        nodes[0].get_mpz_t(), depth);
+                op_mod(_new->at(pos+1).get_mpz_t(), product.get_mpz_t(),
+                        nodes[1].get_mpz_t());
             }
-            // Define operands for this thread
-            mpz_t value;
-            mpz_init(value);
-            mpz_inp_raw(value, file);
-            threads.push_back(boost::thread([value, _R, _new, pos]() mutable {
-                        mpz_mul(value, value, value);
-                        mpz_mod(value, (_R->at(pos/2)).get_mpz_t(), value);
-                        _new->at(pos) = mpz_class(value);
-                        mpz_clear(value);
-                        }));
-        }
-        for (unsigned int j = 0; j < threads.size(); j++) {
-            threads.at(j).join();
-        }
+            R_chunks->release(_R, pos/2, nodes.size());
+            new_chunks->produced(_new, pos, nodes.size());
+            if (memory_pressure()) R_chunks->spill_ahead(_R);
+            PROBE2(task_end, "cofactor", pos);
+            return true;
+            });
+    PROBE2(level_end, "cofactor", l);
+    cout << "     " + to_string(plan.threads) + " threads finished.\n";
+}
+
+/* remainders_mod computes the list remᵢ <- Z mod Xᵢ, where X are the leaves
+ * of the stored product tree and Z is any integer (e.g. the product of
+ * another tree). This is the plain remainder tree: unlike
+ * remainders_squares, nodes are not squared.
+ */
+void remainders_mod(int levels, const mpz_class &Z, vector<mpz_class> *R) {
+    read_level_from_file(levels-1, R);
+    if (R->size() != 1) {
+        cout << "Fatal error: Incomplete product tree" << endl;
+        throw std::exception();
     }
-    cout << "     " + to_string(n_threads) + " threads finished.\n";
-    fclose(file);
+    op_mod((*R)[0].get_mpz_t(), Z.get_mpz_t(), (*R)[0].get_mpz_t());
+    vector<mpz_class> newR;
+    spill_chunks R_chunks, new_chunks;
+    R_chunks.reset(R->size(), levels > 1 ? intsPerFloor[levels-2] : 0);
+    for (int l = levels-2; l >= 0; l--) {
+        vector<mpz_class>().swap(newR);
+        cout << "   Computing partial remainders ";
+        cout << levels-2-l << " of " << levels-2 << endl;
+        partial_remainders(l, R, &newR, &R_chunks, &new_chunks, false);
+        R->swap(newR);
+        R_chunks.swap(new_chunks);
+    }
+    vector<mpz_class>().swap(newR);
+    reload_spilled(R, &R_chunks, &new_chunks);
+}
+
+/* partial_remainders sets _new[k] = R[k/2] % (a square) for all k, or
+ * _new[k] = R[k/2] % (the node) if 'square' is false. The level is read by a
+ * level_prefetcher while the workers of the tuned plan (see run_tuned)
+ * consume it. Both levels are tracked by spill_chunks: R is freed as it is
+ * consumed, and either level may be moved to disk under memory pressure.
+ */
+void partial_remainders(int l, vector<mpz_class> *_R, vector<mpz_class> *_new,
+        spill_chunks *R_chunks, spill_chunks *new_chunks, bool square) {
+    ensure_level(l);
+    _new->resize(intsPerFloor[l]);
+    new_chunks->reset(_new->size(), l > 0 ? intsPerFloor[l-1] : 0);
+    const char *op = square ? "squares" : "mod";
+    PROBE3(level_start, op, l, _new->size());
+    level_prefetcher prefetcher(l, 1, 2*N_THREADS);
+    size_t bits = operand_bits(_R, R_chunks);
+    level_plan plan = run_tuned(op, _new->size(), bits,
+            [_R, _new, R_chunks, new_chunks, square, op,
+            &prefetcher](int depth) {
+            size_t pos;
+            vector<mpz_class> node;
+            if (!prefetcher.next(&pos, &node)) return false;
+            mpz_ptr value = node[0].get_mpz_t();
+            PROBE3(task_start, op, pos, mpz_sizeinbase(value, 2));
+            if (square) parallel_mul(value, value, value, depth);
+            R_chunks->acquire(_R, pos/2);
+            op_mod(value, (_R->at(pos/2)).get_mpz_t(), value);
+            R_chunks->release(_R, pos/2, 1);
+            _new->at(pos).swap(node[0]);
+            new_chunks->produced(_new, pos, 1);
+            if (memory_pressure()) R_chunks->spill_ahead(_R);
+            PROBE2(task_end, op, pos);
+            return true;
+            });
+    PROBE2(level_end, op, l);
+    cout << "     " + to_string(plan.threads) + " threads finished.\n";
 }
 
 void remainders_squares_fast_seq(int levels, vector<mpz_class> *R) {
     vector<mpz_class> newR;
     read_level_from_file(levels-1, R);
     // Sanity check
-    if (static_cast<int>(R->size()) != 1) {
+    if (R->size() != 1) {
         cout << "Fatal error: Incomplete product tree" << endl;
         throw std::exception();
     }
-    string dir = "data/product_tree/level";
     mpz_t _square;
     mpz_init(_square);
     mpz_class square;
@@ -232,14 +785,14 @@ void remainders_squares_fast_seq(int levels, vector<mpz_class> *R) {
         vector<mpz_class>().swap(newR);
         cout << "   Computing partial remainders ";
         cout << levels-2-l << " of " << levels-2 << endl;
-        unsigned int lengthY = intsPerFloor[l];
-        string filename = dir + to_string(l) + ".gmp";
-        FILE* file = fopen(filename.c_str(), "r");
-        for (unsigned int i = 0; i < lengthY; i++) {
-            mpz_inp_raw(_square, file);
-            square = mpz_class(_square);
-            square *= square;
-            square = (*R)[i/2] % square;
+        uint64_t lengthY = intsPerFloor[l];
+        ensure_level(l);
+        level_stream stream(l);
+        for (uint64_t i = 0; i < lengthY; i++) {
+            stream.next(_square);
+            op_sqr(square.get_mpz_t(), _square);
+            op_mod(square.get_mpz_t(), (*R)[i/2].get_mpz_t(),
+                    square.get_mpz_t());
             newR.push_back(square);
         }
         *R = newR;
@@ -251,16 +804,68 @@ void remainders_squares_fast_seq(int levels, vector<mpz_class> *R) {
 
 /*
  * write_level_to_file takes an array of integers stored in the input address
- * and writes them to data/product_level/level<given index>.gmp.
+ * and writes them to <TREE_DIR>/level<given index>.gmp.
  */
 void write_level_to_file(int l, vector<mpz_class> *X) {
-    string dir = "data/product_tree/level" + to_string(l) + ".gmp";
-    cout << "   Writing product tree level to " << dir << endl;
-    FILE* file = fopen(dir.c_str(), "wb");
+    unsigned int stripes = level_stripes();
+    cout << "   Writing product tree level to " << level_filename(l);
+    if (stripes > 1) cout << " (and " << stripes-1 << " more stripes)";
+    cout << endl;
+    PROBE2(level_write_start, l, X->size());
+    boost::filesystem::create_directories(TREE_DIR);
+    vector<uint64_t> offsets(X->size());
+    fingerprint primes = fingerprint_primes();
+    vector<fingerprint> products(stripes, fingerprint_one());
+    // One writer per stripe, so that stripes on different devices overlap.
+    vector<boost::thread> threads;
+    for (unsigned int s = 0; s < stripes; s++) {
+        threads.push_back(boost::thread([l, s, X, &offsets, &primes,
+                    &products]() {
+            boost::filesystem::create_directories(stripe_dir(s));
+            FILE* file = fopen(level_filename(l, s).c_str(), "wb");
+            assert(file);
+            for (size_t i = stripe_begin(X->size(), s);
+                    i < stripe_begin(X->size(), s+1); i++) {
+                offsets[i] = ftello(file);
+                write_raw(file, (*X)[i].get_mpz_t());
+                fingerprint_mul(primes, &products[s],
+                        fingerprint_of(primes, (*X)[i].get_mpz_t()));
+            }
+            fclose(file);
+            }));
+    }
+    for (auto& th : threads)
+        th.join();
+    for (unsigned int s = 1; s < stripes; s++) {
+        fingerprint_mul(primes, &products[0], products[s]);
+    }
+    store_tree_fingerprint(products[0]);
+    FILE* file = fopen(index_filename(l).c_str(), "wb");
     assert(file);
-    for (unsigned int i = 0; i < X->size(); i++) {
-        mpz_out_raw(file, (*X)[i].get_mpz_t());
+    fwrite(offsets.data(), sizeof(uint64_t), offsets.size(), file);
+    fclose(file);
+    PROBE1(level_write_end, l);
+}
+
+/* read_variable_from_file imports the integer at position 'index' of level
+ * 'level', seeking through the level index.
+ */
+void read_variable_from_file(int level, uint64_t index, mpz_class *x) {
+    FILE* idx = fopen(index_filename(level).c_str(), "rb");
+    assert(idx);
+    uint64_t offset;
+    fseeko(idx, static_cast<off_t>(index) * sizeof(uint64_t), SEEK_SET);
+    if (fread(&offset, sizeof(uint64_t), 1, idx) != 1) {
+        cout << "Fatal error: index " << index << " out of level " << level;
+        cout << endl;
+        throw std::exception();
     }
+    fclose(idx);
+    FILE* file = fopen(level_filename(level, stripe_of(level, index)).c_str(),
+            "rb");
+    assert(file);
+    fseeko(file, offset, SEEK_SET);
+    read_raw(x->get_mpz_t(), file);
     fclose(file);
 }
 
@@ -268,24 +873,321 @@ void write_level_to_file(int l, vector<mpz_class> *X) {
  * given vector with these values.
  */
 void read_level_from_file(int l, vector<mpz_class> *moduli) {
-    string dir = "data/product_tree/level" + to_string(l) + ".gmp";
-    cout << "   Reading product tree level from " << dir << endl;
-    // ifstream file(dir);
+    unsigned int stripes = level_stripes();
+    cout << "   Reading product tree level from " << level_filename(l);
+    if (stripes > 1) cout << " (and " << stripes-1 << " more stripes)";
+    cout << endl;
+    PROBE2(level_read_start, l, intsPerFloor[l]);
     vector<mpz_class>().swap(*moduli);
-    mpz_t mod;
-    mpz_init(mod);
-
-    FILE* file = fopen(dir.c_str(), "r");
-    for (unsigned int i = 0; i < intsPerFloor[l]; i++) {
-        mpz_inp_raw(mod, file);
-        moduli->push_back(mpz_class(mod));
+    moduli->resize(intsPerFloor[l]);
+    // One reader per stripe
+    vector<boost::thread> threads;
+    for (unsigned int s = 0; s < stripes; s++) {
+        threads.push_back(boost::thread([l, s, moduli]() {
+            FILE* file = fopen(level_filename(l, s).c_str(), "rb");
+            if (!file) {
+                cout << "Fatal error: missing " << level_filename(l, s) << endl;
+                exit(1);
+            }
+            for (size_t i = stripe_begin(moduli->size(), s);
+                    i < stripe_begin(moduli->size(), s+1); i++) {
+                read_raw((*moduli)[i].get_mpz_t(), file);
+            }
+            fclose(file);
+            }));
     }
-    fclose(file);
-    mpz_clear(mod);
+    for (auto& th : threads)
+        th.join();
+    PROBE1(level_read_end, l);
     cout << "   ok, read " << moduli->size() << " ints of ";
     cout << mpz_sizeinbase((*moduli)[0].get_mpz_t(), 2) << " bits" << endl;
 }
 
+/* product_tree_in_memory computes the whole product tree of X in RAM, with
+ * the same layout as product_tree: (*tree)[0] are the leaves, the last level
+ * holds the product, and orphan nodes are carried to the next level.
+ * Only meant for small trees, e.g. a handful of partial products.
+ */
+void product_tree_in_memory(vector<mpz_class> *X,
+        vector<vector<mpz_class>> *tree, bool multithread) {
+    tree->clear();
+    tree->push_back(*X);
+    while (tree->back().size() > 1) {
+        vector<mpz_class> next;
+        vector<mpz_class> &level = tree->back();
+        if (multithread) {
+            mt_level_mult(&level, &next);
+        } else {
+            for (size_t i = 0; i+1 < level.size(); i += 2) {
+                next.emplace_back();
+                op_mul(next.back().get_mpz_t(), level[i].get_mpz_t(),
+                        level[i+1].get_mpz_t());
+            }
+        }
+        if (level.size()%2 != 0) {
+            next.push_back(level.back());
+        }
+        tree->push_back(next);
+    }
+}
+
+/* remainders_in_memory computes remᵢ <- Z mod Xᵢ (or Z mod Xᵢ² if 'square')
+ * down a product tree built by product_tree_in_memory.
+ */
+void remainders_in_memory(vector<vector<mpz_class>> *tree, const mpz_class &Z,
+        vector<mpz_class> *R, bool square) {
+    // The root is reduced like any other node, with Z as its parent
+    vector<mpz_class> newR(1, Z);
+    mpz_class modulus;
+    for (int l = static_cast<int>(tree->size())-1; l >= 0; l--) {
+        vector<mpz_class> &level = (*tree)[l];
+        R->resize(level.size());
+        for (size_t i = 0; i < level.size(); i++) {
+            mpz_srcptr node = level[i].get_mpz_t();
+            if (square) {
+                op_sqr(modulus.get_mpz_t(), node);
+                node = modulus.get_mpz_t();
+            }
+            op_mod((*R)[i].get_mpz_t(), newR[i/2].get_mpz_t(), node);
+        }
+        newR.swap(*R);
+    }
+    R->swap(newR);
+}
+
+/* final_gcds is Part (C): it takes remᵢ = Z mod Xᵢ² and replaces it with
+ * gcd(remᵢ/Xᵢ, Xᵢ).
+ */
+void final_gcds(vector<mpz_class> *R, vector<mpz_class> *X) {
+    for (size_t i = 0; i < X->size(); i++) {
+        op_divexact((*R)[i].get_mpz_t(), (*R)[i].get_mpz_t(),
+                (*X)[i].get_mpz_t());
+        op_gcd((*R)[i].get_mpz_t(), (*R)[i].get_mpz_t(), (*X)[i].get_mpz_t());
+    }
+}
+
+/* cofactor_gcds is Part (C) for remainders_cofactors: it takes
+ * remᵢ = (Z/Xᵢ) mod Xᵢ and replaces it with gcd(remᵢ, Xᵢ). No division is
+ * needed.
+ */
+void cofactor_gcds(vector<mpz_class> *R, vector<mpz_class> *X) {
+    for (size_t i = 0; i < X->size(); i++) {
+        op_gcd((*R)[i].get_mpz_t(), (*R)[i].get_mpz_t(), (*X)[i].get_mpz_t());
+    }
+}
+
+/* classify_results sorts the IDs of the moduli with a nontrivial gcd into
+ * compromised and duplicates, and returns the amount of false positives.
+ * False positives should not exist, this is a sanity check for large input
+ * sets.
+ */
+size_t classify_results(vector<mpz_class> *R, vector<mpz_class> *X,
+        vector<string> *IDs, vector<string> *compromised,
+        vector<string> *duplicates) {
+    size_t false_positives = 0;
+    for (size_t i = 0; i < X->size(); i++) {
+        if ((*R)[i] != 1) {
+            if ((*R)[i] == 0 || (*X)[i] % (*R)[i] != 0) {
+                false_positives += 1;
+                PROBE2(classify, i, 3);
+            } else if ((*R)[i] == (*X)[i]) {
+                duplicates->push_back((*IDs)[i]);
+                PROBE2(classify, i, 2);
+            } else {
+                compromised->push_back((*IDs)[i]);
+                PROBE2(classify, i, 1);
+            }
+        } else {
+            PROBE2(classify, i, 0);
+        }
+    }
+    return false_positives;
+}
+
+/* report_results prints the summary of a run and writes the IDs to
+ * compromised<suffix>.csv and duplicates<suffix>.csv.
+ */
+void report_results(size_t n, vector<string> *compromised,
+        vector<string> *duplicates, size_t false_positives, string suffix) {
+    string compromised_file = "compromised" + suffix + ".csv";
+    string duplicates_file = "duplicates" + suffix + ".csv";
+    cout << "    ------------- " << endl;
+    cout << "   |-- Results --|" << endl;
+    cout << "    ------------- " << endl << endl;
+    cout << "Amount of target moduli:       " << n << endl;
+    cout << "Amount of duplicates:          " << duplicates->size() << endl;
+    cout << "Amount of compromised moduli:  " << compromised->size() << endl;
+    cout << "False positives:               " << false_positives << endl;
+    cout << "Writing compromised IDs to file..." << endl;
+    std::ofstream file;
+    file.open(compromised_file);
+    for (size_t i = 0; i < compromised->size(); i++) {
+        file << (*compromised)[i] << "\n";
+    }
+    file.close();
+    file.open(duplicates_file);
+    for (size_t i = 0; i < duplicates->size(); i++) {
+        file << (*duplicates)[i] << "\n";
+    }
+    file.close();
+    if (duplicates->size()) {
+        cout << "Note: filter duplicates directly from the input file ";
+        cout << "(i.e., ignoring the output file)" << endl;
+        cout << "and run again. They may contain compromised moduli. ";
+        cout << "If you already did this, then all\nintegers marked as ";
+        cout << "duplicate share factors (run naïve GCDs).";
+        cout << endl << endl;
+    }
+    cout << endl << "See results in " << compromised_file << " and ";
+    cout << duplicates_file << endl;
+}
+
+/* The manifest TREE_DIR/manifest.txt holds one "<key> <value>" per line. It
+ * stores the shape of the tree (keys 'levels' and 'ints_per_floor'), so that
+ * the stored tree can be reused by a later run or pipeline stage without
+ * recomputing it, plus any other key set with manifest_set.
+ */
+/* read_key_value_file loads a file of "<key> <value>" lines, such as the
+ * manifest. A missing file is empty.
+ */
+std::map<string, string> read_key_value_file(string path) {
+    std::map<string, string> entries;
+    std::ifstream file(path);
+    string key, value;
+    while (file >> key) {
+        std::getline(file, value);
+        boost::trim(value);
+        entries[key] = value;
+    }
+    return entries;
+}
+
+// write_key_value_file replaces the file at 'path' atomically.
+void write_key_value_file(string path,
+        const std::map<string, string> &entries) {
+    std::ofstream file(path + ".tmp");
+    for (auto const &entry : entries) {
+        file << entry.first << " " << entry.second << "\n";
+    }
+    file.close();
+    rename((path + ".tmp").c_str(), path.c_str());
+}
+
+static std::map<string, string> read_manifest_map() {
+    return read_key_value_file(TREE_DIR + "/manifest.txt");
+}
+
+static void write_manifest_map(const std::map<string, string> &manifest) {
+    write_key_value_file(TREE_DIR + "/manifest.txt", manifest);
+}
+
+// manifest_get returns the value of 'key' in the manifest, or "" if unset.
+string manifest_get(string key) {
+    std::map<string, string> manifest = read_manifest_map();
+    return manifest.count(key) ? manifest[key] : "";
+}
+
+void manifest_set(string key, string value) {
+    std::map<string, string> manifest = read_manifest_map();
+    manifest[key] = value;
+    write_manifest_map(manifest);
+}
+
+// write_tree_manifest stores intsPerFloor, keeping the other keys.
+void write_tree_manifest() {
+    std::map<string, string> manifest = read_manifest_map();
+    manifest["levels"] = to_string(intsPerFloor.size());
+    string ints = "";
+    for (unsigned int l = 0; l < intsPerFloor.size(); l++) {
+        ints += (l ? " " : "") + to_string(intsPerFloor[l]);
+    }
+    manifest["ints_per_floor"] = ints;
+    manifest["stripes"] = boost::algorithm::join(STORAGE_DIRS, ",");
+    manifest["stride"] = to_string(LEVEL_STRIDE);
+    write_manifest_map(manifest);
+}
+
+/* read_tree_manifest loads the shape of the tree stored in TREE_DIR into
+ * intsPerFloor, and returns the amount of levels.
+ */
+int read_tree_manifest() {
+    std::map<string, string> manifest = read_manifest_map();
+    if (manifest.empty()) {
+        cout << "Fatal error: no product tree manifest in " << TREE_DIR << endl;
+        throw std::exception();
+    }
+    unsigned int levels = std::stoul("0" + manifest["levels"]);
+    LEVEL_STRIDE = std::max(1UL, std::stoul("0" + manifest["stride"]));
+    STORAGE_DIRS.clear();
+    if (manifest["stripes"] != "") {
+        boost::split(STORAGE_DIRS, manifest["stripes"], boost::is_any_of(","));
+    }
+    std::istringstream ints(manifest["ints_per_floor"]);
+    intsPerFloor.clear();
+    uint64_t count;
+    while (ints >> count) {
+        intsPerFloor.push_back(count);
+    }
+    if (levels == 0 || intsPerFloor.size() != levels) {
+        cout << "Fatal error: corrupted manifest in " << TREE_DIR << endl;
+        throw std::exception();
+    }
+    return levels;
+}
+
+// write_ids stores the IDs of the leaves in TREE_DIR/<name>.
+void write_ids(vector<string> *IDs, string name) {
+    std::ofstream file(TREE_DIR + "/" + name);
+    for (size_t i = 0; i < IDs->size(); i++) {
+        file << (*IDs)[i] << "\n";
+    }
+    file.close();
+}
+
+// read_ids loads the IDs of the leaves from TREE_DIR/<name>.
+void read_ids(vector<string> *IDs, string name) {
+    std::ifstream file(TREE_DIR + "/" + name);
+    if (!file) {
+        cout << "Fatal error: no IDs stored in " << TREE_DIR << endl;
+        throw std::exception();
+    }
+    vector<string>().swap(*IDs);
+    string id;
+    while (std::getline(file, id)) {
+        IDs->push_back(id);
+    }
+}
+
+/* write_remainders_to_file stores the output of Part (B) in
+ * TREE_DIR/remainders.gmp, so that Part (C) can run separately.
+ */
+void write_remainders_to_file(vector<mpz_class> *R) {
+    string path = TREE_DIR + "/remainders.gmp";
+    cout << "   Writing remainders to " << path << endl;
+    FILE* file = fopen(path.c_str(), "wb");
+    assert(file);
+    for (size_t i = 0; i < R->size(); i++) {
+        write_raw(file, (*R)[i].get_mpz_t());
+    }
+    fclose(file);
+}
+
+// read_remainders_from_file loads the intsPerFloor[0] stored remainders.
+void read_remainders_from_file(vector<mpz_class> *R) {
+    string path = TREE_DIR + "/remainders.gmp";
+    cout << "   Reading remainders from " << path << endl;
+    FILE* file = fopen(path.c_str(), "rb");
+    if (!file) {
+        cout << "Fatal error: no remainders in " << TREE_DIR << endl;
+        throw std::exception();
+    }
+    R->resize(intsPerFloor[0]);
+    for (size_t i = 0; i < R->size(); i++) {
+        read_raw((*R)[i].get_mpz_t(), file);
+    }
+    fclose(file);
+}
+
 void my_mpz_inp_raw(mpz_class* x, FILE* file) {
     std::ifstream source("eraseme.txt", std::ios_base::binary);
     int byte, next_byte;
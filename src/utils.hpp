@@ -1,7 +1,10 @@
 #ifndef SRC_UTILS_HPP_
 #define SRC_UTILS_HPP_
 
+#include <deque>
+#include <fstream>
 #include <iostream>
+#include <map>
 #include <string>
 #include <vector>
 #include <gmp.h>
@@ -15,20 +18,114 @@ extern int N_THREADS;
 using std::vector;
 using std::string;
 
+extern string TREE_DIR;
+extern vector<string> STORAGE_DIRS;
+extern bool KEEP_LEVELS;
+extern unsigned int LEVEL_STRIDE;
+extern uint64_t DISK_BUDGET;
+extern vector<uint64_t> intsPerFloor;
+
 void read_moduli_from_csv(string, vector<mpz_class>*, vector<string>*, int);
-int product_tree(vector<mpz_class>*);
+void read_moduli_range_from_csv(string, vector<mpz_class>*, vector<string>*,
+        int, size_t, size_t, int64_t offset = -1);
+size_t count_moduli_in_csv(string);
+vector<int64_t> csv_record_offsets(string, const vector<size_t> &);
+unsigned int level_stripes();
+size_t stripe_begin(size_t, unsigned int);
+unsigned int stripe_of(int, size_t);
+string stripe_dir(unsigned int);
+string level_filename(int, unsigned int s = 0);
+string index_filename(int);
+void delete_level(int);
+void check_free_space(vector<mpz_class> *);
+int tree_levels(size_t);
+bool level_stored(int, int);
+void choose_level_stride(vector<mpz_class> *);
+void ensure_level(int);
+
+/* level_stream reads the integers of a stored level sequentially, across its
+ * stripes.
+ */
+struct level_stream {
+    int level;
+    unsigned int stripe;
+    size_t pos, end;
+    FILE *file;
+
+    explicit level_stream(int l);
+    ~level_stream();
+    void next(mpz_ptr x);
+
+ private:
+    void open();
+};
+
+/* level_prefetcher reads a level from a dedicated thread into a bounded queue,
+ * ahead of the workers consuming it, so that disk and CPU overlap. Integers
+ * are handed out in groups of 'group' consecutive nodes (e.g. 2 for pairs of
+ * siblings); the last group may be shorter.
+ */
+class level_prefetcher {
+ public:
+    level_prefetcher(int l, unsigned int group, size_t capacity);
+    ~level_prefetcher();
+    // next pops the next group and the position of its first node, and
+    // returns false once the level is exhausted.
+    bool next(size_t *first, vector<mpz_class> *values);
+
+ private:
+    void read();
+
+    level_stream stream;
+    unsigned int group;
+    size_t capacity;
+    std::deque<std::pair<size_t, vector<mpz_class>>> queue;
+    bool done;
+    boost::mutex mutex;
+    boost::condition_variable not_empty, not_full;
+    boost::thread reader;
+};
+int product_tree(vector<mpz_class>*, bool write_leaves = true);
 int product_tree_multithread(vector<mpz_class>*);
 int product_tree_seq(vector<mpz_class>*);
+void product_tree_in_memory(vector<mpz_class> *, vector<vector<mpz_class>> *,
+        bool multithread = true);
+void remainders_in_memory(vector<vector<mpz_class>> *, const mpz_class &,
+        vector<mpz_class> *, bool square = false);
 void write_level_to_file(int l, vector<mpz_class> *);
 void read_level_from_file(int, vector<mpz_class> *);
-void read_variable_from_file(int level, int index, mpz_class *x);
+void read_variable_from_file(int level, uint64_t index, mpz_class *x);
 void remainders_squares(int, vector<mpz_class> *);
 void remainders_squares_simple(int, vector<mpz_class> *);
 void remainders_squares_fast(int, vector<mpz_class> *);
+void remainders_squares_from_level(int, vector<mpz_class> *);
 void remainders_squares_fast_multithread(int levels, vector<mpz_class> *R);
 void remainders_squares_fast_seq(int levels, vector<mpz_class> *R);
 void mt_level_mult(vector<mpz_class> *, vector<mpz_class> *);
-void partial_remainders(int, vector<mpz_class>*, vector<mpz_class>*);
+void product_of(vector<mpz_class> *, mpz_class *);
+void remainders_mod(int, const mpz_class &, vector<mpz_class> *);
+void remainders_cofactors(int, vector<mpz_class> *);
+class spill_chunks;
+void partial_cofactors(int, vector<mpz_class> *, vector<mpz_class> *,
+        spill_chunks *, spill_chunks *);
+void partial_remainders(int, vector<mpz_class>*, vector<mpz_class>*,
+        spill_chunks *, spill_chunks *, bool square = true);
+void final_gcds(vector<mpz_class> *, vector<mpz_class> *);
+void cofactor_gcds(vector<mpz_class> *, vector<mpz_class> *);
+size_t classify_results(vector<mpz_class> *, vector<mpz_class> *,
+        vector<string> *, vector<string> *, vector<string> *);
+void report_results(size_t, vector<string> *, vector<string> *, size_t,
+        string suffix = "");
+void write_tree_manifest();
+int read_tree_manifest();
+void write_remainders_to_file(vector<mpz_class> *);
+void read_remainders_from_file(vector<mpz_class> *);
+std::map<string, string> read_key_value_file(string);
+void write_key_value_file(string, const std::map<string, string> &);
+string manifest_get(string);
+void manifest_set(string, string);
+void write_ids(vector<string> *, string name = "ids.txt");
+void read_ids(vector<string> *, string name = "ids.txt");
 
 void my_mpz_inp_raw(mpz_class &, FILE *);
 